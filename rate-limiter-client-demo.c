@@ -0,0 +1,221 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-client-demo.c
+ *
+ * DESCRIPTION:
+ *   Sample usage of the pipelined client library against rl-server.
+ *
+ * NOTES:
+ *   1. Runs the same load three times over one shared connection: with
+ *      blocking rlc_admit() calls from every thread, with futures
+ *      submitted in groups of FUTURE_GROUP, and with callbacks that
+ *      keep the connection filled up to RLC_MAX_INFLIGHT.
+ *
+ *   Usage: rl-client [-a addr] [-p port] [-c threads] [-n tenants]
+ *                    [-s seconds]
+ *
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rate-limiter-client.h"
+
+#define MAX_THREADS 256
+#define FUTURE_GROUP 64
+
+#define MODE_BLOCKING 0
+#define MODE_FUTURE 1
+#define MODE_CALLBACK 2
+
+static const char* mode_names[] = { "blocking", "future", "callback" };
+
+typedef struct
+{
+  _Atomic unsigned long allowed;
+  _Atomic unsigned long denied;
+  _Atomic unsigned long errors;
+} totals_t;
+
+typedef struct
+{
+  pthread_t thread;
+  rl_client_t* client;
+  totals_t* totals;
+  int mode;
+  unsigned int tenants;
+  unsigned int seed;
+  long end_time_ms;
+} worker_t;
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+static void
+count_status(totals_t* t, int status)
+{
+  switch (status) {
+    case RL_STATUS_ALLOWED:
+      atomic_fetch_add_explicit(&t->allowed, 1, memory_order_relaxed);
+      break;
+    case RL_STATUS_DENIED:
+      atomic_fetch_add_explicit(&t->denied, 1, memory_order_relaxed);
+      break;
+    default:
+      atomic_fetch_add_explicit(&t->errors, 1, memory_order_relaxed);
+  }
+}
+
+static void
+on_result(void* arg, int status, long retry_after)
+{
+  (void)retry_after;
+  count_status((totals_t*)arg, status);
+}
+
+void*
+worker_thread(void* arg)
+{
+  worker_t* w = (worker_t*)arg;
+  rlc_future_t futures[FUTURE_GROUP];
+  long retry_after;
+  uint32_t tenant_id;
+
+  for (int i = 0; i < FUTURE_GROUP; i++)
+    rlc_future_init(&futures[i]);
+
+  while (get_current_time_ms() < w->end_time_ms) {
+    switch (w->mode) {
+      case MODE_BLOCKING:
+        tenant_id = rand_r(&w->seed) % w->tenants;
+        count_status(w->totals, rlc_admit(w->client, tenant_id, &retry_after));
+        break;
+
+      case MODE_FUTURE:
+        for (int i = 0; i < FUTURE_GROUP; i++) {
+          tenant_id = rand_r(&w->seed) % w->tenants;
+          rlc_admit_future(w->client, tenant_id, &futures[i]);
+        }
+        for (int i = 0; i < FUTURE_GROUP; i++)
+          count_status(w->totals, rlc_future_wait(&futures[i], &retry_after));
+        break;
+
+      case MODE_CALLBACK:
+        /* submits block once RLC_MAX_INFLIGHT are outstanding */
+        for (int i = 0; i < FUTURE_GROUP; i++) {
+          tenant_id = rand_r(&w->seed) % w->tenants;
+          if (0 != rlc_admit_async(w->client, tenant_id, on_result, w->totals))
+            return NULL;
+        }
+        break;
+    }
+  }
+
+  for (int i = 0; i < FUTURE_GROUP; i++)
+    rlc_future_destroy(&futures[i]);
+
+  return NULL;
+}
+
+static int
+run(const char* addr, int port, int mode, int nthreads, int tenants,
+    int seconds)
+{
+  static worker_t workers[MAX_THREADS];
+  totals_t totals;
+  rl_client_t* client;
+  long start_ms, elapsed_ms;
+  unsigned long allowed, denied;
+
+  client = rlc_connect(addr, port);
+  if (NULL == client) {
+    fprintf(stderr, "rl-client: cannot connect to %s:%d\n", addr, port);
+    return 1;
+  }
+
+  memset(&totals, 0, sizeof(totals));
+  start_ms = get_current_time_ms();
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].client = client;
+    workers[i].totals = &totals;
+    workers[i].mode = mode;
+    workers[i].tenants = tenants;
+    workers[i].seed = time(NULL) + i;
+    workers[i].end_time_ms = start_ms + seconds * 1000L;
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(workers[i].thread, NULL);
+  rlc_close(client); /* waits for the callbacks still outstanding */
+  elapsed_ms = get_current_time_ms() - start_ms;
+
+  allowed = atomic_load(&totals.allowed);
+  denied = atomic_load(&totals.denied);
+  printf("%-8s allowed: %lu, denied: %lu, errors: %lu, decisions/sec: %.0f\n",
+         mode_names[mode],
+         allowed,
+         denied,
+         atomic_load(&totals.errors),
+         (allowed + denied) * 1000.0 / elapsed_ms);
+
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  /* Sample usage.
+   * - start rl-server, then run rl-client against it
+   * - nthreads callers share one rl_client_t in each mode
+   */
+
+  const char* addr = "127.0.0.1";
+  int port = RL_PROTO_PORT, nthreads = 4, tenants = 1000, seconds = 3, opt;
+
+  while (-1 != (opt = getopt(argc, argv, "a:p:c:n:s:"))) {
+    switch (opt) {
+      case 'a':
+        addr = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        nthreads = atoi(optarg);
+        break;
+      case 'n':
+        tenants = atoi(optarg);
+        break;
+      case 's':
+        seconds = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-a addr] [-p port] [-c threads] [-n tenants] "
+                "[-s seconds]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (nthreads < 1 || nthreads > MAX_THREADS || tenants < 1) {
+    fprintf(stderr, "rl-client: invalid arguments\n");
+    return 1;
+  }
+
+  for (int mode = MODE_BLOCKING; mode <= MODE_CALLBACK; mode++) {
+    if (0 != run(addr, port, mode, nthreads, tenants, seconds))
+      return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,413 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-client.c
+ *
+ * DESCRIPTION:
+ *   Pipelined client library for the binary admit protocol, see
+ *   rate-limiter-client.h for the API.
+ *
+ * NOTES:
+ *   1. Submitters only take the client lock to assign a seq, park the
+ *      callback in pending[seq % RLC_MAX_INFLIGHT] and append the record
+ *      to the send queue. The writer swaps the queue for an empty one
+ *      and sends it as back to back frames, so everything queued while
+ *      the previous send was in progress goes out in one write.
+ *
+ *   2. The server answers the frames of a connection in order, hence
+ *      the outstanding seqs are always the inflight ones just below
+ *      next_seq and a pending slot is never reused while still in use.
+ *      The reader still checks the echoed seq of every result.
+ *
+ *   3. The reader runs the callbacks of a whole result frame and then
+ *      takes the lock once to release their inflight slots.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "rate-limiter-client.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define PENDING_MASK (RLC_MAX_INFLIGHT - 1)
+#define MAX_QUEUE_FRAMES (RLC_MAX_INFLIGHT / RL_MAX_BATCH)
+#define RECV_BUF_SIZE (4 * RL_MAX_FRAME)
+
+typedef struct
+{
+  rlc_callback_t cb;
+  void* arg;
+} pending_t;
+
+struct rl_client
+{
+  int fd;
+  pthread_t writer;
+  pthread_t reader;
+
+  pthread_mutex_t lock;
+  pthread_cond_t has_work; /* writer: records queued, closing or broken */
+  pthread_cond_t has_room; /* submitters and close: inflight dropped */
+  int closing;
+  int broken;
+  uint32_t next_seq;
+  unsigned int inflight; /* queued or sent, not yet completed */
+  unsigned int queued;
+  rl_admit_req_t* queue; /* records not yet handed to the writer */
+  rl_admit_req_t* spare;
+
+  pending_t pending[RLC_MAX_INFLIGHT];
+};
+
+static int
+send_all(int fd, const unsigned char* buf, size_t len)
+{
+  ssize_t n;
+
+  while (len) {
+    n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (EINTR == errno)
+        continue;
+      return FAILURE;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return SUCCESS;
+}
+
+/*
+ * Mark c down and complete every outstanding request with
+ * RL_STATUS_ERROR. Called by the reader once the connection is gone.
+ */
+static void
+fail_all(rl_client_t* c)
+{
+  uint32_t seq, end;
+  pending_t p;
+
+  pthread_mutex_lock(&c->lock);
+  c->broken = 1;
+  end = c->next_seq;
+  seq = end - c->inflight;
+  c->inflight = 0;
+  c->queued = 0;
+  pthread_cond_broadcast(&c->has_work);
+  pthread_cond_broadcast(&c->has_room);
+  pthread_mutex_unlock(&c->lock);
+
+  /* no new seq is assigned once broken is set */
+  for (; seq != end; seq++) {
+    p = c->pending[seq & PENDING_MASK];
+    p.cb(p.arg, RL_STATUS_ERROR, 0);
+  }
+}
+
+static void*
+writer_thread(void* arg)
+{
+  rl_client_t* c = (rl_client_t*)arg;
+  unsigned char* out;
+  rl_admit_req_t* batch;
+  unsigned int count, n;
+  size_t len;
+
+  out = (unsigned char*)malloc(MAX_QUEUE_FRAMES * RL_MAX_FRAME);
+  if (NULL == out) {
+    shutdown(c->fd, SHUT_RDWR);
+    return NULL;
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&c->lock);
+    while (0 == c->queued && !c->closing && !c->broken)
+      pthread_cond_wait(&c->has_work, &c->lock);
+    if (c->broken || (c->closing && 0 == c->queued)) {
+      pthread_mutex_unlock(&c->lock);
+      break;
+    }
+    batch = c->queue;
+    count = c->queued;
+    c->queue = c->spare;
+    c->spare = batch;
+    c->queued = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    /* the records are already in wire order, add a header per frame */
+    len = 0;
+    for (unsigned int i = 0; i < count; i += n) {
+      n = count - i < RL_MAX_BATCH ? count - i : RL_MAX_BATCH;
+      rl_frame_init((rl_frame_hdr_t*)(out + len), RL_OP_ADMIT, n);
+      len += sizeof(rl_frame_hdr_t);
+      memcpy(out + len, batch + i, n * sizeof(rl_admit_req_t));
+      len += n * sizeof(rl_admit_req_t);
+    }
+
+    if (SUCCESS != send_all(c->fd, out, len)) {
+      shutdown(c->fd, SHUT_RDWR); /* the reader fails the rest */
+      break;
+    }
+  }
+
+  free(out);
+  return NULL;
+}
+
+/* Run the callbacks of one result frame, return how many matched */
+static uint32_t
+complete_frame(rl_client_t* c, const unsigned char* buf, uint32_t expected)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)buf;
+  const rl_admit_resp_t* resp = (const rl_admit_resp_t*)(hdr + 1);
+  uint32_t count = RL_LE32(hdr->count);
+  uint32_t seq;
+  pending_t* p;
+
+  /* expected is the oldest outstanding seq, see the notes above */
+  for (uint32_t i = 0; i < count; i++, expected++) {
+    seq = RL_LE32(resp[i].seq);
+    if (seq != expected)
+      return i;
+    p = &c->pending[seq & PENDING_MASK];
+    p->cb(p->arg, RL_LE16(resp[i].status), RL_LE16(resp[i].retry_after));
+  }
+
+  return count;
+}
+
+static void*
+reader_thread(void* arg)
+{
+  rl_client_t* c = (rl_client_t*)arg;
+  unsigned char in[RECV_BUF_SIZE];
+  size_t in_len = 0, off, len;
+  uint32_t count, done, expected;
+  ssize_t n;
+
+  for (;;) {
+    n = recv(c->fd, in + in_len, sizeof(in) - in_len, 0);
+    if (n <= 0) {
+      if (n < 0 && EINTR == errno)
+        continue;
+      break;
+    }
+    in_len += n;
+
+    off = 0;
+    while (in_len - off >= sizeof(rl_frame_hdr_t)) {
+      len = rl_frame_len((rl_frame_hdr_t*)(in + off), RL_OP_RESULT);
+      if (0 == len)
+        goto done;
+      if (in_len - off < len)
+        break;
+
+      pthread_mutex_lock(&c->lock);
+      expected = c->next_seq - c->inflight;
+      pthread_mutex_unlock(&c->lock);
+      count = RL_LE32(((rl_frame_hdr_t*)(in + off))->count);
+      done = complete_frame(c, in + off, expected);
+
+      pthread_mutex_lock(&c->lock);
+      c->inflight -= done;
+      pthread_cond_broadcast(&c->has_room);
+      pthread_mutex_unlock(&c->lock);
+
+      if (done != count)
+        goto done;
+      off += len;
+    }
+    memmove(in, in + off, in_len - off);
+    in_len -= off;
+  }
+
+done:
+  fail_all(c);
+  return NULL;
+}
+
+rl_client_t*
+rlc_connect(const char* addr, int port)
+{
+  struct sockaddr_in sa;
+  rl_client_t* c;
+  int one = 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  if (1 != inet_pton(AF_INET, addr, &sa.sin_addr))
+    return NULL;
+
+  c = (rl_client_t*)calloc(1, sizeof(rl_client_t));
+  if (NULL == c)
+    return NULL;
+  c->queue =
+    (rl_admit_req_t*)malloc(RLC_MAX_INFLIGHT * sizeof(rl_admit_req_t));
+  c->spare =
+    (rl_admit_req_t*)malloc(RLC_MAX_INFLIGHT * sizeof(rl_admit_req_t));
+  if (NULL == c->queue || NULL == c->spare)
+    goto fail;
+
+  c->fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->fd < 0)
+    goto fail;
+  if (connect(c->fd, (const struct sockaddr*)&sa, sizeof(sa)) < 0) {
+    close(c->fd);
+    goto fail;
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->has_work, NULL);
+  pthread_cond_init(&c->has_room, NULL);
+  pthread_create(&c->writer, NULL, writer_thread, c);
+  pthread_create(&c->reader, NULL, reader_thread, c);
+
+  return c;
+
+fail:
+  free(c->queue);
+  free(c->spare);
+  free(c);
+  return NULL;
+}
+
+void
+rlc_close(rl_client_t* c)
+{
+  if (NULL == c)
+    return;
+
+  pthread_mutex_lock(&c->lock);
+  c->closing = 1;
+  pthread_cond_signal(&c->has_work);
+  while (c->inflight && !c->broken)
+    pthread_cond_wait(&c->has_room, &c->lock);
+  pthread_mutex_unlock(&c->lock);
+
+  shutdown(c->fd, SHUT_RDWR);
+  pthread_join(c->writer, NULL);
+  pthread_join(c->reader, NULL);
+  close(c->fd);
+
+  pthread_cond_destroy(&c->has_room);
+  pthread_cond_destroy(&c->has_work);
+  pthread_mutex_destroy(&c->lock);
+  free(c->queue);
+  free(c->spare);
+  free(c);
+}
+
+int
+rlc_admit_async(rl_client_t* c,
+                uint32_t tenant_id,
+                rlc_callback_t cb,
+                void* arg)
+{
+  uint32_t seq;
+
+  pthread_mutex_lock(&c->lock);
+  while (c->inflight >= RLC_MAX_INFLIGHT && !c->broken)
+    pthread_cond_wait(&c->has_room, &c->lock);
+  if (c->broken || c->closing) {
+    pthread_mutex_unlock(&c->lock);
+    return -1;
+  }
+
+  seq = c->next_seq++;
+  c->pending[seq & PENDING_MASK].cb = cb;
+  c->pending[seq & PENDING_MASK].arg = arg;
+  c->queue[c->queued].seq = RL_LE32(seq);
+  c->queue[c->queued].tenant_id = RL_LE32(tenant_id);
+  c->inflight++;
+
+  /* the writer only sleeps on an empty queue */
+  if (1 == ++c->queued)
+    pthread_cond_signal(&c->has_work);
+  pthread_mutex_unlock(&c->lock);
+
+  return 0;
+}
+
+/* Futures */
+
+static void
+future_complete(void* arg, int status, long retry_after)
+{
+  rlc_future_t* f = (rlc_future_t*)arg;
+
+  pthread_mutex_lock(&f->lock);
+  f->status = status;
+  f->retry_after = retry_after;
+  f->done = 1;
+  pthread_cond_signal(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+void
+rlc_future_init(rlc_future_t* f)
+{
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  f->done = 0;
+  f->status = RL_STATUS_ERROR;
+  f->retry_after = 0;
+}
+
+void
+rlc_future_destroy(rlc_future_t* f)
+{
+  pthread_cond_destroy(&f->cond);
+  pthread_mutex_destroy(&f->lock);
+}
+
+int
+rlc_admit_future(rl_client_t* c, uint32_t tenant_id, rlc_future_t* f)
+{
+  f->done = 0;
+  if (0 != rlc_admit_async(c, tenant_id, future_complete, f)) {
+    f->status = RL_STATUS_ERROR;
+    f->done = 1;
+    return -1;
+  }
+
+  return 0;
+}
+
+int
+rlc_future_wait(rlc_future_t* f, long* retry_after)
+{
+  pthread_mutex_lock(&f->lock);
+  while (!f->done)
+    pthread_cond_wait(&f->cond, &f->lock);
+  pthread_mutex_unlock(&f->lock);
+
+  if (retry_after)
+    *retry_after = f->retry_after;
+  return f->status;
+}
+
+int
+rlc_admit(rl_client_t* c, uint32_t tenant_id, long* retry_after)
+{
+  rlc_future_t f;
+  int status;
+
+  rlc_future_init(&f);
+  rlc_admit_future(c, tenant_id, &f);
+  status = rlc_future_wait(&f, retry_after);
+  rlc_future_destroy(&f);
+
+  return status;
+}
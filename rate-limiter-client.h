@@ -0,0 +1,76 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-client.h
+ *
+ * DESCRIPTION:
+ *   Pipelined client library for the binary admit protocol of
+ *   rate-limiter-proto.h (rl-server, rl-uring).
+ *
+ * NOTES:
+ *   1. One rl_client_t owns one TCP connection and may be shared by any
+ *      number of threads. Requests of concurrent callers are coalesced
+ *      into RL_OP_ADMIT frames of up to RL_MAX_BATCH records by a writer
+ *      thread, and results are matched back to their callers by seq by
+ *      a reader thread, so many decisions are in flight per round trip.
+ *
+ *   2. rlc_admit() blocks until the decision arrives. rlc_admit_async()
+ *      returns at once and runs a callback from the reader thread; the
+ *      callback must neither block nor submit on the same client.
+ *      rlc_future_t wraps the async call for callers that want to
+ *      submit several requests and wait later.
+ *
+ *   3. At most RLC_MAX_INFLIGHT requests are outstanding per client;
+ *      further submits wait for room. If the connection fails, every
+ *      outstanding request completes with RL_STATUS_ERROR and later
+ *      submits fail.
+ *
+ */
+
+#ifndef RATE_LIMITER_CLIENT_H
+#define RATE_LIMITER_CLIENT_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rate-limiter-proto.h"
+
+#define RLC_MAX_INFLIGHT 65536 /* Power of two         */
+
+typedef struct rl_client rl_client_t;
+
+/* status is one of RL_STATUS_*, retry_after in miliseconds */
+typedef void (*rlc_callback_t)(void* arg, int status, long retry_after);
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int done;
+  int status;
+  long retry_after;
+} rlc_future_t;
+
+/* Connect to addr:port, NULL on failure */
+rl_client_t* rlc_connect(const char* addr, int port);
+
+/* Wait for outstanding requests, then disconnect and free c */
+void rlc_close(rl_client_t* c);
+
+/* Blocking admit, returns one of RL_STATUS_* */
+int rlc_admit(rl_client_t* c, uint32_t tenant_id, long* retry_after);
+
+/* Queue an admit; 0 if queued, -1 if c is down (cb is then not run) */
+int rlc_admit_async(rl_client_t* c,
+                    uint32_t tenant_id,
+                    rlc_callback_t cb,
+                    void* arg);
+
+void rlc_future_init(rlc_future_t* f);
+void rlc_future_destroy(rlc_future_t* f);
+
+/* As rlc_admit_async(); an initialized f is completed with the result */
+int rlc_admit_future(rl_client_t* c, uint32_t tenant_id, rlc_future_t* f);
+
+/* Wait for f to complete, returns one of RL_STATUS_* */
+int rlc_future_wait(rlc_future_t* f, long* retry_after);
+
+#endif /* RATE_LIMITER_CLIENT_H */
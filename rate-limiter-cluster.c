@@ -0,0 +1,812 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-cluster.c
+ *
+ * DESCRIPTION:
+ *   Sample sharded sliding window rate limiter cluster. Every tenant is
+ *   owned by exactly one limiter node, picked by a consistent-hash
+ *   ring, so limits stay exact however many nodes there are.
+ *
+ * NOTES:
+ *   1. The ring has VNODES points per node, placed by hashing (node,
+ *      vnode); a tenant belongs to the first point at or after its own
+ *      hash. Adding or removing a node only moves the tenants that land
+ *      on its points, about 1/N of them, and spreads them over all
+ *      other nodes.
+ *
+ *   2. The router keeps the ring and one pipelined rl_client_t per node
+ *      (rate-limiter-client.h), and sends each decision straight to the
+ *      tenant's owner. Nodes answer admits for tenants they do not own
+ *      with RL_STATUS_MOVED, and the router retries on its current
+ *      ring.
+ *
+ *   3. A membership change is an RL_OP_MEMBERS frame to every node.
+ *      A node that loses tenants stops serving them (RL_STATUS_MOVED),
+ *      sends their windows to the new owners as RL_OP_STATE frames and
+ *      waits for them to be applied before acknowledging. The router
+ *      switches to the new ring only once every node has acknowledged,
+ *      so no window is ever served from two places. Only the moved
+ *      tenants are touched; all others keep being served throughout.
+ *
+ *   4. Nodes are single processes with a thread per connection; the
+ *      window of each tenant is a fixed ring of MAX_REQ timestamps
+ *      behind its own qlock, as in rate-limiter-server.c.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rate-limiter-client.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 10000 /* Active tenants       */
+#define WINDOW_SIZE 1000  /* Miliseconds (1s)     */
+#define MAX_REQ 20
+
+#define MAX_NODES 16
+#define VNODES 64
+#define CLUSTER_PORT 7200 /* node i listens on CLUSTER_PORT + i */
+#define CONN_BUF_SIZE (4 * RL_MAX_FRAME)
+
+#define TEST_NUM_NODES 4 /* node 3 joins, node 1 leaves */
+#define TEST_NUM_TENANTS 1000
+#define TEST_NUM_THREADS 4
+#define TEST_DURATION 4000 /* Miliseconds          */
+#define TEST_JOIN_TIME 1500
+#define TEST_LEAVE_TIME 3000
+#define TEST_GROUP 64
+
+/* Consistent-hash ring */
+
+typedef struct
+{
+  uint64_t point;
+  uint32_t node_id;
+} vnode_t;
+
+typedef struct
+{
+  int num_points;
+  int num_nodes;
+  rl_member_rec_t members[MAX_NODES];
+  vnode_t points[MAX_NODES * VNODES];
+} ring_t;
+
+static inline uint64_t
+mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static int
+vnode_cmp(const void* a, const void* b)
+{
+  uint64_t x = ((const vnode_t*)a)->point, y = ((const vnode_t*)b)->point;
+
+  return (x > y) - (x < y);
+}
+
+void
+ring_build(ring_t* ring, const rl_member_rec_t* members, int num_nodes)
+{
+  ring->num_nodes = num_nodes;
+  ring->num_points = 0;
+  for (int i = 0; i < num_nodes; i++) {
+    ring->members[i] = members[i];
+    for (uint64_t v = 0; v < VNODES; v++) {
+      ring->points[ring->num_points].point =
+        mix64((uint64_t)members[i].node_id << 32 | v);
+      ring->points[ring->num_points++].node_id = members[i].node_id;
+    }
+  }
+  qsort(ring->points, ring->num_points, sizeof(vnode_t), vnode_cmp);
+}
+
+/* Owner of tenant_id, or -1 on an empty ring */
+int
+ring_owner(const ring_t* ring, uint32_t tenant_id)
+{
+  uint64_t h = mix64(tenant_id ^ 0x9e3779b97f4a7c15ULL);
+  int lo = 0, hi = ring->num_points, mid;
+
+  if (0 == ring->num_points)
+    return -1;
+
+  /* first point >= h, wrapping around */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (ring->points[mid].point < h)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return ring->points[lo == ring->num_points ? 0 : lo].node_id;
+}
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/* Blocking framed I/O, used for control traffic */
+
+static int
+send_all(int fd, const void* buf, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)buf;
+  ssize_t n;
+
+  while (len) {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (EINTR == errno)
+        continue;
+      return FAILURE;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return SUCCESS;
+}
+
+static int
+recv_all(int fd, void* buf, size_t len)
+{
+  unsigned char* p = (unsigned char*)buf;
+  ssize_t n;
+
+  while (len) {
+    n = recv(fd, p, len, 0);
+    if (n <= 0) {
+      if (n < 0 && EINTR == errno)
+        continue;
+      return FAILURE;
+    }
+    p += n;
+    len -= n;
+  }
+
+  return SUCCESS;
+}
+
+static int
+connect_node(int port)
+{
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+}
+
+/* Send a frame of 8 byte records and wait for its empty result */
+static int
+call_node(int fd, uint8_t op, const void* recs, uint32_t count)
+{
+  unsigned char buf[RL_MAX_FRAME];
+  rl_frame_hdr_t* hdr = (rl_frame_hdr_t*)buf;
+
+  rl_frame_init(hdr, op, count);
+  memcpy(hdr + 1, recs, count * 8);
+  if (SUCCESS != send_all(fd, buf, sizeof(*hdr) + count * 8) ||
+      SUCCESS != recv_all(fd, hdr, sizeof(*hdr)) ||
+      sizeof(*hdr) != rl_frame_len(hdr, RL_OP_RESULT))
+    return FAILURE;
+
+  return SUCCESS;
+}
+
+/* Limiter node */
+
+typedef struct
+{
+  pthread_mutex_t qlock;
+  int owned;
+  unsigned int head;
+  unsigned int size;
+  long slots[MAX_REQ];
+} tenant_t;
+
+typedef struct
+{
+  uint32_t id;
+  pthread_mutex_t ring_lock; /* one membership change at a time */
+  ring_t ring;
+  tenant_t tenants[MAX_TENANTS];
+  _Atomic uint32_t* truth; /* test ground truth, see main() */
+  long start_ms;
+} node_t;
+
+static node_t node;
+
+static int
+check_tenant_allowed(tenant_t* t, long timestamp)
+{
+  int result;
+
+  pthread_mutex_lock(&t->qlock);
+  if (!t->owned) {
+    pthread_mutex_unlock(&t->qlock);
+    return RL_STATUS_MOVED;
+  }
+  while (t->size && (timestamp - t->slots[t->head] >= WINDOW_SIZE)) {
+    t->head = (t->head + 1) % MAX_REQ;
+    t->size--;
+  }
+  if (t->size < MAX_REQ) {
+    t->slots[(t->head + t->size) % MAX_REQ] = timestamp;
+    t->size++;
+    result = RL_STATUS_ALLOWED;
+  } else {
+    result = RL_STATUS_DENIED;
+  }
+  pthread_mutex_unlock(&t->qlock);
+
+  return result;
+}
+
+static size_t
+node_admit(const unsigned char* in, unsigned char* out)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)in;
+  const rl_admit_req_t* req = (const rl_admit_req_t*)(hdr + 1);
+  rl_admit_resp_t* resp = (rl_admit_resp_t*)((rl_frame_hdr_t*)out + 1);
+  uint32_t count = RL_LE32(hdr->count), tenant_id;
+  long timestamp = get_current_time_ms(), elapsed;
+  int status;
+
+  rl_frame_init((rl_frame_hdr_t*)out, RL_OP_RESULT, count);
+  for (uint32_t i = 0; i < count; i++) {
+    tenant_id = RL_LE32(req[i].tenant_id);
+    status = tenant_id < MAX_TENANTS
+               ? check_tenant_allowed(&node.tenants[tenant_id], timestamp)
+               : RL_STATUS_ERROR;
+    resp[i].seq = req[i].seq;
+    resp[i].status = RL_LE16(status);
+    resp[i].retry_after = 0;
+
+    elapsed = timestamp - node.start_ms;
+    if (RL_STATUS_ALLOWED == status && tenant_id < TEST_NUM_TENANTS &&
+        elapsed >= 0 && elapsed < TEST_DURATION)
+      atomic_fetch_add(&node.truth[tenant_id * TEST_DURATION + elapsed], 1);
+  }
+
+  return sizeof(rl_frame_hdr_t) + count * sizeof(rl_admit_resp_t);
+}
+
+/* Take over windows handed over by their previous owner */
+static void
+node_state(const unsigned char* in)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)in;
+  const rl_state_rec_t* rec = (const rl_state_rec_t*)(hdr + 1);
+  uint32_t count = RL_LE32(hdr->count), tenant_id;
+  long timestamp = get_current_time_ms();
+  tenant_t* t;
+
+  /* records of a tenant come oldest first */
+  for (uint32_t i = 0; i < count; i++) {
+    tenant_id = RL_LE32(rec[i].tenant_id);
+    if (tenant_id >= MAX_TENANTS)
+      continue;
+    t = &node.tenants[tenant_id];
+    pthread_mutex_lock(&t->qlock);
+    if (t->size < MAX_REQ) {
+      t->slots[(t->head + t->size) % MAX_REQ] =
+        timestamp - RL_LE32(rec[i].age);
+      t->size++;
+    }
+    pthread_mutex_unlock(&t->qlock);
+  }
+}
+
+/* Hand the tenants moving to owner over, in frames of RL_MAX_BATCH */
+static int
+handoff(int owner, const rl_state_rec_t* recs, uint32_t count)
+{
+  uint32_t port = 0, n;
+  int fd, rc = SUCCESS;
+
+  for (int i = 0; i < node.ring.num_nodes; i++) {
+    if (node.ring.members[i].node_id == (uint32_t)owner)
+      port = node.ring.members[i].port;
+  }
+  if (0 == port || (fd = connect_node(port)) < 0)
+    return FAILURE;
+
+  for (uint32_t i = 0; i < count && SUCCESS == rc; i += n) {
+    n = count - i < RL_MAX_BATCH ? count - i : RL_MAX_BATCH;
+    rc = call_node(fd, RL_OP_STATE, recs + i, n);
+  }
+  close(fd);
+
+  return rc;
+}
+
+/* Switch to a new membership, handing over the tenants we lose */
+static int
+node_members(const unsigned char* in)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)in;
+  rl_member_rec_t members[MAX_NODES];
+  uint32_t count = RL_LE32(hdr->count);
+  static rl_state_rec_t recs[MAX_NODES][MAX_TENANTS * MAX_REQ];
+  uint32_t nrecs[MAX_NODES] = { 0 }, moved = 0;
+  long timestamp = get_current_time_ms();
+  ring_t* next;
+  tenant_t* t;
+  int owner, rc = SUCCESS;
+
+  if (count > MAX_NODES)
+    return FAILURE;
+  for (uint32_t i = 0; i < count; i++) {
+    members[i].node_id = RL_LE32(((rl_member_rec_t*)(hdr + 1))[i].node_id);
+    members[i].port = RL_LE32(((rl_member_rec_t*)(hdr + 1))[i].port);
+    if (members[i].node_id >= MAX_NODES)
+      return FAILURE;
+  }
+
+  next = (ring_t*)malloc(sizeof(ring_t));
+  if (NULL == next)
+    return FAILURE;
+  ring_build(next, members, count);
+
+  pthread_mutex_lock(&node.ring_lock);
+  for (uint32_t i = 0; i < MAX_TENANTS; i++) {
+    owner = ring_owner(next, i);
+    t = &node.tenants[i];
+    pthread_mutex_lock(&t->qlock);
+    if (t->owned && owner != (int)node.id) {
+      /* lost: stop serving it and pack its window, oldest first */
+      t->owned = 0;
+      for (unsigned int k = 0; k < t->size; k++) {
+        long age = timestamp - t->slots[(t->head + k) % MAX_REQ];
+        if (age >= WINDOW_SIZE || owner < 0)
+          continue;
+        recs[owner][nrecs[owner]].tenant_id = RL_LE32(i);
+        recs[owner][nrecs[owner]++].age = RL_LE32(age);
+      }
+      t->head = t->size = 0;
+      moved++;
+    } else if (!t->owned && owner == (int)node.id) {
+      t->owned = 1;
+    }
+    pthread_mutex_unlock(&t->qlock);
+  }
+
+  /* new owners are looked up in the new membership */
+  node.ring = *next;
+  for (int i = 0; i < MAX_NODES; i++) {
+    if (nrecs[i] && SUCCESS != handoff(i, recs[i], nrecs[i]))
+      rc = FAILURE;
+  }
+  pthread_mutex_unlock(&node.ring_lock);
+  free(next);
+
+  if (moved) {
+    printf("node %u: handed %u tenants over\n", node.id, moved);
+    fflush(stdout);
+  }
+
+  return rc;
+}
+
+static void*
+node_conn_thread(void* arg)
+{
+  int fd = (int)(intptr_t)arg;
+  unsigned char *in, *out;
+  size_t in_len = 0, off, len, out_len;
+  const rl_frame_hdr_t* hdr;
+  ssize_t n;
+
+  in = (unsigned char*)malloc(CONN_BUF_SIZE);
+  out = (unsigned char*)malloc(CONN_BUF_SIZE);
+  if (NULL == in || NULL == out)
+    goto done;
+
+  for (;;) {
+    n = recv(fd, in + in_len, CONN_BUF_SIZE - in_len, 0);
+    if (n <= 0) {
+      if (n < 0 && EINTR == errno)
+        continue;
+      break;
+    }
+    in_len += n;
+
+    off = out_len = 0;
+    while (in_len - off >= sizeof(rl_frame_hdr_t) &&
+           out_len + RL_MAX_FRAME <= CONN_BUF_SIZE) {
+      hdr = (const rl_frame_hdr_t*)(in + off);
+      len = rl_frame_len(hdr, hdr->op);
+      if (0 == len)
+        goto done;
+      if (in_len - off < len)
+        break;
+
+      switch (hdr->op) {
+        case RL_OP_ADMIT:
+          out_len += node_admit(in + off, out + out_len);
+          break;
+        case RL_OP_STATE:
+          node_state(in + off);
+          rl_frame_init((rl_frame_hdr_t*)(out + out_len), RL_OP_RESULT, 0);
+          out_len += sizeof(rl_frame_hdr_t);
+          break;
+        case RL_OP_MEMBERS:
+          if (SUCCESS != node_members(in + off))
+            goto done;
+          rl_frame_init((rl_frame_hdr_t*)(out + out_len), RL_OP_RESULT, 0);
+          out_len += sizeof(rl_frame_hdr_t);
+          break;
+        default:
+          goto done;
+      }
+      off += len;
+    }
+    memmove(in, in + off, in_len - off);
+    in_len -= off;
+
+    if (out_len && SUCCESS != send_all(fd, out, out_len))
+      break;
+  }
+
+done:
+  free(in);
+  free(out);
+  close(fd);
+  return NULL;
+}
+
+static void
+node_process(uint32_t id, long start_ms, _Atomic uint32_t* truth)
+{
+  struct sockaddr_in addr;
+  pthread_t thread;
+  int lfd, fd, one = 1;
+
+  node.id = id;
+  node.truth = truth;
+  node.start_ms = start_ms;
+  pthread_mutex_init(&node.ring_lock, NULL);
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_init(&node.tenants[i].qlock, NULL);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(CLUSTER_PORT + id);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(lfd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(lfd, 128) < 0) {
+    perror("rl-cluster: bind");
+    _exit(1);
+  }
+
+  for (;;) {
+    fd = accept(lfd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    pthread_create(&thread, NULL, node_conn_thread, (void*)(intptr_t)fd);
+    pthread_detach(thread);
+  }
+}
+
+/* Router */
+
+typedef struct
+{
+  pthread_rwlock_t lock;
+  ring_t ring;
+  rl_client_t* nodes[MAX_NODES];
+} router_t;
+
+/* Owner of tenant_id, or -1 if it has none the router is connected to */
+static int
+route_owner(router_t* r, uint32_t tenant_id)
+{
+  int owner;
+
+  pthread_rwlock_rdlock(&r->lock);
+  owner = ring_owner(&r->ring, tenant_id);
+  pthread_rwlock_unlock(&r->lock);
+
+  if (owner >= MAX_NODES || (owner >= 0 && NULL == r->nodes[owner]))
+    return -1;
+  return owner;
+}
+
+/*
+ * Admit on the owner. A tenant that is being moved is answered with
+ * RL_STATUS_MOVED until the router has switched to the new ring.
+ */
+int
+route_admit(router_t* r, uint32_t tenant_id, int* moved)
+{
+  int owner, status;
+
+  for (;;) {
+    owner = route_owner(r, tenant_id);
+    if (owner < 0)
+      return RL_STATUS_ERROR;
+    status = rlc_admit(r->nodes[owner], tenant_id, NULL);
+    if (RL_STATUS_MOVED != status)
+      return status;
+    (*moved)++;
+    if (owner == route_owner(r, tenant_id))
+      usleep(100); /* handoff in progress */
+  }
+}
+
+/* Send a membership to node_id */
+static int
+notify_node(uint32_t node_id, const rl_member_rec_t* members, int count)
+{
+  int fd = connect_node(CLUSTER_PORT + node_id), rc = FAILURE;
+
+  if (fd < 0)
+    return FAILURE;
+  rc = call_node(fd, RL_OP_MEMBERS, members, count);
+  close(fd);
+
+  return rc;
+}
+
+/*
+ * Apply a new membership: every node of the old and the new membership
+ * first switches and hands over the tenants it loses, then the router
+ * follows.
+ */
+int
+route_members(router_t* r, const uint32_t* node_ids, int count)
+{
+  rl_member_rec_t members[MAX_NODES], old[MAX_NODES];
+  int num_old, kept, rc = SUCCESS;
+
+  if (count < 0 || count > MAX_NODES)
+    return FAILURE;
+  for (int i = 0; i < count; i++) {
+    members[i].node_id = RL_LE32(node_ids[i]);
+    members[i].port = RL_LE32(CLUSTER_PORT + node_ids[i]);
+  }
+
+  pthread_rwlock_rdlock(&r->lock);
+  num_old = r->ring.num_nodes;
+  memcpy(old, r->ring.members, num_old * sizeof(rl_member_rec_t));
+  pthread_rwlock_unlock(&r->lock);
+
+  for (int i = 0; i < count; i++) {
+    if (SUCCESS != notify_node(node_ids[i], members, count))
+      rc = FAILURE;
+  }
+  /* nodes that leave still have tenants to hand over */
+  for (int i = 0; i < num_old; i++) {
+    kept = 0;
+    for (int j = 0; j < count && !kept; j++)
+      kept = old[i].node_id == node_ids[j];
+    if (!kept && SUCCESS != notify_node(old[i].node_id, members, count))
+      rc = FAILURE;
+  }
+
+  for (int i = 0; i < count; i++) {
+    members[i].node_id = node_ids[i];
+    members[i].port = CLUSTER_PORT + node_ids[i];
+  }
+  pthread_rwlock_wrlock(&r->lock);
+  ring_build(&r->ring, members, count);
+  pthread_rwlock_unlock(&r->lock);
+
+  return rc;
+}
+
+typedef struct
+{
+  pthread_t thread;
+  router_t* router;
+  unsigned int seed;
+  long end_time_ms;
+  unsigned long allowed;
+  unsigned long denied;
+  unsigned long errors;
+  int moved;
+} client_t;
+
+void*
+client_thread(void* arg)
+{
+  client_t* c = (client_t*)arg;
+  rlc_future_t futures[TEST_GROUP];
+  uint32_t tenants[TEST_GROUP];
+  int owner[TEST_GROUP], status;
+
+  for (int i = 0; i < TEST_GROUP; i++)
+    rlc_future_init(&futures[i]);
+
+  while (get_current_time_ms() < c->end_time_ms) {
+    /* a group of decisions in flight, each sent to its owner */
+    for (int i = 0; i < TEST_GROUP; i++) {
+      tenants[i] = rand_r(&c->seed) % TEST_NUM_TENANTS;
+      owner[i] = route_owner(c->router, tenants[i]);
+      if (owner[i] >= 0)
+        rlc_admit_future(c->router->nodes[owner[i]], tenants[i], &futures[i]);
+    }
+    for (int i = 0; i < TEST_GROUP; i++) {
+      /* no owner: an error for this request only */
+      if (owner[i] < 0)
+        status = RL_STATUS_ERROR;
+      else
+        status = rlc_future_wait(&futures[i], NULL);
+      if (RL_STATUS_MOVED == status) {
+        c->moved++;
+        status = route_admit(c->router, tenants[i], &c->moved);
+      }
+      if (RL_STATUS_ALLOWED == status)
+        c->allowed++;
+      else if (RL_STATUS_DENIED == status)
+        c->denied++;
+      else
+        c->errors++;
+    }
+    usleep(1000);
+  }
+
+  for (int i = 0; i < TEST_GROUP; i++)
+    rlc_future_destroy(&futures[i]);
+
+  return NULL;
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - TEST_NUM_NODES forked limiter nodes on loopback, all but the last
+   *   one members at first
+   * - TEST_NUM_THREADS router threads send decisions to the owners
+   * - the last node joins at TEST_JOIN_TIME and node 1 leaves at
+   *   TEST_LEAVE_TIME while traffic keeps flowing
+   * - the largest window of any tenant must stay within MAX_REQ
+   */
+
+  static router_t router;
+  static client_t clients[TEST_NUM_THREADS];
+  uint32_t initial[] = { 0, 1, 2 }, joined[] = { 0, 1, 2, 3 },
+           left[] = { 0, 2, 3 };
+  unsigned long allowed = 0, denied = 0, errors = 0, moved = 0;
+  uint32_t sum, max = 0;
+  _Atomic uint32_t* truth;
+  size_t truth_size =
+    (size_t)TEST_NUM_TENANTS * TEST_DURATION * sizeof(uint32_t);
+  pid_t pids[TEST_NUM_NODES];
+  long start_ms;
+  int fd;
+
+  truth = (_Atomic uint32_t*)mmap(NULL,
+                                  truth_size,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS,
+                                  -1,
+                                  0);
+  if (MAP_FAILED == truth) {
+    perror("mmap");
+    return 1;
+  }
+
+  start_ms = get_current_time_ms() + 500;
+  for (int i = 0; i < TEST_NUM_NODES; i++) {
+    pids[i] = fork();
+    if (0 == pids[i])
+      node_process(i, start_ms, truth);
+  }
+
+  /* wait for every node to listen */
+  for (int i = 0; i < TEST_NUM_NODES; i++) {
+    while ((fd = connect_node(CLUSTER_PORT + i)) < 0)
+      usleep(10000);
+    close(fd);
+    router.nodes[i] = rlc_connect("127.0.0.1", CLUSTER_PORT + i);
+  }
+  pthread_rwlock_init(&router.lock, NULL);
+  route_members(&router, initial, 3);
+
+  while (get_current_time_ms() < start_ms)
+    usleep(1000);
+  for (int i = 0; i < TEST_NUM_THREADS; i++) {
+    clients[i].router = &router;
+    clients[i].seed = time(NULL) + i;
+    clients[i].end_time_ms = start_ms + TEST_DURATION;
+    pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+  }
+
+  usleep(TEST_JOIN_TIME * 1000);
+  printf("node 3 joins\n");
+  fflush(stdout);
+  if (SUCCESS != route_members(&router, joined, 4))
+    fprintf(stderr, "rl-cluster: join failed\n");
+
+  usleep((TEST_LEAVE_TIME - TEST_JOIN_TIME) * 1000);
+  printf("node 1 leaves\n");
+  fflush(stdout);
+  if (SUCCESS != route_members(&router, left, 3))
+    fprintf(stderr, "rl-cluster: leave failed\n");
+
+  for (int i = 0; i < TEST_NUM_THREADS; i++) {
+    pthread_join(clients[i].thread, NULL);
+    allowed += clients[i].allowed;
+    denied += clients[i].denied;
+    errors += clients[i].errors;
+    moved += clients[i].moved;
+  }
+
+  for (int i = 0; i < TEST_NUM_NODES; i++) {
+    rlc_close(router.nodes[i]);
+    kill(pids[i], SIGTERM);
+    waitpid(pids[i], NULL, 0);
+  }
+
+  /* ground truth: admissions per tenant and ms, over all nodes */
+  for (int t = 0; t < TEST_NUM_TENANTS; t++) {
+    sum = 0;
+    for (int ms = 0; ms < TEST_DURATION; ms++) {
+      sum += truth[t * TEST_DURATION + ms];
+      if (ms >= WINDOW_SIZE)
+        sum -= truth[t * TEST_DURATION + ms - WINDOW_SIZE];
+      if (sum > max)
+        max = sum;
+    }
+  }
+
+  printf("allowed: %lu, denied: %lu, errors: %lu, moved retries: %lu\n",
+         allowed,
+         denied,
+         errors,
+         moved);
+  printf("max window of any tenant: %u (limit %d)\n", max, MAX_REQ);
+
+  munmap((void*)truth, truth_size);
+
+  return 0;
+}
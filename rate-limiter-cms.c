@@ -0,0 +1,287 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-cms.c
+ *
+ * DESCRIPTION:
+ *   Sample approximate sliding window rate limiter for unbounded key
+ *   spaces (per-IP, per-URL) backed by a rotating pair of count-min
+ *   sketches instead of a queue per key.
+ *
+ * NOTES:
+ *   1. Memory is fixed at CMS_MEMORY bytes regardless of the number of
+ *      distinct keys: two sketches (previous and current window) of
+ *      CMS_DEPTH rows by CMS_WIDTH 32-bit counters each.
+ *
+ *   2. The sliding window count of a key is estimated as
+ *        cur + prev * (WINDOW_SIZE - elapsed) / WINDOW_SIZE
+ *      where elapsed is the time since the current window started, i.e.
+ *      requests of the previous window are assumed to be evenly spread.
+ *      Sketches are rotated lazily on the first request of a window.
+ *
+ *   3. Error bounds. A count-min sketch never under-counts. For a
+ *      sketch that received N increments, the estimate of a key exceeds
+ *      its true count by more than e/CMS_WIDTH * N with probability at
+ *      most exp(-CMS_DEPTH). With the 4 MB defaults (4 x 131072):
+ *        over-count <= 2.1e-5 * N   with probability >= 98%
+ *      e.g. at most 21 extra requests per window at 1M requests per
+ *      window. The combined estimate is bounded by the same factor of
+ *      (N_cur + N_prev * weight). Over-counting only ever denies
+ *      early, never admits over the limit. Counters are updated
+ *      conservatively (only rows at the minimum are raised), which in
+ *      practice keeps the error well below the bound.
+ *
+ *   4. All row indexes come from one 64-bit key hash with double
+ *      hashing, idx[r] = h1 + r * h2 (Kirsch-Mitzenmacher), computed in
+ *      a fixed-width loop over 32-bit lanes that the compiler can
+ *      vectorize. Rows are probed and updated with the same loops.
+ *
+ *   5. Like rate-limiter.c this is not MT-Safe.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define WINDOW_SIZE 1000 /* Miliseconds (1s)     */
+#define MAX_REQ 100      /* Per key limit        */
+
+#define CMS_MEMORY (4 * 1024 * 1024) /* Bytes for both sketches */
+#define CMS_DEPTH 4
+#define CMS_WIDTH (CMS_MEMORY / (2 * CMS_DEPTH * 4)) /* 32-bit counters */
+#define CMS_MASK (CMS_WIDTH - 1)
+
+#define TEST_NUM_KEYS 1000000
+#define TEST_NUM_HEAVY 4
+#define TEST_HEAVY_PERCENT 5 /* Of all requests, per heavy key */
+#define TEST_MAX_REQUESTS 2000000
+#define TEST_REQ_STEP_US 5 /* Simulated time between requests */
+
+#if (CMS_WIDTH & CMS_MASK)
+#error "CMS_WIDTH must be a power of two"
+#endif
+
+typedef struct
+{
+  uint32_t row[CMS_DEPTH][CMS_WIDTH];
+  unsigned long total; /* increments, for the error bound */
+} sketch_t;
+
+typedef struct
+{
+  sketch_t sketches[2];
+  sketch_t* cur;
+  sketch_t* prev;
+  long window_start; /* of the current sketch */
+} cms_limiter_t;
+
+/* Sketch helpers */
+
+static inline uint64_t
+hash_key(const void* key, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)key;
+  uint64_t h = 0x9E3779B97F4A7C15ULL ^ len, w;
+
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 31;
+    p += 8;
+    len -= 8;
+  }
+  w = 0;
+  memcpy(&w, p, len);
+  h = (h ^ w) * 0x94D049BB133111EBULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 32);
+}
+
+static inline void
+sketch_index(uint64_t h, uint32_t* idx)
+{
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+
+  for (uint32_t r = 0; r < CMS_DEPTH; r++)
+    idx[r] = (h1 + r * h2) & CMS_MASK;
+}
+
+static inline uint32_t
+sketch_estimate(const sketch_t* s, const uint32_t* idx)
+{
+  uint32_t v[CMS_DEPTH], min;
+
+  for (int r = 0; r < CMS_DEPTH; r++)
+    v[r] = s->row[r][idx[r]];
+
+  min = v[0];
+  for (int r = 1; r < CMS_DEPTH; r++)
+    min = (v[r] < min) ? v[r] : min;
+  return min;
+}
+
+/* Conservative update: raise only the rows below the new estimate */
+static inline void
+sketch_add(sketch_t* s, const uint32_t* idx, uint32_t estimate)
+{
+  for (int r = 0; r < CMS_DEPTH; r++) {
+    if (s->row[r][idx[r]] <= estimate)
+      s->row[r][idx[r]] = estimate + 1;
+  }
+  s->total++;
+}
+
+static inline void
+sketch_clear(sketch_t* s)
+{
+  memset(s, 0, sizeof(sketch_t));
+}
+
+/* Rate limiter functionality and helper functions */
+
+unsigned int
+initialize_limiter(cms_limiter_t** rl, long timestamp)
+{
+  *rl = (cms_limiter_t*)calloc(1, sizeof(cms_limiter_t));
+  if (NULL == *rl)
+    return FAILURE;
+
+  (*rl)->cur = &(*rl)->sketches[0];
+  (*rl)->prev = &(*rl)->sketches[1];
+  (*rl)->window_start = timestamp - (timestamp % WINDOW_SIZE);
+  return SUCCESS;
+}
+
+void
+destroy_limiter(cms_limiter_t* rl)
+{
+  free(rl);
+}
+
+/* Lazily move to the window containing timestamp */
+static inline void
+rotate_sketches(cms_limiter_t* rl, long timestamp)
+{
+  sketch_t* temp;
+
+  if (timestamp - rl->window_start < WINDOW_SIZE)
+    return;
+
+  if (timestamp - rl->window_start < 2 * WINDOW_SIZE) {
+    temp = rl->prev;
+    rl->prev = rl->cur;
+    rl->cur = temp;
+    sketch_clear(rl->cur);
+  } else {
+    /* idle for a whole window, nothing to carry over */
+    sketch_clear(rl->cur);
+    sketch_clear(rl->prev);
+  }
+  rl->window_start = timestamp - (timestamp % WINDOW_SIZE);
+}
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+int
+check_key_allowed(cms_limiter_t* rl,
+                  const void* key,
+                  size_t len,
+                  long timestamp)
+{
+  uint32_t idx[CMS_DEPTH], cur, prev;
+  long weight;
+
+  rotate_sketches(rl, timestamp);
+
+  sketch_index(hash_key(key, len), idx);
+  cur = sketch_estimate(rl->cur, idx);
+  prev = sketch_estimate(rl->prev, idx);
+  weight = WINDOW_SIZE - (timestamp - rl->window_start);
+
+  if (cur + (prev * weight) / WINDOW_SIZE < MAX_REQ) {
+    sketch_add(rl->cur, idx, cur);
+    return SUCCESS;
+  } else {
+    return FAILURE;
+  }
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - TEST_MAX_REQUESTS requests over simulated time, one every
+   *   TEST_REQ_STEP_US microseconds
+   * - TEST_NUM_HEAVY heavy hitters, each sending TEST_HEAVY_PERCENT of
+   *   all requests; the rest spread over TEST_NUM_KEYS light keys that
+   *   stay far below MAX_REQ, so any denial of theirs is sketch error
+   */
+
+  cms_limiter_t* rl = NULL;
+  unsigned long heavy_allowed[TEST_NUM_HEAVY] = { 0 };
+  unsigned long light = 0, light_denied = 0;
+  long start_ms, curr_time_ms;
+  char key[32];
+  int len, k;
+
+  srand(time(NULL));
+  start_ms = get_current_time_ms();
+
+  if (SUCCESS != initialize_limiter(&rl, start_ms)) {
+    fprintf(stderr, "failed to allocate limiter\n");
+    return 1;
+  }
+
+  for (long i = 0; i < TEST_MAX_REQUESTS; i++) {
+    curr_time_ms = start_ms + (i * TEST_REQ_STEP_US) / 1000;
+    k = rand() % 100;
+    if (k < TEST_NUM_HEAVY * TEST_HEAVY_PERCENT) {
+      k /= TEST_HEAVY_PERCENT;
+      len = snprintf(key, sizeof(key), "192.0.2.%d", k);
+      if (SUCCESS == check_key_allowed(rl, key, len, curr_time_ms))
+        heavy_allowed[k]++;
+    } else {
+      k = rand() % TEST_NUM_KEYS;
+      len = snprintf(key, sizeof(key), "10.%d.%d.%d",
+                     (k >> 16) & 0xff, (k >> 8) & 0xff, k & 0xff);
+      light++;
+      if (SUCCESS != check_key_allowed(rl, key, len, curr_time_ms))
+        light_denied++;
+    }
+  }
+
+  printf("sketch: %d x %lu counters, %lu bytes\n",
+         CMS_DEPTH,
+         (unsigned long)CMS_WIDTH,
+         (unsigned long)sizeof(cms_limiter_t));
+  for (int i = 0; i < TEST_NUM_HEAVY; i++) {
+    printf("Heavy key %d - allowed: %lu (limit %d / %d ms over %ld ms)\n",
+           i,
+           heavy_allowed[i],
+           MAX_REQ,
+           WINDOW_SIZE,
+           (long)TEST_MAX_REQUESTS * TEST_REQ_STEP_US / 1000);
+  }
+  printf("Light keys - requests: %lu, falsely denied: %lu\n",
+         light,
+         light_denied);
+  printf("over-count bound (current window): %.1f\n",
+         2.718281828 / CMS_WIDTH * rl->cur->total);
+
+  destroy_limiter(rl);
+
+  return 0;
+}
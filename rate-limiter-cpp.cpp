@@ -0,0 +1,115 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-cpp.cpp
+ *
+ * DESCRIPTION:
+ *   Sample usage of the compile-time C++ rate limiter (rate-limiter.hpp).
+ *
+ * NOTES:
+ *   1. Checks both engines against a manual clock: exactly MAX_REQ
+ *      admissions per window, and retry-after hints that are honoured.
+ *
+ *   2. Times decisions with the steady clock over TEST_TENANTS tenants,
+ *      half of them over their limit.
+ *
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <ratio>
+
+#include "rate-limiter.hpp"
+
+#define MAX_REQ 100
+#define TEST_TENANTS 4096
+#define TEST_REQUESTS 20000000
+
+using Window = std::chrono::seconds; /* MAX_REQ per second */
+
+struct ManualClock
+{
+  using rep = long long;
+  using period = std::milli;
+  using duration = std::chrono::duration<rep, period>;
+  using time_point = std::chrono::time_point<ManualClock>;
+  static constexpr bool is_steady = true;
+
+  static inline rep ticks = 1;
+
+  static time_point now() noexcept { return time_point(duration(ticks)); }
+};
+
+template<typename Engine>
+static bool
+check_engine(const char* name)
+{
+  rl::RateLimiter<Engine, Window, MAX_REQ, ManualClock> limiter(1);
+  ManualClock::duration retry_after{};
+  int allowed = 0;
+  bool ok = true;
+
+  /* a burst of twice the limit */
+  for (int i = 0; i < 2 * MAX_REQ; i++) {
+    auto d = limiter.check(0);
+    allowed += d.allowed;
+    retry_after = d.retry_after;
+  }
+  ok &= MAX_REQ == allowed;
+
+  /* still denied just before the hint, admitted at it */
+  ManualClock::ticks += retry_after.count() - 1;
+  ok &= !limiter.check(0);
+  ManualClock::ticks += 1;
+  ok &= bool(limiter.check(0));
+
+  std::printf("%-14s burst: %d of %d allowed, retry after %lld ms: %s\n",
+              name,
+              allowed,
+              2 * MAX_REQ,
+              static_cast<long long>(retry_after.count()),
+              ok ? "ok" : "FAILED");
+  return ok;
+}
+
+template<typename Engine>
+static void
+bench_engine(const char* name)
+{
+  static rl::RateLimiter<Engine, Window, MAX_REQ> limiter(TEST_TENANTS);
+  unsigned long allowed = 0;
+  unsigned int seed = 1, tenant;
+  auto start = std::chrono::steady_clock::now();
+
+  for (long i = 0; i < TEST_REQUESTS; i++) {
+    seed = seed * 1103515245 + 12345;
+    /* the lower half of the tenants gets most of the traffic */
+    tenant =
+      (seed >> 16) & (seed & 1 ? TEST_TENANTS / 2 - 1 : TEST_TENANTS - 1);
+    allowed += bool(limiter.check(tenant));
+  }
+
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  std::printf("%-14s %lu allowed, %.0f decisions/sec\n",
+              name,
+              allowed,
+              TEST_REQUESTS / elapsed.count());
+}
+
+int
+main()
+{
+  /* Sample usage.
+   * - a window of one second and MAX_REQ requests, fixed at compile time
+   * - the same limits with the exact log and the 10 bucket engine
+   */
+
+  bool ok = true;
+
+  ok &= check_engine<rl::LogEngine>("log");
+  ok &= check_engine<rl::BucketEngine<10>>("buckets(10)");
+
+  bench_engine<rl::LogEngine>("log");
+  bench_engine<rl::BucketEngine<10>>("buckets(10)");
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,494 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-fair.c
+ *
+ * DESCRIPTION:
+ *   Sample MT-Safe rate limiter that shares a global backend capacity
+ *   fairly across tenants: the per tenant sliding window check of
+ *   rl-server, followed by deficit round robin (DRR) over the global
+ *   capacity.
+ *
+ * NOTES:
+ *   1. A request first passes the tenant's own limit (MAX_REQ per
+ *      WINDOW_SIZE, a ring of admission times behind qlock). Requests
+ *      over it are denied at once, with a retry-after, as before.
+ *
+ *   2. The backend serves GLOBAL_RATE cost units per second, metered as
+ *      a budget refilled from the clock and capped at GLOBAL_BURST.
+ *      While no tenant is waiting and the budget covers a request, it
+ *      is dispatched at once by the submitting thread.
+ *
+ *   3. Otherwise the request joins its tenant's FIFO and the tenant
+ *      joins the active ring. A FIFO holds at most QUEUE_MAX requests;
+ *      beyond that a request is denied, though it was counted in the
+ *      tenant's window. The dispatcher thread spends the budget every
+ *      tick by DRR: each visit adds QUANTUM * weight to the
+ *      tenant's deficit and serves its head requests while the deficit
+ *      covers their cost. QUANTUM is at least the largest cost a
+ *      request may have, so a visit serves at least the head request
+ *      while the budget lasts. A tenant that empties its queue leaves the
+ *      ring and forfeits its deficit. Every tenant with requests
+ *      waiting gets its weighted share of the capacity however much
+ *      the others offer, and shares left unused by small tenants go to
+ *      the big ones.
+ *
+ *   4. Every structure is O(1) per decision: the ring is circular and
+ *      doubly linked, FIFOs are linked through the caller allocated
+ *      requests, a visit serves at least one request (note 3), and the
+ *      budget is a counter. Requests are dispatched through their
+ *      callback, outside all locks, with status SUCCESS; requests still
+ *      queued when the limiter is destroyed get theirs with FAILURE.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 16     /* Active tenants       */
+#define WINDOW_SIZE 1000   /* Miliseconds (1s)     */
+#define MAX_REQ 4000       /* Per tenant limit     */
+#define GLOBAL_RATE 2000   /* Cost units / second  */
+#define GLOBAL_BURST 20    /* Cost units           */
+#define QUANTUM 20         /* Cost units / visit   */
+#define QUEUE_MAX 256      /* Waiting, per tenant  */
+
+#define TEST_DURATION 4000 /* Miliseconds          */
+#define TEST_WARMUP 1000   /* Not measured         */
+#define TEST_BIG_TENANTS 2
+#define TEST_BIG_RATE 5000 /* Requests / second    */
+#define TEST_SMALL_TENANTS 8
+#define TEST_SMALL_RATE 100
+
+_Static_assert(QUANTUM >= GLOBAL_BURST,
+               "a visit must serve a request of the largest cost");
+
+typedef struct request
+{
+  struct request* next;
+  unsigned int tenant_id;
+  unsigned int cost; /* Cost units           */
+  int status;        /* Set before fn runs  */
+  void (*fn)(struct request* r);
+  void* arg;
+} request_t;
+
+typedef struct tenant
+{
+  pthread_mutex_t qlock; /* window */
+  unsigned int head;
+  unsigned int size;
+  long slots[MAX_REQ];
+  long blocked_until;
+  /* fair_lock */
+  unsigned int weight;
+  unsigned int queued;
+  long deficit;
+  int granted;           /* quantum of this visit added */
+  request_t* first;      /* FIFO */
+  request_t* last;
+  struct tenant* prev;   /* active ring */
+  struct tenant* next;
+} tenant_t;
+
+typedef struct
+{
+  tenant_t tenants[MAX_TENANTS];
+  pthread_mutex_t fair_lock;
+  tenant_t* active; /* next tenant to visit, NULL if none waits */
+  long budget;      /* Cost units / 1000    */
+  long refilled_at;
+  atomic_int stop;
+  pthread_t thread;
+} fair_limiter_t;
+
+/* Rate limiter functionality and helper functions */
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/* Per tenant sliding window, as in rl-server */
+static int
+check_window(tenant_t* t, long timestamp, long* retry_after)
+{
+  long blocked_until = __atomic_load_n(&t->blocked_until, __ATOMIC_RELAXED);
+  int result;
+
+  if (timestamp < blocked_until) {
+    *retry_after = blocked_until - timestamp;
+    return FAILURE;
+  }
+
+  pthread_mutex_lock(&t->qlock);
+  while (t->size && (timestamp - t->slots[t->head] >= WINDOW_SIZE)) {
+    t->head = (t->head + 1) % MAX_REQ;
+    t->size--;
+  }
+  if (t->size < MAX_REQ) {
+    t->slots[(t->head + t->size) % MAX_REQ] = timestamp;
+    t->size++;
+    *retry_after = 0;
+    result = SUCCESS;
+  } else {
+    blocked_until = t->slots[t->head] + WINDOW_SIZE;
+    __atomic_store_n(&t->blocked_until, blocked_until, __ATOMIC_RELAXED);
+    *retry_after = blocked_until - timestamp;
+    result = FAILURE;
+  }
+  pthread_mutex_unlock(&t->qlock);
+
+  return result;
+}
+
+/* Global capacity, with fair_lock held */
+static void
+refill(fair_limiter_t* rl, long timestamp)
+{
+  long elapsed = timestamp - rl->refilled_at;
+
+  if (elapsed <= 0)
+    return;
+  rl->refilled_at = timestamp;
+  rl->budget += elapsed * GLOBAL_RATE;
+  if (rl->budget > GLOBAL_BURST * 1000L)
+    rl->budget = GLOBAL_BURST * 1000L;
+}
+
+/* Active ring, with fair_lock held */
+static void
+ring_insert(fair_limiter_t* rl, tenant_t* t)
+{
+  if (NULL == rl->active) {
+    t->prev = t->next = t;
+    rl->active = t;
+    return;
+  }
+  /* at the end of the current round */
+  t->next = rl->active;
+  t->prev = rl->active->prev;
+  t->prev->next = t;
+  rl->active->prev = t;
+}
+
+static void
+ring_remove(fair_limiter_t* rl, tenant_t* t)
+{
+  if (t->next == t) {
+    rl->active = NULL;
+  } else {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if (rl->active == t)
+      rl->active = t->next;
+  }
+  t->prev = t->next = NULL;
+}
+
+/*
+ * DRR over the budget, with fair_lock held. Dispatched requests are
+ * appended to *fire.
+ */
+static void
+drr_dispatch(fair_limiter_t* rl, request_t** fire)
+{
+  tenant_t* t;
+  request_t* r;
+
+  while (NULL != (t = rl->active)) {
+    if (!t->granted) {
+      t->deficit += (long)QUANTUM * t->weight;
+      t->granted = 1;
+    }
+    while (NULL != (r = t->first) && r->cost <= t->deficit &&
+           r->cost * 1000L <= rl->budget) {
+      t->first = r->next;
+      t->queued--;
+      t->deficit -= r->cost;
+      rl->budget -= r->cost * 1000L;
+      r->status = SUCCESS;
+      *fire = r;
+      fire = &r->next;
+    }
+    if (NULL == t->first) {
+      t->deficit = 0;
+      t->granted = 0;
+      ring_remove(rl, t);
+    } else if (t->first->cost > t->deficit) {
+      t->granted = 0;
+      rl->active = t->next;
+    } else {
+      break; /* out of budget: resume this visit on the next tick */
+    }
+  }
+  *fire = NULL;
+}
+
+static void
+fire_requests(request_t* r)
+{
+  request_t* next;
+
+  for (; NULL != r; r = next) {
+    next = r->next; /* fn may free the request */
+    r->fn(r);
+  }
+}
+
+/*
+ * Admit r for its tenant. SUCCESS if it was dispatched (r->fn has run)
+ * or queued (r->fn runs on the dispatcher thread when its turn comes,
+ * or from destroy_limiter() with r->status FAILURE).
+ * FAILURE if the tenant is over its own limit, *retry_after set, or its
+ * queue is full, *retry_after 0; r->fn is not run. r->cost may not
+ * exceed GLOBAL_BURST.
+ */
+int
+submit_request(fair_limiter_t* rl, request_t* r, long timestamp,
+               long* retry_after)
+{
+  tenant_t* t = &rl->tenants[r->tenant_id];
+
+  *retry_after = 0;
+  if (r->cost > GLOBAL_BURST)
+    return FAILURE;
+  if (SUCCESS != check_window(t, timestamp, retry_after))
+    return FAILURE;
+
+  pthread_mutex_lock(&rl->fair_lock);
+  refill(rl, timestamp);
+  if (NULL == rl->active && r->cost * 1000L <= rl->budget) {
+    rl->budget -= r->cost * 1000L;
+    pthread_mutex_unlock(&rl->fair_lock);
+    r->status = SUCCESS;
+    r->fn(r);
+    return SUCCESS;
+  }
+  if (t->queued >= QUEUE_MAX) {
+    pthread_mutex_unlock(&rl->fair_lock);
+    *retry_after = 0;
+    return FAILURE;
+  }
+
+  r->next = NULL;
+  if (NULL == t->first) {
+    t->first = r;
+    ring_insert(rl, t);
+  } else {
+    t->last->next = r;
+  }
+  t->last = r;
+  t->queued++;
+  pthread_mutex_unlock(&rl->fair_lock);
+
+  return SUCCESS;
+}
+
+static void*
+dispatcher_thread(void* arg)
+{
+  fair_limiter_t* rl = (fair_limiter_t*)arg;
+  request_t* fire;
+
+  while (!atomic_load(&rl->stop)) {
+    pthread_mutex_lock(&rl->fair_lock);
+    refill(rl, get_current_time_ms());
+    drr_dispatch(rl, &fire);
+    pthread_mutex_unlock(&rl->fair_lock);
+
+    fire_requests(fire);
+    usleep(1000);
+  }
+
+  return NULL;
+}
+
+unsigned int
+initialize_limiter(fair_limiter_t** rl)
+{
+  *rl = (fair_limiter_t*)calloc(1, sizeof(fair_limiter_t));
+  if (NULL == *rl)
+    return FAILURE;
+
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    pthread_mutex_init(&(*rl)->tenants[i].qlock, NULL);
+    (*rl)->tenants[i].weight = 1;
+  }
+  pthread_mutex_init(&(*rl)->fair_lock, NULL);
+  (*rl)->refilled_at = get_current_time_ms();
+
+  if (0 != pthread_create(&(*rl)->thread, NULL, dispatcher_thread, *rl)) {
+    free(*rl);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+/* Requests still queued are completed as denied, status FAILURE */
+void
+destroy_limiter(fair_limiter_t* rl)
+{
+  request_t* r;
+
+  if (NULL == rl)
+    return;
+
+  atomic_store(&rl->stop, 1);
+  pthread_join(rl->thread, NULL);
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    for (r = rl->tenants[i].first; NULL != r; r = r->next)
+      r->status = FAILURE;
+    fire_requests(rl->tenants[i].first);
+    rl->tenants[i].first = rl->tenants[i].last = NULL;
+    rl->tenants[i].queued = 0;
+    pthread_mutex_destroy(&rl->tenants[i].qlock);
+  }
+  pthread_mutex_destroy(&rl->fair_lock);
+  free(rl);
+}
+
+/* Sample usage */
+
+typedef struct
+{
+  long start_ms;
+  atomic_ulong served[MAX_TENANTS];
+  unsigned long denied_window[MAX_TENANTS];
+  unsigned long denied_queue[MAX_TENANTS];
+  atomic_ulong dropped; /* still queued at the end */
+} test_t;
+
+static test_t test;
+
+static void
+test_serve(request_t* r)
+{
+  if (SUCCESS != r->status)
+    atomic_fetch_add(&test.dropped, 1);
+  else if (get_current_time_ms() - test.start_ms >= TEST_WARMUP)
+    atomic_fetch_add(&test.served[r->tenant_id], 1);
+  free(r);
+}
+
+/* Max-min fair share of GLOBAL_RATE for the offered rates (equal weights) */
+static void
+fair_shares(const double* offered, double* share, int n)
+{
+  double left = GLOBAL_RATE, level;
+  int unsatisfied = n, done[MAX_TENANTS] = { 0 }, progress = 1;
+
+  while (unsatisfied && progress) {
+    level = left / unsatisfied;
+    progress = 0;
+    for (int i = 0; i < n; i++) {
+      if (!done[i] && offered[i] <= level) {
+        share[i] = offered[i];
+        left -= offered[i];
+        done[i] = 1;
+        unsatisfied--;
+        progress = 1;
+      }
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    if (!done[i])
+      share[i] = left / unsatisfied;
+  }
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - TEST_BIG_TENANTS tenants offer TEST_BIG_RATE requests / second,
+   *   over their own limit and over the whole global capacity
+   * - TEST_SMALL_TENANTS tenants offer TEST_SMALL_RATE requests / second
+   * - served rates are compared with the max-min fair shares
+   */
+
+  fair_limiter_t* rl = NULL;
+  int ntenants = TEST_BIG_TENANTS + TEST_SMALL_TENANTS;
+  double offered[MAX_TENANTS], demand[MAX_TENANTS], share[MAX_TENANTS];
+  double credit[MAX_TENANTS] = { 0 }, seconds;
+  long now, elapsed, last = 0, retry_after;
+  unsigned long total = 0;
+  request_t* r;
+
+  if (SUCCESS != initialize_limiter(&rl)) {
+    fprintf(stderr, "failed to allocate limiter\n");
+    return 1;
+  }
+
+  for (int i = 0; i < ntenants; i++) {
+    offered[i] = i < TEST_BIG_TENANTS ? TEST_BIG_RATE : TEST_SMALL_RATE;
+    demand[i] = offered[i] < MAX_REQ ? offered[i] : MAX_REQ;
+  }
+  fair_shares(demand, share, ntenants);
+
+  test.start_ms = get_current_time_ms();
+  while ((elapsed = (now = get_current_time_ms()) - test.start_ms) <
+         TEST_DURATION) {
+    if (elapsed == last) {
+      usleep(200);
+      continue;
+    }
+    for (int i = 0; i < ntenants; i++) {
+      credit[i] += offered[i] * (elapsed - last) / 1000;
+      for (; credit[i] >= 1; credit[i]--) {
+        r = (request_t*)malloc(sizeof(request_t));
+        if (NULL == r)
+          break;
+        r->tenant_id = i;
+        r->cost = 1;
+        r->fn = test_serve;
+        if (SUCCESS != submit_request(rl, r, now, &retry_after)) {
+          if (retry_after)
+            test.denied_window[i]++;
+          else
+            test.denied_queue[i]++;
+          free(r);
+        }
+      }
+    }
+    last = elapsed;
+  }
+
+  destroy_limiter(rl);
+
+  seconds = (TEST_DURATION - TEST_WARMUP) / 1000.0;
+  printf("global capacity %d/s, tenant limit %d / %d ms, quantum %d\n",
+         GLOBAL_RATE,
+         MAX_REQ,
+         WINDOW_SIZE,
+         QUANTUM);
+  for (int i = 0; i < ntenants; i++) {
+    total += atomic_load(&test.served[i]);
+    printf("tenant %2d: offered %5.0f/s, served %6.1f/s (fair %6.1f/s), "
+           "denied: window %lu, queue full %lu\n",
+           i,
+           offered[i],
+           atomic_load(&test.served[i]) / seconds,
+           share[i],
+           test.denied_window[i],
+           test.denied_queue[i]);
+  }
+  printf("served: %.1f/s of %d/s, %lu queued at shutdown denied\n",
+         total / seconds,
+         GLOBAL_RATE,
+         atomic_load(&test.dropped));
+
+  return 0;
+}
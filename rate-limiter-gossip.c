@@ -0,0 +1,580 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-gossip.c
+ *
+ * DESCRIPTION:
+ *   Sample distributed sliding window rate limiter. Every node admits
+ *   locally against its share of a global per-tenant limit and keeps
+ *   its peers informed with asynchronous UDP gossip, so that N nodes
+ *   together enforce MAX_REQ instead of N * MAX_REQ.
+ *
+ * NOTES:
+ *   1. Counts are kept per tenant in buckets of BUCKET_SIZE ms, as in
+ *      rate-limiter-striped.c: the window is the current bucket plus
+ *      the NUM_BUCKETS before it. A node counts both its admissions and
+ *      its demand (every request, admitted or not).
+ *
+ *   2. Every GOSSIP_INTERVAL ms a node sends its peers the buckets that
+ *      changed since the last round. Entries carry absolute bucket
+ *      counts, so a lost or reordered datagram is repaired by any later
+ *      one and merging is a max; entries are delta encoded (tenant gap,
+ *      bucket age, counts) as varints, a few bytes each. Every
+ *      FULL_SYNC_ROUNDS rounds the whole window is sent again.
+ *
+ *   3. After each round a node recomputes, per tenant, its allowance:
+ *      the budget split by demand, ((local + 1) / (total + nodes)) of
+ *      it, so that shares follow where the traffic actually lands and
+ *      add up to one. A request is admitted if the node is below its
+ *      allowance and the known global count is below the budget.
+ *
+ *   4. A peer not heard from for STALE_TIME ms is considered partitioned.
+ *      Its last known window count, and at least MAX_REQ / nodes, is
+ *      taken off the budget of everyone else and frozen until it is
+ *      heard again. Isolated nodes thus fall back to a static split of
+ *      the limit and connected groups share what is left by demand; the
+ *      global limit holds, at the cost of idle capacity.
+ *
+ *   5. Between rounds nodes act on a view that is up to one round old,
+ *      and shares are computed from slightly different views, so the
+ *      global count may briefly overshoot by about what the nodes admit
+ *      in one GOSSIP_INTERVAL.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 100  /* Active tenants       */
+#define WINDOW_SIZE 1000 /* Miliseconds (1s)     */
+#define MAX_REQ 1000     /* Global, all nodes    */
+#define NUM_BUCKETS 10
+#define BUCKET_SIZE (WINDOW_SIZE / NUM_BUCKETS)
+#define RING_BUCKETS (NUM_BUCKETS + 1) /* window plus current bucket */
+
+#define MAX_NODES 64
+#define GOSSIP_PORT 7100    /* node i listens on GOSSIP_PORT + i */
+#define GOSSIP_INTERVAL 20  /* Miliseconds          */
+#define FULL_SYNC_ROUNDS 25 /* every 500ms          */
+#define STALE_TIME 200      /* Miliseconds          */
+#define GOSSIP_MAGIC 0x4c47 /* "LG" */
+#define GOSSIP_MTU 1400
+
+#define TEST_NUM_NODES 4
+#define TEST_NUM_TENANTS 4
+#define TEST_DURATION 6000    /* Miliseconds          */
+#define TEST_PARTITION_START 2000
+#define TEST_PARTITION_END 4000
+#define TEST_REQ_PER_MS 4     /* per node             */
+#define TEST_HOME_PERCENT 80  /* to the tenant's home node */
+
+/* Window state of one tenant, as counted by one node */
+typedef struct
+{
+  long epoch[RING_BUCKETS]; /* bucket number held by each slot */
+  uint32_t admitted[RING_BUCKETS];
+  uint32_t demand[RING_BUCKETS];
+} counts_t;
+
+typedef struct
+{
+  counts_t local;
+  uint32_t dirty;     /* slots changed since the last round */
+  uint32_t allowance; /* local admissions allowed in the window */
+  uint32_t budget;    /* global limit minus partitioned peers */
+  uint32_t remote;    /* admissions of connected peers */
+} tenant_t;
+
+typedef struct
+{
+  struct sockaddr_in addr;
+  long last_heard; /* Miliseconds, 0 if never */
+  counts_t tenants[MAX_TENANTS];
+} peer_t;
+
+typedef struct
+{
+  int id;
+  int num_nodes;
+  int fd;
+  int partitioned; /* test hook: drop all gossip */
+  unsigned int round;
+  unsigned long msgs;
+  unsigned long bytes;
+  tenant_t tenants[MAX_TENANTS];
+  peer_t peers[MAX_NODES];
+} node_t;
+
+/* Gossip datagram header; entries follow as varints */
+typedef struct
+{
+  uint16_t magic;
+  uint8_t node_id;
+  uint8_t pad;
+  uint32_t count;
+  int64_t epoch; /* entry ages are relative to this bucket */
+} gossip_hdr_t;
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/* Bucket counters */
+
+static inline long
+bucket_epoch(long timestamp)
+{
+  return timestamp / BUCKET_SIZE;
+}
+
+static uint32_t
+window_sum(const counts_t* c, const uint32_t* field, long epoch)
+{
+  uint32_t sum = 0;
+
+  for (int i = 0; i < RING_BUCKETS; i++) {
+    if (c->epoch[i] <= epoch && c->epoch[i] > epoch - RING_BUCKETS)
+      sum += field[i];
+  }
+
+  return sum;
+}
+
+/* Slot of the current bucket, reset if it still holds an older one */
+static inline int
+bucket_slot(counts_t* c, long epoch)
+{
+  int slot = epoch % RING_BUCKETS;
+
+  if (c->epoch[slot] != epoch) {
+    c->epoch[slot] = epoch;
+    c->admitted[slot] = c->demand[slot] = 0;
+  }
+
+  return slot;
+}
+
+/* Take a peer's bucket; counts only grow within a bucket */
+static void
+merge_bucket(counts_t* c, long epoch, uint32_t admitted, uint32_t demand)
+{
+  int slot = epoch % RING_BUCKETS;
+
+  if (epoch < c->epoch[slot])
+    return;
+  if (epoch > c->epoch[slot]) {
+    c->epoch[slot] = epoch;
+    c->admitted[slot] = c->demand[slot] = 0;
+  }
+  if (admitted > c->admitted[slot])
+    c->admitted[slot] = admitted;
+  if (demand > c->demand[slot])
+    c->demand[slot] = demand;
+}
+
+/* Varints, 7 bits per byte */
+
+static inline int
+put_varint(unsigned char* p, uint64_t v)
+{
+  int n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+
+  return n;
+}
+
+static inline int
+get_varint(const unsigned char* p, const unsigned char* end, uint64_t* v)
+{
+  int n = 0, shift = 0;
+
+  *v = 0;
+  while (p + n < end && shift < 64) {
+    *v |= (uint64_t)(p[n] & 0x7f) << shift;
+    if (!(p[n++] & 0x80))
+      return n;
+    shift += 7;
+  }
+
+  return 0;
+}
+
+/* Gossip */
+
+static void
+gossip_flush(node_t* n, unsigned char* buf, size_t len)
+{
+  for (int i = 0; i < n->num_nodes; i++) {
+    if (i == n->id)
+      continue;
+    sendto(n->fd,
+           buf,
+           len,
+           MSG_DONTWAIT,
+           (const struct sockaddr*)&n->peers[i].addr,
+           sizeof(n->peers[i].addr));
+    n->msgs++;
+    n->bytes += len;
+  }
+}
+
+/*
+ * Send the changed buckets (or, on a full sync, the whole window) of
+ * every tenant. Sent even when empty, as a heartbeat.
+ */
+static void
+gossip_send(node_t* n, long epoch)
+{
+  unsigned char buf[GOSSIP_MTU];
+  gossip_hdr_t* hdr = (gossip_hdr_t*)buf;
+  int full = 0 == n->round % FULL_SYNC_ROUNDS;
+  unsigned int prev = 0;
+  size_t len = sizeof(*hdr);
+  counts_t* c;
+  uint32_t mask;
+
+  hdr->magic = GOSSIP_MAGIC;
+  hdr->node_id = n->id;
+  hdr->pad = 0;
+  hdr->count = 0;
+  hdr->epoch = epoch;
+
+  for (unsigned int t = 0; t < MAX_TENANTS; t++) {
+    c = &n->tenants[t].local;
+    mask = full ? (1u << RING_BUCKETS) - 1 : n->tenants[t].dirty;
+    n->tenants[t].dirty = 0;
+
+    for (int slot = 0; mask; slot++, mask >>= 1) {
+      if (!(mask & 1) || c->epoch[slot] > epoch ||
+          c->epoch[slot] <= epoch - RING_BUCKETS || 0 == c->demand[slot])
+        continue;
+
+      /* 4 varints of at most 5 bytes each */
+      if (len + 20 > sizeof(buf)) {
+        gossip_flush(n, buf, len);
+        len = sizeof(*hdr);
+        hdr->count = 0;
+        prev = 0;
+      }
+      len += put_varint(buf + len, t - prev);
+      len += put_varint(buf + len, epoch - c->epoch[slot]);
+      len += put_varint(buf + len, c->admitted[slot]);
+      len += put_varint(buf + len, c->demand[slot]);
+      hdr->count++;
+      prev = t;
+    }
+  }
+
+  gossip_flush(n, buf, len);
+  n->round++;
+}
+
+static void
+gossip_receive(node_t* n, long timestamp)
+{
+  unsigned char buf[GOSSIP_MTU];
+  const gossip_hdr_t* hdr = (const gossip_hdr_t*)buf;
+  const unsigned char *p, *end;
+  uint64_t v[4];
+  unsigned int tenant;
+  peer_t* peer;
+  ssize_t len;
+  int k;
+
+  while ((len = recv(n->fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+    if (n->partitioned || (size_t)len < sizeof(*hdr) ||
+        GOSSIP_MAGIC != hdr->magic || hdr->node_id >= n->num_nodes ||
+        hdr->node_id == n->id)
+      continue;
+
+    peer = &n->peers[hdr->node_id];
+    peer->last_heard = timestamp;
+
+    p = buf + sizeof(*hdr);
+    end = buf + len;
+    tenant = 0;
+    for (uint32_t i = 0; i < hdr->count; i++) {
+      for (k = 0; k < 4; k++) {
+        if (0 == (len = get_varint(p, end, &v[k])))
+          break;
+        p += len;
+      }
+      if (k < 4)
+        break;
+      /* tenant gap, bucket age, admitted, demand */
+      tenant += v[0];
+      if (tenant >= MAX_TENANTS || v[1] >= RING_BUCKETS)
+        break;
+      merge_bucket(&peer->tenants[tenant], hdr->epoch - (long)v[1], v[2], v[3]);
+    }
+  }
+}
+
+/* Recompute every tenant's allowance from the current view */
+static void
+rebalance(node_t* n, long timestamp)
+{
+  long epoch = bucket_epoch(timestamp);
+  uint32_t static_share = MAX_REQ / n->num_nodes;
+  uint32_t reserved, remote, demand, total, frozen;
+  tenant_t* t;
+  peer_t* peer;
+  counts_t* c;
+
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    t = &n->tenants[i];
+    demand = window_sum(&t->local, t->local.demand, epoch);
+    total = demand + 1;
+    reserved = remote = 0;
+
+    for (int p = 0; p < n->num_nodes; p++) {
+      if (p == n->id)
+        continue;
+      peer = &n->peers[p];
+      c = &peer->tenants[i];
+      if (0 == peer->last_heard || timestamp - peer->last_heard > STALE_TIME) {
+        /* partitioned: its window as last seen, frozen */
+        frozen = window_sum(c, c->admitted, bucket_epoch(peer->last_heard));
+        reserved += frozen > static_share ? frozen : static_share;
+      } else {
+        remote += window_sum(c, c->admitted, epoch);
+        total += window_sum(c, c->demand, epoch) + 1;
+      }
+    }
+
+    t->budget = reserved < MAX_REQ ? MAX_REQ - reserved : 0;
+    t->remote = remote;
+    t->allowance = (uint64_t)t->budget * (demand + 1) / total;
+  }
+}
+
+int
+check_tenant_allowed(node_t* n, unsigned int tenant_id, long timestamp)
+{
+  tenant_t* t = &n->tenants[tenant_id];
+  long epoch = bucket_epoch(timestamp);
+  int slot = bucket_slot(&t->local, epoch);
+  uint32_t used = window_sum(&t->local, t->local.admitted, epoch);
+
+  t->local.demand[slot]++;
+  t->dirty |= 1u << slot;
+
+  if (used >= t->allowance || used + t->remote >= t->budget)
+    return FAILURE;
+
+  t->local.admitted[slot]++;
+  return SUCCESS;
+}
+
+unsigned int
+initialize_node(node_t* n, int id, int num_nodes)
+{
+  struct sockaddr_in addr;
+
+  memset(n, 0, sizeof(*n));
+  n->id = id;
+  n->num_nodes = num_nodes;
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    for (int s = 0; s < RING_BUCKETS; s++)
+      n->tenants[i].local.epoch[s] = -1;
+  }
+
+  for (int i = 0; i < num_nodes; i++) {
+    n->peers[i].addr.sin_family = AF_INET;
+    n->peers[i].addr.sin_port = htons(GOSSIP_PORT + i);
+    n->peers[i].addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int t = 0; t < MAX_TENANTS; t++) {
+      for (int s = 0; s < RING_BUCKETS; s++)
+        n->peers[i].tenants[t].epoch[s] = -1;
+    }
+  }
+
+  n->fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (n->fd < 0)
+    return FAILURE;
+  addr = n->peers[id].addr;
+  if (bind(n->fd, (const struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(n->fd);
+    return FAILURE;
+  }
+
+  /* nobody heard yet: start from the static split */
+  rebalance(n, get_current_time_ms());
+
+  return SUCCESS;
+}
+
+/* Admissions of all nodes per tenant and ms, the test's ground truth */
+typedef struct
+{
+  _Atomic uint32_t admitted[TEST_NUM_TENANTS][TEST_DURATION];
+} truth_t;
+
+static void
+node_process(int id, long start_ms, truth_t* truth)
+{
+  static node_t node;
+  unsigned long allowed = 0, denied = 0;
+  long curr_time_ms, last_ms, last_round = 0, elapsed;
+  unsigned int seed = time(NULL) + id, tenant_id;
+  int home = id % TEST_NUM_TENANTS;
+
+  if (SUCCESS != initialize_node(&node, id, TEST_NUM_NODES)) {
+    perror("rl-gossip: bind");
+    _exit(1);
+  }
+
+  last_ms = get_current_time_ms();
+  while ((elapsed = (curr_time_ms = get_current_time_ms()) - start_ms) <
+         TEST_DURATION) {
+    /* the last node is cut off from its peers for a while */
+    node.partitioned = id == TEST_NUM_NODES - 1 &&
+                       elapsed >= TEST_PARTITION_START &&
+                       elapsed < TEST_PARTITION_END;
+
+    if (curr_time_ms - last_round >= GOSSIP_INTERVAL) {
+      gossip_receive(&node, curr_time_ms);
+      if (!node.partitioned)
+        gossip_send(&node, bucket_epoch(curr_time_ms));
+      rebalance(&node, curr_time_ms);
+      last_round = curr_time_ms;
+    }
+
+    /* offered load: mostly the home tenant, some of the others */
+    for (long i = 0; i < (curr_time_ms - last_ms) * TEST_REQ_PER_MS; i++) {
+      tenant_id = home;
+      if (rand_r(&seed) % 100 >= TEST_HOME_PERCENT)
+        tenant_id = rand_r(&seed) % TEST_NUM_TENANTS;
+      if (SUCCESS == check_tenant_allowed(&node, tenant_id, curr_time_ms)) {
+        allowed++;
+        if (elapsed >= 0)
+          atomic_fetch_add(&truth->admitted[tenant_id][elapsed], 1);
+      } else {
+        denied++;
+      }
+    }
+    last_ms = curr_time_ms;
+    usleep(1000);
+  }
+
+  printf("node %d: allowed: %lu, denied: %lu, gossip: %lu msgs, %lu bytes\n",
+         id,
+         allowed,
+         denied,
+         node.msgs,
+         node.bytes);
+  fflush(stdout);
+  close(node.fd);
+  _exit(0);
+}
+
+/* Largest count of any WINDOW_SIZE ms window ending in [from, to) */
+static uint32_t
+max_window(truth_t* truth, int tenant, long from, long to)
+{
+  uint32_t sum = 0, max = 0;
+
+  for (long ms = 0; ms < to; ms++) {
+    sum += truth->admitted[tenant][ms];
+    if (ms >= WINDOW_SIZE)
+      sum -= truth->admitted[tenant][ms - WINDOW_SIZE];
+    if (ms >= from && sum > max)
+      max = sum;
+  }
+
+  return max;
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - TEST_NUM_NODES forked nodes gossiping on loopback
+   * - each tenant gets most of its traffic on one node
+   * - the last node is partitioned between TEST_PARTITION_START and
+   *   TEST_PARTITION_END
+   * - reports the largest global window count against MAX_REQ
+   */
+
+  truth_t* truth;
+  long start_ms;
+  uint32_t before, during, after, w;
+  unsigned long total = 0;
+  pid_t pid;
+
+  truth = (truth_t*)mmap(NULL,
+                         sizeof(truth_t),
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS,
+                         -1,
+                         0);
+  if (MAP_FAILED == truth) {
+    perror("mmap");
+    return 1;
+  }
+
+  start_ms = get_current_time_ms() + 100; /* let every node bind */
+  for (int i = 0; i < TEST_NUM_NODES; i++) {
+    pid = fork();
+    if (0 == pid)
+      node_process(i, start_ms, truth);
+    else if (pid < 0)
+      perror("fork");
+  }
+
+  while (wait(NULL) > 0)
+    ;
+
+  printf("limit %d per %d ms per tenant, %d nodes "
+         "(%d if every node enforced it alone)\n",
+         MAX_REQ,
+         WINDOW_SIZE,
+         TEST_NUM_NODES,
+         MAX_REQ * TEST_NUM_NODES);
+  for (int t = 0; t < TEST_NUM_TENANTS; t++) {
+    before = max_window(truth, t, 0, TEST_PARTITION_START);
+    during = max_window(truth, t, TEST_PARTITION_START, TEST_PARTITION_END);
+    after = max_window(
+      truth, t, TEST_PARTITION_END + WINDOW_SIZE, TEST_DURATION);
+    w = 0;
+    for (int ms = 0; ms < TEST_DURATION; ms++)
+      w += truth->admitted[t][ms];
+    total += w;
+    printf("tenant %d: max window: %u before, %u partitioned, %u healed; "
+           "admitted %u\n",
+           t,
+           before,
+           during,
+           after,
+           w);
+  }
+  printf("utilization: %.0f%%\n",
+         100.0 * total /
+           ((double)MAX_REQ * TEST_NUM_TENANTS * TEST_DURATION / WINDOW_SIZE));
+
+  munmap(truth, sizeof(truth_t));
+
+  return 0;
+}
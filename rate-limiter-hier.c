@@ -0,0 +1,353 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-hier.c
+ *
+ * DESCRIPTION:
+ *   Sample MT-Safe hierarchical sliding window rate limiter. A request
+ *   from a user is admitted only if the user, its tenant and the global
+ *   limit all have room, evaluated as a single decision.
+ *
+ * NOTES:
+ *   1. Decisions use reserve-then-commit semantics: every level of the
+ *      chain is locked and checked first, and the request timestamp is
+ *      recorded at all levels only if none of them denies. A request
+ *      denied at the user level therefore never consumes tenant or
+ *      global quota.
+ *
+ *   2. Locks are taken leaf to root (user, tenant, global). As the
+ *      levels form a tree, every chain acquires locks in the same level
+ *      order, so there is no deadlock; and the common user-level denial
+ *      never touches the shared global lock.
+ *
+ *   3. All windows live in one array (global first, then tenants, then
+ *      users), and a user's parents are found by index arithmetic, so a
+ *      decision needs no lookups and the hot parent windows stay packed
+ *      together. Timestamps are kept in fixed ring buffers carved out
+ *      of one slot pool, sized by the limit of each level.
+ *
+ *   4. Counters (rate-limiter-stats.h) are kept with the levels as
+ *      classes: an admission counts as allowed at every level, since
+ *      each window records it, a denial counts at the level that
+ *      denied, and expirations and lock waits at the level of their
+ *      window. They are dumped in OpenMetrics text at exit.
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rate-limiter-stats.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 100      /* Active tenants       */
+#define USERS_PER_TENANT 16  /* Users per tenant     */
+#define MAX_USERS (MAX_TENANTS * USERS_PER_TENANT)
+
+#define LEVEL_GLOBAL 0
+#define LEVEL_TENANT 1
+#define LEVEL_USER 2
+#define NUM_LEVELS 3
+#define LEVEL_NONE -1
+
+#define GLOBAL_WINDOW_SIZE 1000 /* Miliseconds (1s)     */
+#define GLOBAL_MAX_REQ 500
+#define TENANT_WINDOW_SIZE 1000
+#define TENANT_MAX_REQ 100
+#define USER_WINDOW_SIZE 1000
+#define USER_MAX_REQ 10
+
+#define NUM_WINDOWS (1 + MAX_TENANTS + MAX_USERS)
+#define NUM_SLOTS                                                            \
+  (GLOBAL_MAX_REQ + MAX_TENANTS * TENANT_MAX_REQ + MAX_USERS * USER_MAX_REQ)
+
+#define NUM_THREADS 4
+#define TEST_NUM_TENANTS 8
+#define TEST_MAX_REQUESTS 20000
+#define TEST_REQ_DELAY 50
+
+typedef struct
+{
+  const char* name;
+  long window_size;
+  unsigned int max_req;
+} level_config_t;
+
+static const level_config_t level_config[NUM_LEVELS] = {
+  { "global", GLOBAL_WINDOW_SIZE, GLOBAL_MAX_REQ },
+  { "tenant", TENANT_WINDOW_SIZE, TENANT_MAX_REQ },
+  { "user", USER_WINDOW_SIZE, USER_MAX_REQ },
+};
+
+static rl_stats_t stats = { .engine = "hier",
+                            .nclasses = NUM_LEVELS,
+                            .class_names = { "global", "tenant", "user" } };
+
+/* Sliding window log over a fixed ring of timestamps */
+typedef struct
+{
+  pthread_mutex_t lock;
+  long* slots;           /* ring buffer, max_req entries */
+  unsigned int head;     /* oldest timestamp */
+  unsigned int size;
+  unsigned int capacity; /* max_req of the level */
+  int level;
+} window_t;
+
+typedef struct
+{
+  window_t windows[NUM_WINDOWS]; /* global, tenants..., users... */
+  long* slot_pool;
+} hier_limiter_t;
+
+/* Ring buffer helpers */
+
+static inline void
+window_expire(window_t* w, long timestamp)
+{
+  long window_size = level_config[w->level].window_size;
+
+  while (w->size && (timestamp - w->slots[w->head] >= window_size)) {
+    if (++w->head == w->capacity)
+      w->head = 0;
+    w->size--;
+    rl_stats_inc(&stats, w->level, RL_STAT_EXPIRED);
+  }
+}
+
+static inline void
+window_push(window_t* w, long timestamp)
+{
+  unsigned int tail = w->head + w->size;
+
+  if (tail >= w->capacity)
+    tail -= w->capacity;
+  w->slots[tail] = timestamp;
+  w->size++;
+}
+
+static void
+window_init(window_t* w, int level, long* slots)
+{
+  pthread_mutex_init(&w->lock, NULL);
+  w->slots = slots;
+  w->head = 0;
+  w->size = 0;
+  w->capacity = level_config[level].max_req;
+  w->level = level;
+}
+
+/* Hierarchical limiter */
+
+static inline window_t*
+tenant_window(hier_limiter_t* rl, unsigned int tenant_id)
+{
+  return &rl->windows[1 + tenant_id];
+}
+
+static inline window_t*
+user_window(hier_limiter_t* rl, unsigned int user_id)
+{
+  return &rl->windows[1 + MAX_TENANTS + user_id];
+}
+
+unsigned int
+initialize_limiter(hier_limiter_t** rl)
+{
+  long* slots = NULL;
+
+  *rl = (hier_limiter_t*)malloc(sizeof(hier_limiter_t));
+  if (NULL == *rl)
+    return FAILURE;
+
+  (*rl)->slot_pool = slots = (long*)malloc(NUM_SLOTS * sizeof(long));
+  if (NULL == slots) {
+    free(*rl);
+    *rl = NULL;
+    return FAILURE;
+  }
+
+  /* Parents first so that the shared windows are adjacent in memory */
+  window_init(&(*rl)->windows[0], LEVEL_GLOBAL, slots);
+  slots += GLOBAL_MAX_REQ;
+
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    window_init(tenant_window(*rl, i), LEVEL_TENANT, slots);
+    slots += TENANT_MAX_REQ;
+  }
+
+  for (int i = 0; i < MAX_USERS; i++) {
+    window_init(user_window(*rl, i), LEVEL_USER, slots);
+    slots += USER_MAX_REQ;
+  }
+
+  return SUCCESS;
+}
+
+void
+destroy_limiter(hier_limiter_t* rl)
+{
+  if (NULL == rl)
+    return;
+
+  for (int i = 0; i < NUM_WINDOWS; i++)
+    pthread_mutex_destroy(&rl->windows[i].lock);
+
+  free(rl->slot_pool);
+  free(rl);
+}
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/*
+ * Admit a request of user_id against the user, tenant and global
+ * windows. On FAILURE, *denied_level is set to the first level (from
+ * the leaf) that had no room; on SUCCESS it is LEVEL_NONE.
+ */
+int
+check_hier_allowed(hier_limiter_t* rl,
+                   unsigned int user_id,
+                   long timestamp,
+                   int* denied_level)
+{
+  window_t* chain[NUM_LEVELS];
+  int level, locked = 0;
+
+  chain[LEVEL_USER] = user_window(rl, user_id);
+  chain[LEVEL_TENANT] = tenant_window(rl, user_id / USERS_PER_TENANT);
+  chain[LEVEL_GLOBAL] = &rl->windows[0];
+
+  *denied_level = LEVEL_NONE;
+
+  /* Reserve: lock and check leaf to root, stopping at the first denial */
+  for (level = NUM_LEVELS - 1; level >= 0; level--) {
+    if (0 != pthread_mutex_trylock(&chain[level]->lock)) {
+      rl_stats_inc(&stats, level, RL_STAT_CONTENDED);
+      pthread_mutex_lock(&chain[level]->lock);
+    }
+    locked++;
+    window_expire(chain[level], timestamp);
+    if (chain[level]->size >= chain[level]->capacity) {
+      *denied_level = level;
+      break;
+    }
+  }
+
+  /* Commit: every level had room */
+  if (LEVEL_NONE == *denied_level) {
+    for (level = 0; level < NUM_LEVELS; level++) {
+      window_push(chain[level], timestamp);
+      rl_stats_inc(&stats, level, RL_STAT_ALLOWED);
+    }
+  } else {
+    rl_stats_inc(&stats, *denied_level, RL_STAT_DENIED);
+  }
+
+  for (level = NUM_LEVELS - locked; level < NUM_LEVELS; level++)
+    pthread_mutex_unlock(&chain[level]->lock);
+
+  return (LEVEL_NONE == *denied_level) ? SUCCESS : FAILURE;
+}
+
+typedef struct
+{
+  hier_limiter_t* rl;
+  unsigned int seed;
+  unsigned long allowed;
+  unsigned long denied[NUM_LEVELS];
+} client_arg_t;
+
+void*
+client_thread(void* arg)
+{
+  client_arg_t* c = (client_arg_t*)arg;
+  long curr_time_ms = 0;
+  unsigned int user_id = 0;
+  int denied_level;
+
+  for (int i = 0; i <= TEST_MAX_REQUESTS; i++) {
+    curr_time_ms = get_current_time_ms();
+#ifdef RANDOM
+    user_id = rand_r(&c->seed) % (TEST_NUM_TENANTS * USERS_PER_TENANT);
+#else
+    user_id = (user_id + 1) % (TEST_NUM_TENANTS * USERS_PER_TENANT);
+#endif
+    if (SUCCESS ==
+        check_hier_allowed(c->rl, user_id, curr_time_ms, &denied_level)) {
+      c->allowed++;
+    } else {
+      c->denied[denied_level]++;
+    }
+#if DEBUG
+    printf("[%lx] User %u (tenant %u) - Request %s: %d\n",
+           pthread_self(),
+           user_id,
+           user_id / USERS_PER_TENANT,
+           (LEVEL_NONE == denied_level) ? "allowed"
+                                        : level_config[denied_level].name,
+           i);
+#endif
+    usleep(TEST_REQ_DELAY);
+  }
+
+  return NULL;
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - NUM_THREADS clients sending requests for users of a few tenants
+   * - per level limits as per level_config
+   * - summary of admissions and denials by level at the end
+   */
+
+  hier_limiter_t* rl = NULL;
+  pthread_t threads[NUM_THREADS];
+  client_arg_t args[NUM_THREADS];
+  unsigned long allowed = 0, denied[NUM_LEVELS] = { 0 };
+
+  if (SUCCESS != initialize_limiter(&rl)) {
+    fprintf(stderr, "failed to allocate limiter\n");
+    return 1;
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    memset(&args[i], 0, sizeof(args[i]));
+    args[i].rl = rl;
+    args[i].seed = time(NULL) + i;
+    pthread_create(&threads[i], NULL, client_thread, &args[i]);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    allowed += args[i].allowed;
+    for (int level = 0; level < NUM_LEVELS; level++)
+      denied[level] += args[i].denied[level];
+  }
+
+  printf("allowed: %lu\n", allowed);
+  for (int level = NUM_LEVELS - 1; level >= 0; level--) {
+    printf("denied at %s level (limit %u / %ld ms): %lu\n",
+           level_config[level].name,
+           level_config[level].max_req,
+           level_config[level].window_size,
+           denied[level]);
+  }
+  rl_stats_dump(&stats, stdout, 1.0); /* all windows are preallocated */
+
+  destroy_limiter(rl);
+
+  return 0;
+}
@@ -0,0 +1,223 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-hist.h
+ *
+ * DESCRIPTION:
+ *   Latency histograms for the limiter engines, compiled in with
+ *   -DRL_HISTOGRAMS.
+ *
+ * NOTES:
+ *   1. Buckets are log-linear, as in HdrHistogram: values below
+ *      RL_HIST_SUB are exact, above that every power of two is split
+ *      into RL_HIST_SUB buckets, so a bucket is never wider than 1/16
+ *      (6.25%) of its value, from nanoseconds up to the full 64 bits.
+ *
+ *   2. Every thread records into its own shard, on its own cache lines,
+ *      with plain relaxed loads and stores, as in rate-limiter-stats.h.
+ *      Shards are merged only when read. Threads past the first
+ *      RL_HIST_MAX_THREADS - 1 share the last shard and use atomic
+ *      adds.
+ *
+ *   3. rl_hist_dump() writes a histogram as an OpenMetrics summary
+ *      (p50 to p99.9 and max, in seconds), meant to be called from the
+ *      extra hook of rl_stats_t so it lands in the same scrape.
+ *
+ *   4. RL_HIST_DEFINE() keeps the shards in their own zero initialized
+ *      array, so the megabyte of counters of a histogram lands in .bss
+ *      and only its name and help strings take room in .data.
+ *
+ *   5. Without -DRL_HISTOGRAMS, RL_HIST_START(), RL_HIST_RECORD() and
+ *      RL_HIST_ADD() compile to nothing, so engines can leave them in
+ *      their hot path.
+ *
+ */
+
+#ifndef RATE_LIMITER_HIST_H
+#define RATE_LIMITER_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RL_HIST_MAX_THREADS 64
+#define RL_HIST_SUB_BITS 4
+#define RL_HIST_SUB (1 << RL_HIST_SUB_BITS)
+#define RL_HIST_BUCKETS ((64 - RL_HIST_SUB_BITS + 1) * RL_HIST_SUB)
+
+#ifdef RL_HISTOGRAMS
+#define RL_HIST_START() rl_hist_now()
+#define RL_HIST_RECORD(h, start) rl_hist_record((h), rl_hist_now() - (start))
+#define RL_HIST_ADD(h, ns) rl_hist_record((h), (ns))
+#else
+#define RL_HIST_START() 0
+#define RL_HIST_RECORD(h, start) ((void)(start))
+#define RL_HIST_ADD(h, ns) ((void)0)
+#endif
+
+typedef struct
+{
+  _Alignas(64) uint64_t count[RL_HIST_BUCKETS];
+  uint64_t total;
+  uint64_t sum; /* Nanoseconds          */
+  uint64_t max;
+} rl_hist_shard_t;
+
+typedef struct
+{
+  const char* name; /* metric family, in seconds */
+  const char* help;
+  rl_hist_shard_t* shards; /* RL_HIST_MAX_THREADS */
+} rl_hist_t;
+
+/* A static histogram var, see note 4 */
+#define RL_HIST_DEFINE(var, n, h)                                            \
+  static rl_hist_shard_t var##_shards[RL_HIST_MAX_THREADS];                  \
+  static rl_hist_t var = { .name = (n), .help = (h), .shards = var##_shards }
+
+static int rl_hist_nthreads;
+static __thread int rl_hist_tid = -1;
+
+static inline uint64_t
+rl_hist_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline unsigned int
+rl_hist_bucket(uint64_t v)
+{
+  unsigned int e;
+
+  if (v < RL_HIST_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  return (e - RL_HIST_SUB_BITS + 1) * RL_HIST_SUB +
+         ((v >> (e - RL_HIST_SUB_BITS)) & (RL_HIST_SUB - 1));
+}
+
+/* Highest value that falls into bucket b */
+static inline uint64_t
+rl_hist_bucket_max(unsigned int b)
+{
+  unsigned int e, shift;
+
+  if (b < RL_HIST_SUB)
+    return b;
+  e = b / RL_HIST_SUB + RL_HIST_SUB_BITS - 1;
+  shift = e - RL_HIST_SUB_BITS;
+  return ((uint64_t)(RL_HIST_SUB + b % RL_HIST_SUB) << shift) +
+         ((1ULL << shift) - 1);
+}
+
+static inline void
+rl_hist_store_add(uint64_t* p, uint64_t n, int shared)
+{
+  if (shared)
+    __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+  else
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static inline void
+rl_hist_record(rl_hist_t* h, uint64_t ns)
+{
+  int tid = rl_hist_tid;
+  rl_hist_shard_t* s;
+  int shared;
+
+  if (tid < 0) {
+    tid = __atomic_fetch_add(&rl_hist_nthreads, 1, __ATOMIC_RELAXED);
+    rl_hist_tid = tid < RL_HIST_MAX_THREADS ? tid : RL_HIST_MAX_THREADS - 1;
+    tid = rl_hist_tid;
+  }
+  s = &h->shards[tid];
+  shared = RL_HIST_MAX_THREADS - 1 == tid;
+
+  rl_hist_store_add(&s->count[rl_hist_bucket(ns)], 1, shared);
+  rl_hist_store_add(&s->total, 1, shared);
+  rl_hist_store_add(&s->sum, ns, shared);
+  if (ns > __atomic_load_n(&s->max, __ATOMIC_RELAXED))
+    __atomic_store_n(&s->max, ns, __ATOMIC_RELAXED); /* racy if shared */
+}
+
+/* Sum all shards into out */
+static inline void
+rl_hist_merge(const rl_hist_t* h, rl_hist_shard_t* out)
+{
+  int nthreads = __atomic_load_n(&rl_hist_nthreads, __ATOMIC_RELAXED);
+  const rl_hist_shard_t* s;
+  uint64_t max;
+
+  if (nthreads > RL_HIST_MAX_THREADS)
+    nthreads = RL_HIST_MAX_THREADS;
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < nthreads; i++) {
+    s = &h->shards[i];
+    for (int b = 0; b < RL_HIST_BUCKETS; b++)
+      out->count[b] += __atomic_load_n(&s->count[b], __ATOMIC_RELAXED);
+    out->total += __atomic_load_n(&s->total, __ATOMIC_RELAXED);
+    out->sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&s->max, __ATOMIC_RELAXED);
+    out->max = max > out->max ? max : out->max;
+  }
+}
+
+/* Value at quantile q (0..1) of a merged histogram, in nanoseconds */
+static inline uint64_t
+rl_hist_quantile(const rl_hist_shard_t* m, double q)
+{
+  uint64_t rank = (uint64_t)(q * m->total + 0.5), seen = 0, v;
+
+  if (rank < 1)
+    rank = 1;
+  for (int b = 0; b < RL_HIST_BUCKETS; b++) {
+    seen += m->count[b];
+    if (seen >= rank) {
+      v = rl_hist_bucket_max(b);
+      return v < m->max ? v : m->max;
+    }
+  }
+
+  return m->max;
+}
+
+static inline void
+rl_hist_dump(const rl_hist_t* h, FILE* out, const char* engine)
+{
+  static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+  static rl_hist_shard_t m; /* too large for a small stack; one scraper */
+
+  rl_hist_merge(h, &m);
+  fprintf(out,
+          "# TYPE %s summary\n# UNIT %s seconds\n# HELP %s %s\n",
+          h->name,
+          h->name,
+          h->name,
+          h->help);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+    fprintf(out,
+            "%s{engine=\"%s\",quantile=\"%g\"} %.9f\n",
+            h->name,
+            engine,
+            quantiles[i],
+            rl_hist_quantile(&m, quantiles[i]) / 1e9);
+  }
+  fprintf(out,
+          "%s{engine=\"%s\",quantile=\"1\"} %.9f\n"
+          "%s_sum{engine=\"%s\"} %.9f\n"
+          "%s_count{engine=\"%s\"} %llu\n",
+          h->name,
+          engine,
+          m.max / 1e9,
+          h->name,
+          engine,
+          m.sum / 1e9,
+          h->name,
+          engine,
+          (unsigned long long)m.total);
+}
+
+#endif /* RATE_LIMITER_HIST_H */
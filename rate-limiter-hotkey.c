@@ -0,0 +1,572 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-hotkey.c
+ *
+ * DESCRIPTION:
+ *   Sample MT-Safe sliding window rate limiter that detects contended
+ *   (hot) tenants and moves them from the compact queue representation
+ *   to per-CPU striped counters, and back again once they cool down.
+ *
+ * NOTES:
+ *   1. Every tenant starts compact: a timestamp queue behind qlock, as
+ *      in rate-limiter-mt.c. Contention is tracked with lock-wait
+ *      counters: qlock is first tried with pthread_mutex_trylock(), and
+ *      only a failed try (a thread had to wait) bumps the counter, so
+ *      uncontended tenants pay nothing extra.
+ *
+ *   2. A tenant with PROMOTE_THRESHOLD lock waits within one
+ *      CONTENTION_PERIOD is promoted: its queued timestamps are folded
+ *      into the bucket counters of a striped representation (see
+ *      rate-limiter-striped.c) and qlock becomes the lock of its exact
+ *      slow path.
+ *
+ *   3. A striped tenant is reviewed once per COOL_PERIOD. If fewer than
+ *      DEMOTE_THRESHOLD requests were admitted in the last window it is
+ *      demoted: the fast path is shut off and the bucket counts are
+ *      turned back into queue timestamps, stamped with the end of their
+ *      bucket so that they never expire early.
+ *
+ *   4. Threads may still be running on the striped fast path of a
+ *      tenant while it is demoted, so the striped state of a tenant is
+ *      kept (and reused on the next promotion) rather than freed.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+#define SLOW_PATH 2
+
+#define MAX_TENANTS 100    /* Active tenants       */
+#define WINDOW_SIZE 1000   /* Miliseconds (1s)     */
+#define MAX_REQ 100000     /* Per tenant limit     */
+#define NUM_BUCKETS 10
+#define BUCKET_SIZE (WINDOW_SIZE / NUM_BUCKETS)
+#define RING_BUCKETS (NUM_BUCKETS + 1)
+#define MAX_STRIPES 64
+#define CACHE_LINE 64
+
+#define CONTENTION_PERIOD 100 /* Miliseconds          */
+#define PROMOTE_THRESHOLD 8   /* Lock waits / period  */
+#define COOL_PERIOD 1000      /* Miliseconds          */
+#define DEMOTE_THRESHOLD (MAX_REQ / 10) /* Admits / window */
+
+#define MODE_COMPACT 0
+#define MODE_STRIPED 1
+
+#define NUM_THREADS 4
+#define TEST_NUM_TENANTS 10
+#define TEST_PHASE 2000 /* Miliseconds per hot tenant */
+#define TEST_NUM_PHASES 3
+#define TEST_HOT_PERMILLE 999
+
+/* Dequeue implementation (Ideally should be separate files) */
+
+typedef struct node
+{
+  long data; /* request timestamp */
+  struct node* next;
+} qnode_t;
+
+typedef struct
+{
+  qnode_t* head;
+  qnode_t* tail;
+  unsigned int size;
+} queue_t;
+
+qnode_t*
+allocate_node(long data)
+{
+  qnode_t* temp = (qnode_t*)malloc(sizeof(qnode_t));
+  if (NULL == temp)
+    return NULL;
+
+  temp->data = data;
+  temp->next = NULL;
+  return temp;
+}
+
+unsigned int
+initialize_queue(queue_t** q, long data)
+{
+  *q = (queue_t*)malloc(sizeof(queue_t));
+  if (NULL == *q)
+    return FAILURE;
+
+  (*q)->head = (*q)->tail = allocate_node(data);
+  if (NULL == (*q)->head)
+    return FAILURE;
+
+  (*q)->size = 1;
+  return SUCCESS;
+}
+
+void
+destroy_queue(queue_t* q)
+{
+  qnode_t *temp = NULL, *next = NULL;
+  if (NULL == q)
+    return;
+
+  temp = q->head;
+  next = NULL;
+
+  while (NULL != temp) {
+    next = temp->next;
+    free(temp);
+    temp = next;
+  }
+  q->head = q->tail = NULL;
+  free(q);
+}
+
+unsigned int
+enqueue(queue_t** q, long data)
+{
+  qnode_t* temp = NULL;
+  if (NULL == *q)
+    return initialize_queue(q, data);
+  else if (NULL == (temp = allocate_node(data)))
+    return FAILURE;
+
+  if ((*q)->size) {
+    (*q)->tail->next = temp;
+  } else {
+    (*q)->head = temp;
+  }
+
+  (*q)->tail = temp;
+  (*q)->size++;
+
+  return SUCCESS;
+}
+
+long
+dequeue(queue_t** q)
+{
+  long data;
+  qnode_t* p = NULL;
+
+  /* uninitialized queue */
+  if (NULL == *q || NULL == (*q)->head)
+    return -1;
+
+  p = (*q)->head;
+  (*q)->head = (*q)->head->next;
+
+  /* if last node */
+  if (NULL == (*q)->head)
+    (*q)->tail = NULL;
+
+  (*q)->size--;
+
+  data = p->data;
+  free(p);
+
+  return data;
+}
+
+/* Striped representation; each word is (epoch/generation << 32 | count) */
+
+typedef struct
+{
+  _Alignas(CACHE_LINE) _Atomic uint64_t bucket[RING_BUCKETS];
+  _Atomic uint64_t lease;
+} stripe_t;
+
+typedef struct
+{
+  _Alignas(CACHE_LINE) _Atomic uint64_t share; /* generation, quota */
+  _Atomic long review_time;                    /* next cool down check */
+  stripe_t stripes[MAX_STRIPES];
+} striped_t;
+
+#define WORD_TAG(w) ((uint32_t)((w) >> 32))
+#define WORD_COUNT(w) ((uint32_t)(w))
+#define MAKE_WORD(tag, count) (((uint64_t)(tag) << 32) | (uint32_t)(count))
+
+static unsigned int nstripes = 1;
+
+static inline void
+stripe_reserve(stripe_t* s, uint32_t epoch, uint32_t n)
+{
+  _Atomic uint64_t* b = &s->bucket[epoch % RING_BUCKETS];
+  uint64_t old = atomic_load_explicit(b, memory_order_relaxed), new;
+
+  do {
+    /* current, or a little ahead of a racing older timestamp */
+    if ((uint32_t)(WORD_TAG(old) - epoch) < RING_BUCKETS)
+      new = MAKE_WORD(WORD_TAG(old), WORD_COUNT(old) + n);
+    else
+      new = MAKE_WORD(epoch, n);
+  } while (!atomic_compare_exchange_weak(b, &old, new));
+}
+
+static inline void
+stripe_release(stripe_t* s, uint32_t epoch)
+{
+  _Atomic uint64_t* b = &s->bucket[epoch % RING_BUCKETS];
+  uint64_t old = atomic_load_explicit(b, memory_order_relaxed);
+
+  do {
+    if (WORD_TAG(old) != epoch || 0 == WORD_COUNT(old))
+      return;
+  } while (!atomic_compare_exchange_weak(b, &old, old - 1));
+}
+
+/* Fast path quota per stripe; in-flight reservations may overshoot */
+static inline uint32_t
+striped_quota(unsigned long count)
+{
+  return (count < MAX_REQ) ? (MAX_REQ - count) / nstripes : 0;
+}
+
+/* Admits per bucket of the window ending in epoch, oldest first */
+static unsigned long
+striped_counts(striped_t* h, uint32_t epoch, unsigned long* counts)
+{
+  unsigned long total = 0;
+  uint32_t age;
+  uint64_t w;
+
+  memset(counts, 0, RING_BUCKETS * sizeof(unsigned long));
+  for (unsigned int i = 0; i < nstripes; i++) {
+    for (int b = 0; b < RING_BUCKETS; b++) {
+      w = atomic_load(&h->stripes[i].bucket[b]);
+      age = epoch - WORD_TAG(w);
+      if ((uint32_t)(WORD_TAG(w) - epoch) < RING_BUCKETS)
+        age = 0; /* a little ahead: counts as current */
+      if (age < RING_BUCKETS) {
+        counts[RING_BUCKETS - 1 - age] += WORD_COUNT(w);
+        total += WORD_COUNT(w);
+      }
+    }
+  }
+
+  return total;
+}
+
+/* Tenant table */
+
+typedef struct
+{
+  pthread_mutex_t qlock;
+  _Atomic int mode;
+  _Atomic unsigned int contention; /* lock waits in this period */
+  long period_start;
+  queue_t* q;  /* MODE_COMPACT */
+  striped_t* hot; /* MODE_STRIPED (kept once allocated) */
+  unsigned long promotions;
+  unsigned long demotions;
+} tenant_t;
+
+/* Rate limiter functionality and helper functions */
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+static inline void
+lock_tenant(tenant_t* t)
+{
+  if (pthread_mutex_trylock(&t->qlock)) {
+    atomic_fetch_add_explicit(&t->contention, 1, memory_order_relaxed);
+    pthread_mutex_lock(&t->qlock);
+  }
+}
+
+/* Called with qlock held */
+static void
+promote_tenant(tenant_t* t, long timestamp)
+{
+  striped_t* h = t->hot;
+  unsigned long count = 0;
+  long data;
+
+  if (NULL == h) {
+    h = (striped_t*)aligned_alloc(CACHE_LINE, sizeof(striped_t));
+    if (NULL == h)
+      return;
+    memset(h, 0, sizeof(striped_t));
+    t->hot = h;
+  }
+
+  /* fold the window into stripe 0; the ring may hold stale epochs */
+  for (int b = 0; b < RING_BUCKETS; b++)
+    atomic_store(&h->stripes[0].bucket[b], 0);
+  for (unsigned int i = 1; i < nstripes; i++) {
+    for (int b = 0; b < RING_BUCKETS; b++) {
+      uint64_t w = atomic_load(&h->stripes[i].bucket[b]);
+      if (WORD_COUNT(w))
+        atomic_store(&h->stripes[i].bucket[b], MAKE_WORD(WORD_TAG(w), 0));
+    }
+  }
+  while (t->q && t->q->head) {
+    data = dequeue(&t->q);
+    stripe_reserve(&h->stripes[0], (uint32_t)(data / BUCKET_SIZE), 1);
+    count++;
+  }
+  destroy_queue(t->q);
+  t->q = NULL;
+
+  atomic_store(&h->share,
+               MAKE_WORD(WORD_TAG(atomic_load(&h->share)) + 1,
+                         striped_quota(count)));
+  atomic_store(&h->review_time, timestamp + COOL_PERIOD);
+  atomic_store_explicit(&t->mode, MODE_STRIPED, memory_order_release);
+  t->promotions++;
+  printf("promoted tenant (window count = %lu)\n", count);
+}
+
+/* Called with qlock held and the striped fast path shut off */
+static void
+demote_tenant(tenant_t* t, long timestamp, unsigned long* counts)
+{
+  long stamp;
+
+  /* from the full timestamp: the 32-bit epoch may have wrapped */
+  for (int b = 0; b < RING_BUCKETS; b++) {
+    stamp = (timestamp / BUCKET_SIZE - (RING_BUCKETS - 1 - b)) * BUCKET_SIZE +
+            BUCKET_SIZE - 1;
+    for (unsigned long i = 0; i < counts[b]; i++)
+      enqueue(&t->q, stamp);
+  }
+
+  atomic_store_explicit(&t->mode, MODE_COMPACT, memory_order_release);
+  atomic_store(&t->contention, 0);
+  t->demotions++;
+  printf("demoted tenant (window count = %u)\n", t->q ? t->q->size : 0);
+}
+
+/* Exact striped decision, called with qlock held */
+static int
+check_striped_exact(tenant_t* t, long timestamp, uint32_t epoch)
+{
+  striped_t* h = t->hot;
+  unsigned long counts[RING_BUCKETS], count;
+  uint32_t gen;
+  int result;
+
+  gen = WORD_TAG(atomic_load(&h->share)) + 1;
+  atomic_store(&h->share, MAKE_WORD(gen, 0));
+
+  count = striped_counts(h, epoch, counts);
+
+  if (timestamp >= atomic_load(&h->review_time)) {
+    if (count < DEMOTE_THRESHOLD) {
+      demote_tenant(t, timestamp, counts);
+      return SLOW_PATH;
+    }
+    atomic_store(&h->review_time, timestamp + COOL_PERIOD);
+  }
+
+  if (count < MAX_REQ) {
+    stripe_reserve(&h->stripes[0], epoch, 1);
+    count++;
+    result = SUCCESS;
+  } else {
+    result = FAILURE;
+  }
+
+  atomic_store(&h->share, MAKE_WORD(gen + 1, striped_quota(count)));
+
+  return result;
+}
+
+static int
+check_striped_fast(tenant_t* t, long timestamp, uint32_t epoch)
+{
+  striped_t* h = t->hot;
+  int cpu = sched_getcpu();
+  stripe_t* s = &h->stripes[(cpu < 0 ? 0 : cpu) % nstripes];
+  uint64_t share, lease, used;
+
+  if (timestamp >= atomic_load_explicit(&h->review_time,
+                                        memory_order_relaxed))
+    return SLOW_PATH;
+
+  stripe_reserve(s, epoch, 1);
+
+  lease = atomic_load_explicit(&s->lease, memory_order_relaxed);
+  do {
+    share = atomic_load(&h->share);
+    used = (WORD_TAG(lease) == WORD_TAG(share)) ? WORD_COUNT(lease) : 0;
+    if (used >= WORD_COUNT(share)) {
+      stripe_release(s, epoch);
+      return SLOW_PATH;
+    }
+  } while (!atomic_compare_exchange_weak(
+    &s->lease, &lease, MAKE_WORD(WORD_TAG(share), used + 1)));
+
+  return SUCCESS;
+}
+
+/* Compact decision, called with qlock held */
+static int
+check_compact(tenant_t* t, long timestamp)
+{
+  while (t->q && t->q->head && (timestamp - t->q->head->data >= WINDOW_SIZE))
+    dequeue(&t->q);
+
+  if (timestamp - t->period_start >= CONTENTION_PERIOD) {
+    if (atomic_exchange(&t->contention, 0) >= PROMOTE_THRESHOLD)
+      promote_tenant(t, timestamp);
+    t->period_start = timestamp;
+    if (MODE_STRIPED == atomic_load(&t->mode))
+      return SLOW_PATH;
+  }
+
+  if (!t->q || t->q->size < MAX_REQ) {
+    enqueue(&t->q, timestamp);
+    return SUCCESS;
+  } else {
+    return FAILURE;
+  }
+}
+
+int
+check_allowed(tenant_t* t, long timestamp)
+{
+  uint32_t epoch = (uint32_t)(timestamp / BUCKET_SIZE);
+  int result;
+
+  if (MODE_STRIPED == atomic_load_explicit(&t->mode, memory_order_acquire)) {
+    result = check_striped_fast(t, timestamp, epoch);
+    if (SLOW_PATH != result)
+      return result;
+  }
+
+  lock_tenant(t);
+  do {
+    if (MODE_STRIPED == atomic_load(&t->mode))
+      result = check_striped_exact(t, timestamp, epoch);
+    else
+      result = check_compact(t, timestamp);
+  } while (SLOW_PATH == result);
+  pthread_mutex_unlock(&t->qlock);
+
+  return result;
+}
+
+void
+initialize_tenants(tenant_t* tenants)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+  nstripes = (ncpus < 1) ? 1 : (ncpus > MAX_STRIPES) ? MAX_STRIPES : ncpus;
+
+  memset(tenants, 0, MAX_TENANTS * sizeof(tenant_t));
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_init(&tenants[i].qlock, NULL);
+}
+
+void
+destroy_tenants(tenant_t* tenants)
+{
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    destroy_queue(tenants[i].q);
+    free(tenants[i].hot);
+    pthread_mutex_destroy(&tenants[i].qlock);
+  }
+}
+
+typedef struct
+{
+  tenant_t* tenants;
+  unsigned int seed;
+  long start_time_ms;
+  unsigned long allowed;
+  unsigned long denied;
+} client_arg_t;
+
+void*
+client_thread(void* arg)
+{
+  client_arg_t* c = (client_arg_t*)arg;
+  long curr_time_ms = 0, elapsed;
+  int tenant_id, hot_id;
+
+  for (;;) {
+    curr_time_ms = get_current_time_ms();
+    elapsed = curr_time_ms - c->start_time_ms;
+    if (elapsed >= TEST_PHASE * TEST_NUM_PHASES)
+      break;
+
+    /* skewed load, the hot tenant changes every phase */
+    hot_id = elapsed / TEST_PHASE;
+    for (int i = 0; i < 64; i++) {
+      if (rand_r(&c->seed) % 1000 < TEST_HOT_PERMILLE)
+        tenant_id = hot_id;
+      else
+        tenant_id = rand_r(&c->seed) % TEST_NUM_TENANTS;
+
+      if (SUCCESS == check_allowed(&c->tenants[tenant_id], curr_time_ms))
+        c->allowed++;
+      else
+        c->denied++;
+    }
+  }
+
+  return NULL;
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - NUM_THREADS clients, most requests going to one hot tenant
+   * - the hot tenant changes every TEST_PHASE ms, so earlier hot
+   *   tenants cool down and are demoted again
+   */
+
+  static tenant_t tenants[MAX_TENANTS];
+  pthread_t threads[NUM_THREADS];
+  client_arg_t args[NUM_THREADS];
+  unsigned long allowed = 0, denied = 0;
+  long start_ms;
+
+  initialize_tenants(tenants);
+
+  start_ms = get_current_time_ms();
+  for (int i = 0; i < NUM_THREADS; i++) {
+    memset(&args[i], 0, sizeof(args[i]));
+    args[i].tenants = tenants;
+    args[i].seed = time(NULL) + i;
+    args[i].start_time_ms = start_ms;
+    pthread_create(&threads[i], NULL, client_thread, &args[i]);
+  }
+
+  for (int i = 0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    allowed += args[i].allowed;
+    denied += args[i].denied;
+  }
+
+  for (int i = 0; i < TEST_NUM_TENANTS; i++) {
+    printf("Tenant %d - mode: %s, promotions: %lu, demotions: %lu\n",
+           i,
+           (MODE_STRIPED == tenants[i].mode) ? "striped" : "compact",
+           tenants[i].promotions,
+           tenants[i].demotions);
+  }
+  printf("allowed: %lu, denied: %lu\n", allowed, denied);
+
+  destroy_tenants(tenants);
+
+  return 0;
+}
@@ -0,0 +1,343 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-loadgen.c
+ *
+ * DESCRIPTION:
+ *   Load generator for rl-server. Keeps a fixed number of admit
+ *   requests in flight per connection and reports decisions per second.
+ *
+ * NOTES:
+ *   1. Each thread owns one TCP connection (or one connected UDP
+ *      socket) and runs a closed loop: depth requests are kept
+ *      outstanding, sent in frames of batch records, and every result
+ *      frame received is answered with a new admit frame.
+ *
+ *   2. Over UDP a result that does not arrive within UDP_TIMEOUT ms is
+ *      counted as lost and its frame is sent again.
+ *
+ *   Usage: rl-loadgen [-a addr] [-p port] [-c threads] [-d depth]
+ *                     [-b batch] [-n tenants] [-s seconds] [-u]
+ *
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rate-limiter-proto.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_THREADS 256
+#define UDP_TIMEOUT 100 /* Miliseconds          */
+
+typedef struct
+{
+  struct sockaddr_in addr;
+  int udp;
+  int depth;
+  int batch;
+  unsigned int tenants;
+  long end_time_ms;
+} config_t;
+
+typedef struct
+{
+  pthread_t thread;
+  const config_t* cfg;
+  unsigned int seed;
+  uint32_t seq;
+  unsigned long allowed;
+  unsigned long denied;
+  unsigned long errors;
+  unsigned long lost;
+} client_t;
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/* Append an admit frame of batch records for random tenants */
+static size_t
+build_frame(client_t* c, unsigned char* buf)
+{
+  rl_frame_hdr_t* hdr = (rl_frame_hdr_t*)buf;
+  rl_admit_req_t* req = (rl_admit_req_t*)(hdr + 1);
+
+  rl_frame_init(hdr, RL_OP_ADMIT, c->cfg->batch);
+  for (int i = 0; i < c->cfg->batch; i++) {
+    req[i].seq = RL_LE32(c->seq++);
+    req[i].tenant_id = RL_LE32(rand_r(&c->seed) % c->cfg->tenants);
+  }
+
+  return sizeof(rl_frame_hdr_t) + c->cfg->batch * sizeof(rl_admit_req_t);
+}
+
+static void
+count_results(client_t* c, const unsigned char* buf)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)buf;
+  const rl_admit_resp_t* resp = (const rl_admit_resp_t*)(hdr + 1);
+  uint32_t count = RL_LE32(hdr->count);
+
+  for (uint32_t i = 0; i < count; i++) {
+    switch (RL_LE16(resp[i].status)) {
+      case RL_STATUS_ALLOWED:
+        c->allowed++;
+        break;
+      case RL_STATUS_DENIED:
+        c->denied++;
+        break;
+      default:
+        c->errors++;
+    }
+  }
+}
+
+static int
+send_all(int fd, const unsigned char* buf, size_t len)
+{
+  ssize_t n;
+
+  while (len) {
+    n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (EINTR == errno)
+        continue;
+      return FAILURE;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return SUCCESS;
+}
+
+static void
+run_tcp(client_t* c, int fd)
+{
+  int frames = (c->cfg->depth + c->cfg->batch - 1) / c->cfg->batch;
+  size_t in_len = 0, out_len, off, len;
+  unsigned char *in, *out;
+  ssize_t n;
+
+  in = (unsigned char*)malloc(frames * RL_MAX_FRAME);
+  out = (unsigned char*)malloc(frames * RL_MAX_FRAME);
+  if (NULL == in || NULL == out)
+    goto done;
+
+  out_len = 0;
+  for (int i = 0; i < frames; i++)
+    out_len += build_frame(c, out + out_len);
+  if (SUCCESS != send_all(fd, out, out_len))
+    goto done;
+
+  while (get_current_time_ms() < c->cfg->end_time_ms) {
+    n = recv(fd, in + in_len, frames * RL_MAX_FRAME - in_len, 0);
+    if (n <= 0) {
+      if (n < 0 && EINTR == errno)
+        continue;
+      break;
+    }
+    in_len += n;
+
+    /* one new admit frame per complete result frame */
+    off = out_len = 0;
+    while (in_len - off >= sizeof(rl_frame_hdr_t)) {
+      len = rl_frame_len((rl_frame_hdr_t*)(in + off), RL_OP_RESULT);
+      if (0 == len) {
+        c->errors++;
+        goto done;
+      }
+      if (in_len - off < len)
+        break;
+      count_results(c, in + off);
+      out_len += build_frame(c, out + out_len);
+      off += len;
+    }
+    memmove(in, in + off, in_len - off);
+    in_len -= off;
+
+    if (out_len && SUCCESS != send_all(fd, out, out_len))
+      break;
+  }
+
+done:
+  free(in);
+  free(out);
+}
+
+static void
+run_udp(client_t* c, int fd)
+{
+  int frames = (c->cfg->depth + c->cfg->batch - 1) / c->cfg->batch;
+  unsigned char in[RL_MAX_FRAME], out[RL_MAX_FRAME];
+  struct timeval tv = { 0, UDP_TIMEOUT * 1000 };
+  size_t len;
+  ssize_t n;
+
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  for (int i = 0; i < frames; i++) {
+    len = build_frame(c, out);
+    send(fd, out, len, 0);
+  }
+
+  while (get_current_time_ms() < c->cfg->end_time_ms) {
+    n = recv(fd, in, sizeof(in), 0);
+    if (n < 0) {
+      if (EAGAIN != errno && EWOULDBLOCK != errno && EINTR != errno)
+        break;
+      /* refill the window with the frames that were lost */
+      c->lost += frames;
+      for (int i = 0; i < frames; i++) {
+        len = build_frame(c, out);
+        send(fd, out, len, 0);
+      }
+      continue;
+    }
+    if ((size_t)n < sizeof(rl_frame_hdr_t) ||
+        (size_t)n != rl_frame_len((rl_frame_hdr_t*)in, RL_OP_RESULT)) {
+      c->errors++;
+      continue;
+    }
+    count_results(c, in);
+    len = build_frame(c, out);
+    send(fd, out, len, 0);
+  }
+}
+
+void*
+client_thread(void* arg)
+{
+  client_t* c = (client_t*)arg;
+  int fd, one = 1;
+
+  fd = socket(AF_INET, c->cfg->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (fd < 0 ||
+      connect(fd, (const struct sockaddr*)&c->cfg->addr,
+              sizeof(c->cfg->addr)) < 0) {
+    perror("rl-loadgen: connect");
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+
+  if (c->cfg->udp) {
+    run_udp(c, fd);
+  } else {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    run_tcp(c, fd);
+  }
+
+  close(fd);
+  return NULL;
+}
+
+int
+main(int argc, char** argv)
+{
+  static client_t clients[MAX_THREADS];
+  config_t cfg;
+  const char* addr = "127.0.0.1";
+  int port = RL_PROTO_PORT, nthreads = 1, seconds = 5, opt;
+  unsigned long allowed = 0, denied = 0, errors = 0, lost = 0;
+  long start_ms;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.depth = 1024;
+  cfg.batch = 64;
+  cfg.tenants = 1000;
+
+  while (-1 != (opt = getopt(argc, argv, "a:p:c:d:b:n:s:u"))) {
+    switch (opt) {
+      case 'a':
+        addr = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        nthreads = atoi(optarg);
+        break;
+      case 'd':
+        cfg.depth = atoi(optarg);
+        break;
+      case 'b':
+        cfg.batch = atoi(optarg);
+        break;
+      case 'n':
+        cfg.tenants = atoi(optarg);
+        break;
+      case 's':
+        seconds = atoi(optarg);
+        break;
+      case 'u':
+        cfg.udp = 1;
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-a addr] [-p port] [-c threads] [-d depth] "
+                "[-b batch] [-n tenants] [-s seconds] [-u]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (nthreads < 1 || nthreads > MAX_THREADS || cfg.batch < 1 ||
+      cfg.batch > RL_MAX_BATCH || cfg.depth < cfg.batch || cfg.tenants < 1) {
+    fprintf(stderr, "rl-loadgen: invalid arguments\n");
+    return 1;
+  }
+
+  cfg.addr.sin_family = AF_INET;
+  cfg.addr.sin_port = htons(port);
+  if (1 != inet_pton(AF_INET, addr, &cfg.addr.sin_addr)) {
+    fprintf(stderr, "rl-loadgen: invalid address %s\n", addr);
+    return 1;
+  }
+
+  start_ms = get_current_time_ms();
+  cfg.end_time_ms = start_ms + seconds * 1000L;
+  for (int i = 0; i < nthreads; i++) {
+    clients[i].cfg = &cfg;
+    clients[i].seed = time(NULL) + i;
+    pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(clients[i].thread, NULL);
+    allowed += clients[i].allowed;
+    denied += clients[i].denied;
+    errors += clients[i].errors;
+    lost += clients[i].lost;
+  }
+
+  printf("%s, %d threads, depth %d, batch %d\n",
+         cfg.udp ? "udp" : "tcp",
+         nthreads,
+         cfg.depth,
+         cfg.batch);
+  printf("allowed: %lu, denied: %lu, errors: %lu, lost: %lu\n",
+         allowed,
+         denied,
+         errors,
+         lost);
+  printf("decisions/sec: %.0f\n",
+         (allowed + denied) * 1000.0 / (get_current_time_ms() - start_ms));
+
+  return 0;
+}
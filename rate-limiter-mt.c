@@ -13,6 +13,34 @@
  *      a) Single queue with nodes containing tenant_id
  *      b) AVL / RB Trees based on tenant_id containing a single queue
  *
+ *   2. Decisions, expirations and lock contention are counted in per
+ *      thread shards (rate-limiter-stats.h) and dumped in OpenMetrics
+ *      text at exit.
+ *
+ *   3. Decisions, expirations, tenant creation and teardown also fire
+ *      USDT probes (rate-limiter-probes.h), with the address of the
+ *      tenant's queue slot as tenant; expirations are printed only with
+ *      DEBUG.
+ *
+ *   4. With -DRL_HISTOGRAMS, the latency of every check_allowed() call
+ *      and the time spent acquiring qlock are recorded in per thread
+ *      log-bucketed histograms (rate-limiter-hist.h), dumped with the
+ *      counters.
+ *
+ *   5. With -DSHADOW, every admission is also evaluated against a set
+ *      of candidate policies (shadow_policies), in the same pass over
+ *      the tenant's queue and under the same qlock, and the admissions
+ *      a candidate would have denied are counted per tenant. The live
+ *      decision is unchanged. See the shadow section below;
+ *      "rl-mt-shadow -b" benchmarks the overhead.
+ *
+ *   6. With -DSNAPSHOT, a background thread periodically writes the
+ *      in-window timestamps of all tenants to SNAPSHOT_PATH, and main()
+ *      restores them at startup, so a restarted process does not hand
+ *      every tenant a fresh window. Each tenant is copied under its own
+ *      qlock, so a snapshot is consistent per tenant only, not a single
+ *      point in time across tenants. See the snapshot section below.
+ *
  */
 
 #include <pthread.h>
@@ -22,6 +50,16 @@
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef SNAPSHOT
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "rate-limiter-hist.h"
+#include "rate-limiter-probes.h"
+#include "rate-limiter-stats.h"
 
 #define SUCCESS 0
 #define FAILURE 1
@@ -35,6 +73,43 @@
 #define TEST_NUM_TENANTS 3
 #define TEST_REQ_DELAY 300000
 
+#ifdef SNAPSHOT
+#define SNAPSHOT_PATH "rate-limiter.snap"
+#define SNAPSHOT_MAGIC 0x31504e534c52ULL /* "RLSNP1" */
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_INTERVAL 1000 /* Miliseconds          */
+#endif
+
+#ifdef SHADOW
+#define SHADOW_POLICIES 3
+#define BENCH_REQUESTS 20000000
+#define BENCH_STEP (WINDOW_SIZE / (2 * MAX_REQ)) /* 2x the live limit */
+#endif
+
+#ifdef RL_HISTOGRAMS
+RL_HIST_DEFINE(decision_hist,
+               "rl_check_latency_seconds",
+               "Latency of check_allowed().");
+RL_HIST_DEFINE(lock_hist,
+               "rl_lock_wait_seconds",
+               "Time spent acquiring a qlock.");
+
+static void
+dump_histograms(FILE* out)
+{
+  rl_hist_dump(&decision_hist, out, "mt");
+  rl_hist_dump(&lock_hist, out, "mt");
+}
+#endif
+
+static rl_stats_t stats = { .engine = "mt",
+                            .nclasses = 1,
+                            .class_names = { "default" },
+#ifdef RL_HISTOGRAMS
+                            .extra = dump_histograms
+#endif
+};
+
 /* Dequeue implementation (Ideally should be separate files) */
 
 typedef struct node
@@ -48,7 +123,12 @@ typedef struct
   qnode_t* head;
   qnode_t* tail;
   unsigned int size;
+  long blocked_until; /* denied until the head leaves the window */
   pthread_mutex_t qlock;
+#ifdef SHADOW
+  unsigned long admitted;                     /* shadow evaluated */
+  unsigned long would_deny[SHADOW_POLICIES]; /* of those, per policy */
+#endif
 } queue_t;
 
 qnode_t*
@@ -66,15 +146,26 @@ allocate_node(long data)
 unsigned int
 initialize_queue(queue_t** q, long data)
 {
-  *q = (queue_t*)malloc(sizeof(queue_t));
-  if (NULL == *q)
+  queue_t* temp = (queue_t*)malloc(sizeof(queue_t));
+  if (NULL == temp)
     return FAILURE;
 
-  (*q)->head = (*q)->tail = allocate_node(data);
-  if (NULL == (*q)->head)
+  temp->head = temp->tail = allocate_node(data);
+  if (NULL == temp->head) {
+    free(temp);
     return FAILURE;
+  }
 
-  (*q)->size = 1;
+  temp->size = 1;
+  temp->blocked_until = 0;
+  pthread_mutex_init(&temp->qlock, NULL);
+#ifdef SHADOW
+  temp->admitted = 0;
+  memset(temp->would_deny, 0, sizeof(temp->would_deny));
+#endif
+
+  /* publish fully initialized, for readers such as snapshot_thread() */
+  __atomic_store_n(q, temp, __ATOMIC_RELEASE);
   return SUCCESS;
 }
 
@@ -153,34 +244,406 @@ get_current_time_ms()
   return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
 }
 
+#ifdef SHADOW
+/*
+ * Shadow (dry-run) policies
+ *
+ * Candidates are meant to be at least as strict as the live limit, and
+ * their windows may not exceed WINDOW_SIZE, as the queue only holds the
+ * live window. They are evaluated on the live log, which also holds the
+ * requests a candidate would have denied, so would-deny counts are an
+ * upper bound. Requests denied live are not evaluated.
+ */
+
+typedef struct
+{
+  const char* name;
+  long window; /* Miliseconds          */
+  unsigned int max_req;
+} policy_t;
+
+static const policy_t shadow_policies[SHADOW_POLICIES] = {
+  { "8/10s", 10000, 8 },
+  { "4/5s", 5000, 4 },
+  { "1/1s", 1000, 1 },
+};
+
+static volatile int shadow_enabled = 1;
+
+/*
+ * Bitmask of the policies that would deny a request at timestamp, from
+ * one walk of the in-window log. Called with qlock held.
+ */
+static unsigned int
+shadow_evaluate(const queue_t* q, long timestamp)
+{
+  unsigned int count[SHADOW_POLICIES] = { 0 }, mask = 0;
+  long age;
+
+  for (const qnode_t* n = q->head; n; n = n->next) {
+    age = timestamp - n->data;
+    for (int p = 0; p < SHADOW_POLICIES; p++)
+      count[p] += age < shadow_policies[p].window;
+  }
+  for (int p = 0; p < SHADOW_POLICIES; p++) {
+    if (count[p] >= shadow_policies[p].max_req)
+      mask |= 1u << p;
+  }
+
+  return mask;
+}
+#endif
+
+/*
+ * On FAILURE, *retry_after is set to the miliseconds until the oldest
+ * request leaves the window (0 on SUCCESS). Until then the tenant is
+ * denied without taking qlock.
+ */
 int
-check_allowed(queue_t** q, long timestamp)
+check_allowed(queue_t** q, long timestamp, long* retry_after)
 {
+  uint64_t start = RL_HIST_START(), wait_start;
   unsigned int result;
+  long blocked_until, expired;
+#ifdef SHADOW
+  unsigned int shadow;
+#endif
 
-  if (*q)
-    pthread_mutex_lock(&((*q)->qlock));
+  if (*q) {
+    blocked_until = __atomic_load_n(&(*q)->blocked_until, __ATOMIC_RELAXED);
+    if (timestamp < blocked_until) {
+      *retry_after = blocked_until - timestamp;
+      rl_stats_inc(&stats, 0, RL_STAT_DENIED);
+      RL_PROBE3(deny, q, timestamp, *retry_after);
+      RL_HIST_RECORD(&decision_hist, start);
+      return FAILURE;
+    }
+    if (0 != pthread_mutex_trylock(&((*q)->qlock))) {
+      wait_start = RL_HIST_START();
+      rl_stats_inc(&stats, 0, RL_STAT_CONTENDED);
+      pthread_mutex_lock(&((*q)->qlock));
+      RL_HIST_RECORD(&lock_hist, wait_start);
+    } else {
+      RL_HIST_ADD(&lock_hist, 0);
+    }
+  }
 
   while ((*q) && (*q)->head && (timestamp - (*q)->head->data >= WINDOW_SIZE)) {
-    printf("removed %lu\n", dequeue(q));
+    expired = dequeue(q);
+#if DEBUG
+    printf("removed %lu\n", expired);
+#endif
+    rl_stats_inc(&stats, 0, RL_STAT_EXPIRED);
+    RL_PROBE3(expire, q, expired, timestamp - expired);
   }
   if (!(*q) || (*q)->size < MAX_REQ) {
-    enqueue(q, get_current_time_ms());
+#ifdef SHADOW
+    shadow = (*q && shadow_enabled) ? shadow_evaluate(*q, timestamp) : 0;
+#endif
+    if (!(*q))
+      RL_PROBE2(create, q, timestamp);
+    enqueue(q, timestamp);
+#ifdef SHADOW
+    if (*q && shadow_enabled) {
+      (*q)->admitted++;
+      for (int p = 0; p < SHADOW_POLICIES; p++)
+        (*q)->would_deny[p] += (shadow >> p) & 1;
+    }
+#endif
+    *retry_after = 0;
+    rl_stats_inc(&stats, 0, RL_STAT_ALLOWED);
+    RL_PROBE3(admit, q, timestamp, (*q)->size);
     result = SUCCESS;
   } else {
+    blocked_until = (*q)->head->data + WINDOW_SIZE;
+    __atomic_store_n(&(*q)->blocked_until, blocked_until, __ATOMIC_RELAXED);
+    *retry_after = blocked_until - timestamp;
+    rl_stats_inc(&stats, 0, RL_STAT_DENIED);
+    RL_PROBE3(deny, q, timestamp, *retry_after);
     result = FAILURE;
   }
 
   if (*q)
     pthread_mutex_unlock(&((*q)->qlock));
+  RL_HIST_RECORD(&decision_hist, start);
 
   return result;
 }
 
+#ifdef SNAPSHOT
+/*
+ * Snapshots
+ *
+ * File layout (native endian, fixed width):
+ *   snapshot_hdr_t
+ *   uint32_t offsets[SNAPSHOT_OFFSETS] first record of each tenant, and
+ *                                      the end; zero padded so that
+ *   int64_t records[num_records]       records are 8 byte aligned;
+ *                                      request timestamps, oldest first
+ *
+ * Timestamps are wall clock miliseconds, so they stay meaningful across
+ * a restart. The checksum covers everything after the header. A file is
+ * written to SNAPSHOT_PATH.tmp and renamed over SNAPSHOT_PATH, so a
+ * reader only ever sees a complete snapshot.
+ */
+
+typedef struct
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t max_tenants;
+  uint32_t window_size;
+  uint32_t max_req;
+  int64_t taken_at; /* Miliseconds          */
+  uint64_t num_records;
+  uint64_t checksum; /* FNV-1a */
+} snapshot_hdr_t;
+
+/* max_tenants + 1 offsets, rounded up to a multiple of 8 bytes */
+#define SNAPSHOT_OFFSETS ((MAX_TENANTS + 2) & ~1)
+
+_Static_assert(0 == sizeof(snapshot_hdr_t) % sizeof(int64_t),
+               "snapshot records must stay 8 byte aligned");
+
+static volatile int snapshot_stop;
+
+static uint64_t
+fnv1a(uint64_t h, const void* buf, size_t len)
+{
+  const unsigned char* p = (const unsigned char*)buf;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+/*
+ * Copy the in-window timestamps of every tenant, each under its own
+ * qlock, then write them out with no lock held.
+ */
+unsigned int
+write_snapshot(queue_t** tq, const char* path)
+{
+  static uint32_t offsets[SNAPSHOT_OFFSETS];
+  snapshot_hdr_t hdr;
+  char tmp_path[256];
+  long timestamp = get_current_time_ms();
+  int64_t* records;
+  uint32_t n = 0;
+  queue_t* q;
+  int fd, rc = FAILURE;
+
+  /* a tenant never holds more than MAX_REQ timestamps in the window */
+  records = (int64_t*)malloc((size_t)MAX_TENANTS * MAX_REQ * sizeof(int64_t));
+  if (NULL == records)
+    return FAILURE;
+
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    offsets[i] = n;
+    q = __atomic_load_n(&tq[i], __ATOMIC_ACQUIRE);
+    if (NULL == q)
+      continue;
+    pthread_mutex_lock(&q->qlock);
+    for (qnode_t* p = q->head; p && n - offsets[i] < MAX_REQ; p = p->next) {
+      if (timestamp - p->data < WINDOW_SIZE)
+        records[n++] = p->data;
+    }
+    pthread_mutex_unlock(&q->qlock);
+  }
+  offsets[MAX_TENANTS] = n;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = SNAPSHOT_MAGIC;
+  hdr.version = SNAPSHOT_VERSION;
+  hdr.max_tenants = MAX_TENANTS;
+  hdr.window_size = WINDOW_SIZE;
+  hdr.max_req = MAX_REQ;
+  hdr.taken_at = timestamp;
+  hdr.num_records = n;
+  hdr.checksum = fnv1a(0xcbf29ce484222325ULL, offsets, sizeof(offsets));
+  hdr.checksum = fnv1a(hdr.checksum, records, n * sizeof(int64_t));
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    goto done;
+  if (sizeof(hdr) == write(fd, &hdr, sizeof(hdr)) &&
+      sizeof(offsets) == write(fd, offsets, sizeof(offsets)) &&
+      (ssize_t)(n * sizeof(int64_t)) ==
+        write(fd, records, n * sizeof(int64_t)) &&
+      0 == fsync(fd))
+    rc = SUCCESS;
+  close(fd);
+
+  if (SUCCESS != rc || 0 != rename(tmp_path, path)) {
+    unlink(tmp_path);
+    rc = FAILURE;
+  }
+
+done:
+  free(records);
+  return rc;
+}
+
+/*
+ * Map a snapshot and rebuild the queues of the tenants that still have
+ * requests in the window. Only the mapped pages of live records are
+ * read; tenants with nothing left cost one offsets compare.
+ */
+unsigned int
+restore_snapshot(queue_t** tq, const char* path, unsigned long* restored)
+{
+  const snapshot_hdr_t* hdr;
+  const uint32_t* offsets;
+  const int64_t* records;
+  long timestamp = get_current_time_ms();
+  struct stat st;
+  size_t size;
+  void* map;
+  int fd;
+
+  *restored = 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return FAILURE;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snapshot_hdr_t)) {
+    close(fd);
+    return FAILURE;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map)
+    return FAILURE;
+
+  hdr = (const snapshot_hdr_t*)map;
+  offsets = (const uint32_t*)(hdr + 1);
+  records = (const int64_t*)(offsets + SNAPSHOT_OFFSETS);
+  size = sizeof(*hdr) + SNAPSHOT_OFFSETS * sizeof(uint32_t);
+
+  if (SNAPSHOT_MAGIC != hdr->magic || SNAPSHOT_VERSION != hdr->version ||
+      MAX_TENANTS != hdr->max_tenants || WINDOW_SIZE != hdr->window_size ||
+      MAX_REQ != hdr->max_req || (size_t)st.st_size < size ||
+      /* bounded first, so that the multiplications cannot wrap */
+      hdr->num_records > ((size_t)st.st_size - size) / sizeof(int64_t) ||
+      (size_t)st.st_size != size + hdr->num_records * sizeof(int64_t) ||
+      hdr->checksum !=
+        fnv1a(fnv1a(0xcbf29ce484222325ULL,
+                    offsets,
+                    SNAPSHOT_OFFSETS * sizeof(uint32_t)),
+              records,
+              hdr->num_records * sizeof(int64_t))) {
+    munmap(map, st.st_size);
+    return FAILURE;
+  }
+
+  /* the whole window has passed since: nothing to restore */
+  if (timestamp - hdr->taken_at < WINDOW_SIZE) {
+    for (int i = 0; i < MAX_TENANTS; i++) {
+      if (offsets[i] > offsets[i + 1] || offsets[i + 1] > hdr->num_records)
+        break;
+      for (uint32_t r = offsets[i]; r < offsets[i + 1]; r++) {
+        if (timestamp - records[r] < WINDOW_SIZE &&
+            SUCCESS == enqueue(&tq[i], records[r]))
+          (*restored)++;
+      }
+    }
+  }
+
+  munmap(map, st.st_size);
+  return SUCCESS;
+}
+
+void*
+snapshot_thread(void* arg)
+{
+  queue_t** tq = (queue_t**)arg;
+
+  while (!snapshot_stop) {
+    for (int ms = 0; ms < SNAPSHOT_INTERVAL && !snapshot_stop; ms += 100)
+      usleep(100000);
+    if (SUCCESS != write_snapshot(tq, SNAPSHOT_PATH))
+      perror("write_snapshot");
+  }
+
+  return NULL;
+}
+#endif
+
+#ifdef SHADOW
+void
+shadow_report(queue_t** tq)
+{
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    if (NULL == tq[i] || 0 == tq[i]->admitted)
+      continue;
+    printf("shadow: tenant %d, %lu admitted, would deny", i, tq[i]->admitted);
+    for (int p = 0; p < SHADOW_POLICIES; p++)
+      printf(" %s: %lu", shadow_policies[p].name, tq[i]->would_deny[p]);
+    printf("\n");
+  }
+}
+
+/*
+ * Decisions per second with and without shadow evaluation, single
+ * threaded, with every tenant offered twice its live limit
+ */
+static double
+shadow_bench_run(int enabled, unsigned long* would_deny)
+{
+  static queue_t* tq[MAX_TENANTS];
+  struct timespec start, end;
+  long timestamp = 0, retry_after;
+
+  shadow_enabled = enabled;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < BENCH_REQUESTS; i++) {
+    if (0 == i % MAX_TENANTS)
+      timestamp += BENCH_STEP;
+    check_allowed(&tq[i % MAX_TENANTS], timestamp, &retry_after);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    for (int p = 0; p < SHADOW_POLICIES; p++)
+      would_deny[p] += tq[i] ? tq[i]->would_deny[p] : 0;
+    if (NULL != tq[i])
+      pthread_mutex_destroy(&tq[i]->qlock);
+    destroy_queue(tq[i]);
+    tq[i] = NULL;
+  }
+
+  return BENCH_REQUESTS / ((end.tv_sec - start.tv_sec) +
+                           (end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int
+shadow_benchmark(void)
+{
+  unsigned long would_deny[SHADOW_POLICIES] = { 0 };
+  double live, shadow;
+
+  live = shadow_bench_run(0, would_deny);
+  shadow = shadow_bench_run(1, would_deny);
+  printf("live only: %.0f decisions/sec\n"
+         "shadow:    %.0f decisions/sec (%d policies, %.1f%% overhead)\n",
+         live,
+         shadow,
+         SHADOW_POLICIES,
+         (live / shadow - 1) * 100);
+  for (int p = 0; p < SHADOW_POLICIES; p++)
+    printf("  %s would deny %lu\n", shadow_policies[p].name, would_deny[p]);
+
+  return 0;
+}
+#endif
+
 void*
 client_thread(void* arg)
 {
-  long curr_time_ms = 0;
+  long curr_time_ms = 0, retry_after = 0;
   int tenant_id = 0;
 
   queue_t** tq = (queue_t**)arg;
@@ -194,14 +657,17 @@ client_thread(void* arg)
 #else
     tenant_id = ++tenant_id % TEST_NUM_TENANTS;
 #endif
-    if (SUCCESS == check_allowed(&tq[tenant_id], curr_time_ms)) {
+    if (SUCCESS == check_allowed(&tq[tenant_id], curr_time_ms, &retry_after)) {
       printf("[%lx] Tenant %d - Request allowed: %d\n",
              pthread_self(),
              tenant_id,
              i);
     } else {
-      printf(
-        "[%lx] Tenant %d - Request denied: %d\n", pthread_self(), tenant_id, i);
+      printf("[%lx] Tenant %d - Request denied: %d (retry after %ld ms)\n",
+             pthread_self(),
+             tenant_id,
+             i,
+             retry_after);
     }
 #if DEBUG
     q = tq[tenant_id];
@@ -218,10 +684,31 @@ client_thread(void* arg)
 }
 
 int
-main(void)
+main(int argc, char** argv)
 {
   queue_t* tenant_queues[MAX_TENANTS] = { NULL };
   pthread_t threads[NUM_THREADS];
+  unsigned int active = 0;
+#ifdef SHADOW
+  if (argc > 1 && 0 == strcmp(argv[1], "-b"))
+    return shadow_benchmark();
+#else
+  (void)argc;
+  (void)argv;
+#endif
+#ifdef SNAPSHOT
+  pthread_t snapshotter;
+  unsigned long restored;
+  long start_ms = get_current_time_ms();
+
+  /* warm restart: resume the windows of the previous run */
+  if (SUCCESS == restore_snapshot(tenant_queues, SNAPSHOT_PATH, &restored))
+    printf("restored %lu requests from %s in %ld ms\n",
+           restored,
+           SNAPSHOT_PATH,
+           get_current_time_ms() - start_ms);
+  pthread_create(&snapshotter, NULL, snapshot_thread, &tenant_queues[0]);
+#endif
 
   for (int i = 0; i < NUM_THREADS; i++) {
     pthread_create(&threads[i], NULL, client_thread, &tenant_queues[0]);
@@ -231,7 +718,22 @@ main(void)
     pthread_join(threads[i], NULL);
   }
 
+#ifdef SNAPSHOT
+  snapshot_stop = 1;
+  pthread_join(snapshotter, NULL);
+#endif
+
+#ifdef SHADOW
+  shadow_report(tenant_queues);
+#endif
+
+  for (int i = 0; i < MAX_TENANTS; i++)
+    active += NULL != tenant_queues[i];
+  rl_stats_dump(&stats, stdout, (double)active / MAX_TENANTS);
+
   for (int i = 0; i < MAX_TENANTS; i++) {
+    if (NULL != tenant_queues[i])
+      RL_PROBE2(evict, &tenant_queues[i], tenant_queues[i]->size);
     destroy_queue(tenant_queues[i]);
     if (NULL != tenant_queues[i])
       pthread_mutex_destroy(&(tenant_queues[i]->qlock));
@@ -0,0 +1,56 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-probes.h
+ *
+ * DESCRIPTION:
+ *   USDT probes (provider rate_limiter) for tracing limiter decisions
+ *   on live traffic with bpftrace, perf or SystemTap.
+ *
+ * NOTES:
+ *   1. With <sys/sdt.h> (systemtap-sdt-dev, systemtap-sdt-devel) the
+ *      probes are single nops plus an ELF note; a tracer patches in a
+ *      breakpoint only while attached. Without the header, or with
+ *      -DRL_NO_PROBES, they compile to nothing.
+ *
+ *   2. Arguments must be plain values without side effects. Compiled
+ *      out, a probe only casts them to void, which keeps the variables
+ *      used for nothing but tracing from warning.
+ *
+ *   3. Probes and arguments. tenant is the tenant id where the engine
+ *      knows it, or else the address of its slot in the tenant table.
+ *      Every engine passes absolute timestamps and ages in miliseconds;
+ *      rl-server converts its rate-limiter-reltime.h offsets back, and
+ *      its timestamps are CLOCK_MONOTONIC rather than wall clock time.
+ *        admit(tenant, timestamp_ms, in_window)
+ *        deny(tenant, timestamp_ms, retry_after_ms)
+ *        expire(tenant, request_timestamp_ms, age_ms)
+ *        create(tenant, timestamp_ms)
+ *        evict(tenant, in_window)
+ *
+ *   4. Example bpftrace scripts, run from the build directory against a
+ *      running rl-server (edit the binary path for other engines):
+ *        rate-limiter-deny.bt    most denied tenants, retry-after
+ *        rate-limiter-admit.bt   admissions per second, window fill
+ *        rate-limiter-expire.bt  age of timestamps at expiry
+ *
+ */
+
+#ifndef RATE_LIMITER_PROBES_H
+#define RATE_LIMITER_PROBES_H
+
+#if !defined(RL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RL_PROBES 1
+#endif
+#endif
+
+#ifdef RL_PROBES
+#define RL_PROBE2(name, a1, a2) DTRACE_PROBE2(rate_limiter, name, a1, a2)
+#define RL_PROBE3(name, a1, a2, a3)                                          \
+  DTRACE_PROBE3(rate_limiter, name, a1, a2, a3)
+#else
+#define RL_PROBE2(name, a1, a2) ((void)(a1), (void)(a2))
+#define RL_PROBE3(name, a1, a2, a3) ((void)(a1), (void)(a2), (void)(a3))
+#endif
+
+#endif /* RATE_LIMITER_PROBES_H */
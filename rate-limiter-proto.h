@@ -0,0 +1,110 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-proto.h
+ *
+ * DESCRIPTION:
+ *   Binary admit protocol spoken by rl-server and its clients.
+ *
+ * NOTES:
+ *   1. Every message is a frame: an rl_frame_hdr_t followed by count
+ *      fixed size records. An RL_OP_ADMIT frame carries rl_admit_req_t
+ *      records and is answered by one RL_OP_RESULT frame carrying one
+ *      rl_admit_resp_t per request, in the same order.
+ *
+ *   2. Over TCP frames are sent back to back and may be pipelined
+ *      freely; over UDP a datagram holds exactly one frame.
+ *
+ *   3. Cluster nodes (rate-limiter-cluster.c) also take RL_OP_MEMBERS
+ *      frames, one rl_member_rec_t per node of the new membership, and
+ *      RL_OP_STATE frames, one rl_state_rec_t per timestamp of a tenant
+ *      window handed over by its previous owner. Both are answered by
+ *      an empty RL_OP_RESULT frame once applied.
+ *
+ *   4. All fields are little endian. The structs have no padding and
+ *      are used on the wire as is; use RL_LE16() / RL_LE32() (no-ops on
+ *      little endian hosts) when reading or writing fields.
+ *
+ */
+
+#ifndef RATE_LIMITER_PROTO_H
+#define RATE_LIMITER_PROTO_H
+
+#include <endian.h>
+#include <stdint.h>
+
+#define RL_PROTO_PORT 7070
+#define RL_PROTO_MAGIC 0x4c52 /* "RL" */
+#define RL_PROTO_VERSION 1
+
+#define RL_OP_ADMIT 1
+#define RL_OP_RESULT 2
+#define RL_OP_MEMBERS 3
+#define RL_OP_STATE 4
+
+#define RL_STATUS_ALLOWED 0
+#define RL_STATUS_DENIED 1
+#define RL_STATUS_ERROR 2 /* e.g. tenant_id out of range */
+#define RL_STATUS_MOVED 3 /* tenant not owned by this node */
+
+#define RL_MAX_BATCH 1024 /* Records per frame    */
+
+#define RL_LE16(x) htole16(x)
+#define RL_LE32(x) htole32(x)
+
+typedef struct
+{
+  uint16_t magic;
+  uint8_t version;
+  uint8_t op;
+  uint32_t count; /* records following the header */
+} rl_frame_hdr_t;
+
+typedef struct
+{
+  uint32_t seq; /* echoed back in the result */
+  uint32_t tenant_id;
+} rl_admit_req_t;
+
+typedef struct
+{
+  uint32_t seq;
+  uint16_t status;
+  uint16_t retry_after; /* Miliseconds, saturated at 65535 */
+} rl_admit_resp_t;
+
+typedef struct
+{
+  uint32_t node_id;
+  uint32_t port; /* on the same host */
+} rl_member_rec_t;
+
+typedef struct
+{
+  uint32_t tenant_id;
+  uint32_t age; /* Miliseconds before the sender's current time */
+} rl_state_rec_t;
+
+#define RL_MAX_FRAME (sizeof(rl_frame_hdr_t) + RL_MAX_BATCH * 8)
+
+static inline void
+rl_frame_init(rl_frame_hdr_t* hdr, uint8_t op, uint32_t count)
+{
+  hdr->magic = RL_LE16(RL_PROTO_MAGIC);
+  hdr->version = RL_PROTO_VERSION;
+  hdr->op = op;
+  hdr->count = RL_LE32(count);
+}
+
+/* Length of a valid frame of the given op, or 0 if hdr is invalid */
+static inline uint32_t
+rl_frame_len(const rl_frame_hdr_t* hdr, uint8_t op)
+{
+  uint32_t count = RL_LE32(hdr->count);
+
+  if (RL_PROTO_MAGIC != RL_LE16(hdr->magic) ||
+      RL_PROTO_VERSION != hdr->version || op != hdr->op ||
+      count > RL_MAX_BATCH)
+    return 0;
+  return sizeof(rl_frame_hdr_t) + count * 8;
+}
+
+#endif /* RATE_LIMITER_PROTO_H */
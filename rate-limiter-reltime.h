@@ -0,0 +1,137 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-reltime.h
+ *
+ * DESCRIPTION:
+ *   Compact timestamps for sliding window logs: 32-bit offsets from a
+ *   per-limiter epoch, in microseconds (or RL_TS_UNIT_NS) instead of
+ *   64-bit miliseconds.
+ *
+ * NOTES:
+ *   1. Clock readings (rl_ts_now()) are absolute CLOCK_MONOTONIC times
+ *      in RL_TS_UNIT_NS units, held in 64 bits. Only the timestamps
+ *      stored in a ring are rl_ts_t offsets, so a log of MAX_REQ
+ *      entries takes half the memory and cache lines, at a thousand
+ *      times the resolution.
+ *
+ *   2. The epoch of generation gen is base + gen * RL_TS_STEP. Once a
+ *      reading is RL_TS_ROLL past the current epoch, the reader bumps
+ *      the generation (a CAS on one word, so concurrent readers agree),
+ *      moving the epoch RL_TS_STEP forward. 32 bits of microseconds
+ *      roll every ~18 minutes.
+ *
+ *   3. Rings are rebased lazily: each remembers the generation of its
+ *      offsets, and rl_ts_rebase() brings it up to date on its next use,
+ *      under the ring's lock. An entry from before the new epoch is at
+ *      least RL_TS_ROLL - RL_TS_STEP units old, far outside any window,
+ *      and is dropped; a ring that missed more than one generation is
+ *      emptied.
+ *
+ *   4. Windows must be shorter than RL_TS_STEP units (~17 minutes).
+ *
+ */
+
+#ifndef RATE_LIMITER_RELTIME_H
+#define RATE_LIMITER_RELTIME_H
+
+#include <stdint.h>
+#include <time.h>
+
+#ifndef RL_TS_UNIT_NS
+#define RL_TS_UNIT_NS 1000 /* microseconds          */
+#endif
+
+#define RL_TS_ROLL (1U << 31)
+#define RL_TS_STEP (1U << 30)
+
+/* miliseconds to units, units to miliseconds rounded up, and down */
+#define RL_TS_FROM_MS(ms) ((int64_t)(ms) * (1000000 / RL_TS_UNIT_NS))
+#define RL_TS_TO_MS(u)                                                       \
+  (((int64_t)(u) * RL_TS_UNIT_NS + 999999) / 1000000)
+#define RL_TS_TO_MS_FLOOR(u) ((int64_t)(u) * RL_TS_UNIT_NS / 1000000)
+
+typedef uint32_t rl_ts_t;
+
+typedef struct
+{
+  int64_t base; /* units, epoch of generation 0 */
+  uint32_t gen;
+} rl_tsclock_t;
+
+static inline int64_t
+rl_ts_read(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) / RL_TS_UNIT_NS;
+}
+
+static void
+rl_ts_init(rl_tsclock_t* c)
+{
+  c->base = rl_ts_read();
+  c->gen = 0;
+}
+
+static inline uint32_t
+rl_ts_gen(rl_tsclock_t* c)
+{
+  return __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+}
+
+/* Current time, in units; rolls the epoch over when due */
+static inline int64_t
+rl_ts_now(rl_tsclock_t* c)
+{
+  int64_t now = rl_ts_read();
+  uint32_t gen = rl_ts_gen(c);
+
+  while (now - c->base - (int64_t)gen * RL_TS_STEP >= RL_TS_ROLL) {
+    /* a failed CAS means another reader rolled it: recheck */
+    __atomic_compare_exchange_n(
+      &c->gen, &gen, gen + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    gen = rl_ts_gen(c);
+  }
+
+  return now;
+}
+
+/* now, as an offset from the epoch of generation gen */
+static inline rl_ts_t
+rl_ts_rel(const rl_tsclock_t* c, uint32_t gen, int64_t now)
+{
+  return (rl_ts_t)(now - c->base - (int64_t)gen * RL_TS_STEP);
+}
+
+/* Offset rel of generation gen, as an absolute time in units */
+static inline int64_t
+rl_ts_abs(const rl_tsclock_t* c, uint32_t gen, rl_ts_t rel)
+{
+  return c->base + (int64_t)gen * RL_TS_STEP + rel;
+}
+
+/*
+ * Bring a ring of size entries from head, in a buffer of cap, from
+ * generation *ring_gen to gen
+ */
+static inline void
+rl_ts_rebase(rl_ts_t* slots,
+             unsigned int cap,
+             unsigned int* head,
+             unsigned int* size,
+             uint32_t* ring_gen,
+             uint32_t gen)
+{
+  if (gen - *ring_gen == 1) {
+    while (*size && slots[*head] < RL_TS_STEP) {
+      *head = (*head + 1) % cap;
+      (*size)--;
+    }
+    for (unsigned int i = 0; i < *size; i++)
+      slots[(*head + i) % cap] -= RL_TS_STEP;
+  } else {
+    *size = 0;
+  }
+  *ring_gen = gen;
+}
+
+#endif /* RATE_LIMITER_RELTIME_H */
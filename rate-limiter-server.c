@@ -0,0 +1,599 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-server.c
+ *
+ * DESCRIPTION:
+ *   Standalone sliding window rate limit daemon. Answers admit requests
+ *   of the binary protocol in rate-limiter-proto.h over TCP and UDP, so
+ *   that processes on a host share one set of tenant limits.
+ *
+ * NOTES:
+ *   1. One event loop per core. Every loop owns its own TCP listener and
+ *      UDP socket bound to the same port with SO_REUSEPORT, so the
+ *      kernel spreads connections and datagrams across loops, and its
+ *      own edge-triggered epoll instance.
+ *
+ *   2. The tenant table is shared by all loops. Each tenant is a fixed
+ *      ring of MAX_REQ timestamps behind its own qlock (a sliding window
+ *      log as in rate-limiter-mt.c, without per request allocations),
+ *      and caches its blocked-until time so that denied tenants cost one
+ *      compare.
+ *
+ *   3. Requests are batched by the protocol: the clock is read once per
+ *      frame, and all responses produced by one read are written with
+ *      one send (sendmmsg for UDP).
+ *
+ *   4. Decisions, expirations and lock contention are counted per loop
+ *      thread (rate-limiter-stats.h). With -m, the main thread writes
+ *      them in OpenMetrics text to a file every second, for a textfile
+ *      collector. With -DRL_HISTOGRAMS (rl-server-hist), decision
+ *      latency and qlock wait are recorded in log-bucketed histograms
+ *      (rate-limiter-hist.h) and written along with the counters.
+ *
+ *   5. The hottest and the most denied tenants are tracked in two
+ *      sampled space-saving sketches (rate-limiter-topk.h), decayed
+ *      once per second, and the top RL_TOPK_REPORT of each are written
+ *      to the metrics file as well.
+ *
+ *   6. Admits, denials and expirations fire USDT probes, with the
+ *      tenant id (rate-limiter-probes.h, rate-limiter-*.bt).
+ *
+ *   7. Ring timestamps are 32-bit microsecond offsets from an epoch
+ *      shared by the tenant table (rate-limiter-reltime.h), rebased
+ *      lazily when the epoch rolls over. A ring of MAX_REQ takes half
+ *      the space of 64-bit miliseconds, at a thousand times the
+ *      resolution. blocked_until and clock readings stay 64 bits.
+ *
+ *   Usage: rl-server [-p port] [-t loops] [-m metrics-file]
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rate-limiter-hist.h"
+#include "rate-limiter-probes.h"
+#include "rate-limiter-proto.h"
+#include "rate-limiter-reltime.h"
+#include "rate-limiter-stats.h"
+#include "rate-limiter-topk.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 65536 /* Active tenants       */
+#define WINDOW_SIZE 10000 /* Miliseconds (10s)    */
+#define WINDOW_UNITS ((int32_t)RL_TS_FROM_MS(WINDOW_SIZE))
+#define MAX_REQ 10        /* 10ms service rate    */
+#define MAX_LOOPS 64
+
+#define MAX_EVENTS 256
+#define CONN_BUF_SIZE (4 * RL_MAX_FRAME)
+#define UDP_BATCH 32
+
+typedef struct
+{
+  pthread_mutex_t qlock;
+  int64_t blocked_until; /* RL_TS units, absolute */
+  unsigned int head;
+  unsigned int size;
+  uint32_t gen; /* epoch generation of slots */
+  rl_ts_t slots[MAX_REQ];
+} tenant_t;
+
+typedef struct
+{
+  int fd;
+  size_t in_len;
+  size_t out_len;
+  size_t out_off;
+  unsigned char in[CONN_BUF_SIZE];
+  unsigned char out[CONN_BUF_SIZE];
+} conn_t;
+
+typedef struct
+{
+  pthread_t thread;
+  int id;
+  int epfd;
+  int listen_fd;
+  int udp_fd;
+  unsigned char (*udp_in)[RL_MAX_FRAME];
+  unsigned char (*udp_out)[RL_MAX_FRAME];
+} loop_t;
+
+_Static_assert(RL_TS_FROM_MS(WINDOW_SIZE) < RL_TS_STEP,
+               "window too long for 32-bit timestamps");
+
+static tenant_t* tenants;
+static rl_tsclock_t ts_clock;
+#ifdef RL_HISTOGRAMS
+RL_HIST_DEFINE(decision_hist,
+               "rl_check_latency_seconds",
+               "Latency of check_allowed().");
+RL_HIST_DEFINE(lock_hist,
+               "rl_lock_wait_seconds",
+               "Time spent acquiring a qlock.");
+#endif
+static rl_topk_t top_requests = RL_TOPK_INITIALIZER;
+static rl_topk_t top_denied = RL_TOPK_INITIALIZER;
+
+static void
+dump_extra(FILE* out)
+{
+#ifdef RL_HISTOGRAMS
+  rl_hist_dump(&decision_hist, out, "server");
+  rl_hist_dump(&lock_hist, out, "server");
+#endif
+  rl_topk_dump(&top_requests,
+               out,
+               "rl_top_tenant_requests",
+               "Hottest tenants, admit requests per second (at least).",
+               "server");
+  rl_topk_dump(&top_denied,
+               out,
+               "rl_top_tenant_denials",
+               "Most limited tenants, denials per second (at least).",
+               "server");
+}
+
+static rl_stats_t stats = { .engine = "server",
+                            .nclasses = 1,
+                            .class_names = { "default" },
+                            .extra = dump_extra };
+static volatile sig_atomic_t stop;
+
+/* Rate limiter functionality and helper functions */
+
+int
+check_allowed(tenant_t* t, int64_t timestamp, long* retry_after)
+{
+  int64_t blocked_until = __atomic_load_n(&t->blocked_until, __ATOMIC_RELAXED);
+  uint64_t start = RL_HIST_START(), wait_start;
+  uint32_t gen;
+  unsigned int tail;
+  rl_ts_t now;
+  int result;
+
+  if (timestamp < blocked_until) {
+    *retry_after = RL_TS_TO_MS(blocked_until - timestamp);
+    rl_stats_inc(&stats, 0, RL_STAT_DENIED);
+    RL_PROBE3(deny, t - tenants, RL_TS_TO_MS_FLOOR(timestamp), *retry_after);
+    RL_HIST_RECORD(&decision_hist, start);
+    return FAILURE;
+  }
+
+  if (0 != pthread_mutex_trylock(&t->qlock)) {
+    wait_start = RL_HIST_START();
+    rl_stats_inc(&stats, 0, RL_STAT_CONTENDED);
+    pthread_mutex_lock(&t->qlock);
+    RL_HIST_RECORD(&lock_hist, wait_start);
+  } else {
+    RL_HIST_ADD(&lock_hist, 0);
+  }
+
+  gen = rl_ts_gen(&ts_clock);
+  if (t->gen != gen)
+    rl_ts_rebase(t->slots, MAX_REQ, &t->head, &t->size, &t->gen, gen);
+  now = rl_ts_rel(&ts_clock, t->gen, timestamp);
+
+  while (t->size && (int32_t)(now - t->slots[t->head]) >= WINDOW_UNITS) {
+    /* probes take absolute miliseconds, not epoch offsets */
+    RL_PROBE3(
+      expire,
+      t - tenants,
+      RL_TS_TO_MS_FLOOR(rl_ts_abs(&ts_clock, t->gen, t->slots[t->head])),
+      RL_TS_TO_MS_FLOOR(now - t->slots[t->head]));
+    t->head = (t->head + 1) % MAX_REQ;
+    t->size--;
+    rl_stats_inc(&stats, 0, RL_STAT_EXPIRED);
+  }
+  if (t->size < MAX_REQ) {
+    tail = (t->head + t->size) % MAX_REQ;
+    t->slots[tail] = now;
+    t->size++;
+    *retry_after = 0;
+    rl_stats_inc(&stats, 0, RL_STAT_ALLOWED);
+    RL_PROBE3(admit, t - tenants, RL_TS_TO_MS_FLOOR(timestamp), t->size);
+    result = SUCCESS;
+  } else {
+    blocked_until =
+      timestamp + (int32_t)(t->slots[t->head] + WINDOW_UNITS - now);
+    __atomic_store_n(&t->blocked_until, blocked_until, __ATOMIC_RELAXED);
+    *retry_after = RL_TS_TO_MS(blocked_until - timestamp);
+    rl_stats_inc(&stats, 0, RL_STAT_DENIED);
+    RL_PROBE3(deny, t - tenants, RL_TS_TO_MS_FLOOR(timestamp), *retry_after);
+    result = FAILURE;
+  }
+
+  pthread_mutex_unlock(&t->qlock);
+  RL_HIST_RECORD(&decision_hist, start);
+
+  return result;
+}
+
+/*
+ * Evaluate one admit frame into a result frame. Returns the length of
+ * the result frame.
+ */
+static size_t
+admit_frame(const unsigned char* in, unsigned char* out)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)in;
+  const rl_admit_req_t* req = (const rl_admit_req_t*)(hdr + 1);
+  rl_admit_resp_t* resp = (rl_admit_resp_t*)((rl_frame_hdr_t*)out + 1);
+  uint32_t count = RL_LE32(hdr->count), tenant_id;
+  int64_t timestamp = rl_ts_now(&ts_clock);
+  long retry_after;
+
+  rl_frame_init((rl_frame_hdr_t*)out, RL_OP_RESULT, count);
+  for (uint32_t i = 0; i < count; i++) {
+    tenant_id = RL_LE32(req[i].tenant_id);
+    resp[i].seq = req[i].seq;
+    if (tenant_id >= MAX_TENANTS) {
+      resp[i].status = RL_LE16(RL_STATUS_ERROR);
+      resp[i].retry_after = 0;
+      continue;
+    }
+    rl_topk_sample(&top_requests, tenant_id);
+    if (SUCCESS ==
+        check_allowed(&tenants[tenant_id], timestamp, &retry_after)) {
+      resp[i].status = RL_LE16(RL_STATUS_ALLOWED);
+    } else {
+      resp[i].status = RL_LE16(RL_STATUS_DENIED);
+      rl_topk_sample(&top_denied, tenant_id);
+    }
+    resp[i].retry_after = RL_LE16(retry_after > 65535 ? 65535 : retry_after);
+  }
+
+  return sizeof(rl_frame_hdr_t) + count * sizeof(rl_admit_resp_t);
+}
+
+/* Networking */
+
+static int
+open_socket(int type, int port)
+{
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    goto fail;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    goto fail;
+  if (SOCK_STREAM == type && listen(fd, SOMAXCONN) < 0)
+    goto fail;
+
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+/* Parse complete admit frames while there is room for their results */
+static int
+conn_process(conn_t* c)
+{
+  size_t off = 0, len;
+
+  while (c->in_len - off >= sizeof(rl_frame_hdr_t)) {
+    len = rl_frame_len((rl_frame_hdr_t*)(c->in + off), RL_OP_ADMIT);
+    if (0 == len)
+      return FAILURE;
+    if (c->in_len - off < len || CONN_BUF_SIZE - c->out_len < len)
+      break;
+    c->out_len += admit_frame(c->in + off, c->out + c->out_len);
+    off += len;
+  }
+
+  if (off) {
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+  }
+
+  return SUCCESS;
+}
+
+/* Edge-triggered: run until both directions would block */
+static int
+conn_service(conn_t* c)
+{
+  ssize_t n;
+
+  for (;;) {
+    if (SUCCESS != conn_process(c))
+      return FAILURE;
+
+    while (c->out_off < c->out_len) {
+      n = send(c->fd,
+               c->out + c->out_off,
+               c->out_len - c->out_off,
+               MSG_NOSIGNAL);
+      if (n < 0) {
+        if (EINTR == errno)
+          continue;
+        return (EAGAIN == errno) ? SUCCESS : FAILURE;
+      }
+      c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+
+    if (CONN_BUF_SIZE == c->in_len)
+      continue;
+
+    n = recv(c->fd, c->in + c->in_len, CONN_BUF_SIZE - c->in_len, 0);
+    if (0 == n)
+      return FAILURE;
+    if (n < 0) {
+      if (EINTR == errno)
+        continue;
+      return (EAGAIN == errno) ? SUCCESS : FAILURE;
+    }
+    c->in_len += n;
+  }
+}
+
+static void
+conn_close(conn_t* c)
+{
+  close(c->fd);
+  free(c);
+}
+
+static void
+accept_connections(loop_t* l)
+{
+  struct epoll_event ev;
+  conn_t* c;
+  int fd, one = 1;
+
+  for (;;) {
+    fd = accept4(l->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c = (conn_t*)malloc(sizeof(conn_t));
+    if (NULL == c) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->in_len = c->out_len = c->out_off = 0;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      conn_close(c);
+  }
+}
+
+static void
+serve_datagrams(loop_t* l)
+{
+  unsigned char(*in)[RL_MAX_FRAME] = l->udp_in;
+  unsigned char(*out)[RL_MAX_FRAME] = l->udp_out;
+  struct mmsghdr rmsg[UDP_BATCH], smsg[UDP_BATCH];
+  struct sockaddr_in addr[UDP_BATCH];
+  struct iovec riov[UDP_BATCH], siov[UDP_BATCH];
+  int n, nsend;
+
+  for (int i = 0; i < UDP_BATCH; i++) {
+    riov[i].iov_base = in[i];
+    riov[i].iov_len = RL_MAX_FRAME;
+    memset(&rmsg[i], 0, sizeof(rmsg[i]));
+    rmsg[i].msg_hdr.msg_iov = &riov[i];
+    rmsg[i].msg_hdr.msg_iovlen = 1;
+    rmsg[i].msg_hdr.msg_name = &addr[i];
+    rmsg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+  }
+
+  for (;;) {
+    n = recvmmsg(l->udp_fd, rmsg, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0)
+      return;
+
+    nsend = 0;
+    for (int i = 0; i < n; i++) {
+      if (rmsg[i].msg_len < sizeof(rl_frame_hdr_t) ||
+          rmsg[i].msg_len !=
+            rl_frame_len((rl_frame_hdr_t*)in[i], RL_OP_ADMIT))
+        continue;
+      siov[nsend].iov_base = out[nsend];
+      siov[nsend].iov_len = admit_frame(in[i], out[nsend]);
+      memset(&smsg[nsend], 0, sizeof(smsg[nsend]));
+      smsg[nsend].msg_hdr.msg_iov = &siov[nsend];
+      smsg[nsend].msg_hdr.msg_iovlen = 1;
+      smsg[nsend].msg_hdr.msg_name = &addr[i];
+      smsg[nsend].msg_hdr.msg_namelen = rmsg[i].msg_hdr.msg_namelen;
+      nsend++;
+    }
+    if (nsend)
+      sendmmsg(l->udp_fd, smsg, nsend, 0);
+
+    for (int i = 0; i < n; i++)
+      rmsg[i].msg_hdr.msg_namelen = sizeof(addr[i]);
+  }
+}
+
+void*
+event_loop(void* arg)
+{
+  loop_t* l = (loop_t*)arg;
+  struct epoll_event events[MAX_EVENTS];
+  int n;
+
+  while (!stop) {
+    n = epoll_wait(l->epfd, events, MAX_EVENTS, 500);
+    for (int i = 0; i < n; i++) {
+      if (&l->listen_fd == events[i].data.ptr) {
+        accept_connections(l);
+      } else if (&l->udp_fd == events[i].data.ptr) {
+        serve_datagrams(l);
+      } else if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+                 SUCCESS != conn_service((conn_t*)events[i].data.ptr)) {
+        conn_close((conn_t*)events[i].data.ptr);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+static int
+initialize_loop(loop_t* l, int port)
+{
+  struct epoll_event ev;
+
+  l->udp_in = malloc(UDP_BATCH * RL_MAX_FRAME);
+  l->udp_out = malloc(UDP_BATCH * RL_MAX_FRAME);
+  if (NULL == l->udp_in || NULL == l->udp_out)
+    return FAILURE;
+
+  l->epfd = epoll_create1(0);
+  l->listen_fd = open_socket(SOCK_STREAM, port);
+  l->udp_fd = open_socket(SOCK_DGRAM, port);
+  if (l->epfd < 0 || l->listen_fd < 0 || l->udp_fd < 0)
+    return FAILURE;
+
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &l->listen_fd;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listen_fd, &ev) < 0)
+    return FAILURE;
+
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &l->udp_fd;
+  if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->udp_fd, &ev) < 0)
+    return FAILURE;
+
+  return SUCCESS;
+}
+
+/* Share of tenants holding timestamps in their window */
+static double
+load_factor(void)
+{
+  unsigned int active = 0;
+
+  for (int i = 0; i < MAX_TENANTS; i++)
+    active += 0 != __atomic_load_n(&tenants[i].size, __ATOMIC_RELAXED);
+
+  return (double)active / MAX_TENANTS;
+}
+
+static void
+handle_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+int
+main(int argc, char** argv)
+{
+  static loop_t loops[MAX_LOOPS];
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int port = RL_PROTO_PORT, nloops = (ncpus < 1) ? 1 : ncpus, opt;
+  const char* metrics_path = NULL;
+  unsigned long allowed, denied;
+
+  while (-1 != (opt = getopt(argc, argv, "p:t:m:"))) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 't':
+        nloops = atoi(optarg);
+        break;
+      case 'm':
+        metrics_path = optarg;
+        break;
+      default:
+        fprintf(stderr,
+                "usage: %s [-p port] [-t loops] [-m metrics-file]\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (nloops < 1)
+    nloops = 1;
+  if (nloops > MAX_LOOPS)
+    nloops = MAX_LOOPS;
+
+  tenants = (tenant_t*)calloc(MAX_TENANTS, sizeof(tenant_t));
+  if (NULL == tenants) {
+    fprintf(stderr, "failed to allocate tenant table\n");
+    return 1;
+  }
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_init(&tenants[i].qlock, NULL);
+  rl_ts_init(&ts_clock);
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (int i = 0; i < nloops; i++) {
+    loops[i].id = i;
+    if (SUCCESS != initialize_loop(&loops[i], port)) {
+      perror("rl-server");
+      return 1;
+    }
+  }
+  for (int i = 0; i < nloops; i++)
+    pthread_create(&loops[i].thread, NULL, event_loop, &loops[i]);
+
+  printf("rl-server: listening on port %d (tcp/udp), %d loops\n",
+         port,
+         nloops);
+  fflush(stdout);
+
+  while (!stop) {
+    sleep(1);
+    rl_topk_decay(&top_requests);
+    rl_topk_decay(&top_denied);
+    if (NULL != metrics_path &&
+        0 != rl_stats_write_file(&stats, metrics_path, load_factor()))
+      perror("rl-server: metrics");
+  }
+
+  for (int i = 0; i < nloops; i++) {
+    pthread_join(loops[i].thread, NULL);
+    close(loops[i].listen_fd);
+    close(loops[i].udp_fd);
+    close(loops[i].epfd);
+    free(loops[i].udp_in);
+    free(loops[i].udp_out);
+  }
+
+  allowed = rl_stats_sum(&stats, 0, RL_STAT_ALLOWED);
+  denied = rl_stats_sum(&stats, 0, RL_STAT_DENIED);
+  printf("rl-server: %lu decisions, %lu allowed\n", allowed + denied, allowed);
+
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_destroy(&tenants[i].qlock);
+  free(tenants);
+
+  return 0;
+}
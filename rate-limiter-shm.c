@@ -0,0 +1,582 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-shm.c
+ *
+ * DESCRIPTION:
+ *   Sample multi-process sliding window rate limiter. The tenant table
+ *   lives in a POSIX shared memory region so that prefork workers share
+ *   their limits without a socket hop per decision.
+ *
+ * NOTES:
+ *   1. The region is position independent: a header followed by a
+ *      fixed array of tenant slots, each holding a ring of MAX_REQ
+ *      timestamps. Slots are found by offset (tenant_id * slot size),
+ *      there are no pointers (cf. qnode_t->next in rate-limiter.c), so
+ *      every process may map it at a different address.
+ *
+ *   2. Each slot is guarded by a robust, process-shared qlock. If a
+ *      process dies while holding it, the next locker gets EOWNERDEAD,
+ *      repairs the slot (see recover_tenant()) and marks the lock
+ *      consistent again.
+ *
+ *   3. Slot updates are ordered so that a half done update is always
+ *      safe to keep: a timestamp is written before size is bumped, and
+ *      expiry only ever drops entries. The dirty flag marks a slot under
+ *      update so that recovery knows which slots to re-validate.
+ *
+ *   4. The blocked-until time of a slot is a process-shared atomic, so
+ *      denied tenants are answered without taking the lock. Nothing
+ *      else is shared between processes on the decision path, which
+ *      then costs the same as in-process admission.
+ *
+ *   5. Slots are initialized lazily, on first use: a zero page is a
+ *      valid "untouched" slot, and the first process to touch one claims
+ *      it by swapping its pid into the slot state, initializes it and
+ *      marks it SLOT_READY. A claim left behind by a dead process is
+ *      taken over. Creating or opening a table therefore costs the same
+ *      for 100 or 10M tenants, and only touched slots ever get a page.
+ *
+ *   6. Pids and the owner tids of robust locks only mean something
+ *      within one boot: after a reboot a stale claim may name a live,
+ *      unrelated process and a lock held at the crash is never marked
+ *      EOWNERDEAD. The header therefore records the kernel boot id of
+ *      the boot that last opened the table. The first process to open
+ *      it in a new boot (under flock(), so exactly one) drops every
+ *      claim, re-initializes the locks of ready slots, repairs any ring
+ *      caught mid-update and stamps the new boot id. Only the data
+ *      extents of the file are walked (SEEK_DATA), so untouched slots
+ *      stay holes.
+ *
+ *   7. With -f the table is a regular file instead of POSIX shared
+ *      memory (a sparse file, as it is sized with ftruncate). The file
+ *      is kept across runs and timestamps are wall clock time, so a
+ *      restarted process resumes every window with no load step: its
+ *      pages simply fault in as tenants are touched.
+ *
+ *   Usage: rl-shm [-f file] [-n tenants]
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 100   /* Active tenants, default */
+#define WINDOW_SIZE 10000 /* Miliseconds (10s)    */
+#define MAX_REQ 10        /* 10ms service rate    */
+
+#define SHM_NAME "/rate-limiter"
+#define SHM_MAGIC 0x524c53484d544231ULL /* "RLSHMTB1" */
+#define SHM_VERSION 3
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_LEN 36
+#define SLOT_READY UINT32_MAX /* otherwise 0 or the initializer's pid */
+#define CREATE_TIMEOUT 5000   /* Miliseconds, waiting for the creator */
+
+#define TEST_NUM_WORKERS 4
+#define TEST_NUM_TENANTS 3
+#define TEST_MAX_REQUESTS 1000000
+
+typedef struct
+{
+  uint64_t magic;
+  uint32_t version;
+  uint32_t max_tenants;
+  uint32_t tenant_size; /* sizeof(shm_tenant_t) of the creator */
+  _Atomic uint32_t ready;
+  _Atomic uint64_t recovered; /* locks recovered from dead owners */
+  char boot_id[BOOT_ID_LEN + 4]; /* boot that last opened the table */
+} shm_header_t;
+
+typedef struct
+{
+  _Atomic uint32_t state; /* see SLOT_READY */
+  pthread_mutex_t qlock;  /* robust, process-shared */
+  _Atomic long blocked_until;
+  uint32_t head;
+  uint32_t size;
+  uint32_t dirty; /* set while the ring is being updated */
+  long slots[MAX_REQ];
+} shm_tenant_t;
+
+typedef struct
+{
+  shm_header_t* hdr; /* base of this process' mapping */
+  size_t size;
+  uint32_t max_tenants;
+  const char* path; /* NULL for POSIX shared memory */
+} shm_limiter_t;
+
+#define SHM_SIZE(tenants)                                                    \
+  (sizeof(shm_header_t) + (size_t)(tenants) * sizeof(shm_tenant_t))
+
+static inline shm_tenant_t*
+tenant_slot(shm_limiter_t* rl, unsigned int tenant_id)
+{
+  return (shm_tenant_t*)((char*)rl->hdr + sizeof(shm_header_t) +
+                         (size_t)tenant_id * sizeof(shm_tenant_t));
+}
+
+static int
+initialize_qlock(shm_tenant_t* t)
+{
+  pthread_mutexattr_t attr;
+  int rc;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  rc = pthread_mutex_init(&t->qlock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  return rc ? FAILURE : SUCCESS;
+}
+
+static int
+initialize_tenant(shm_tenant_t* t)
+{
+  atomic_store(&t->blocked_until, 0);
+  t->head = t->size = t->dirty = 0;
+
+  return initialize_qlock(t);
+}
+
+/*
+ * Keep every timestamp of a ring caught mid-update that is still
+ * plausible, and drop the rest.
+ */
+static void
+repair_ring(shm_tenant_t* t, long timestamp)
+{
+  uint32_t keep = 0;
+  long prev = 0, data;
+
+  if (t->dirty || t->head >= MAX_REQ || t->size > MAX_REQ) {
+    if (t->head >= MAX_REQ || t->size > MAX_REQ)
+      t->head = t->size = 0;
+
+    /* a valid window is non-decreasing and not in the future */
+    for (uint32_t i = 0; i < t->size; i++) {
+      data = t->slots[(t->head + i) % MAX_REQ];
+      if (data < prev || data > timestamp)
+        break;
+      prev = data;
+      keep++;
+    }
+    t->size = keep;
+    t->dirty = 0;
+  }
+}
+
+/* First use of a slot: claim it, or wait for whoever claimed it */
+static shm_tenant_t*
+claim_tenant(shm_tenant_t* t)
+{
+  uint32_t self = getpid(), state;
+
+  for (;;) {
+    state = atomic_load_explicit(&t->state, memory_order_acquire);
+    if (SLOT_READY == state)
+      return t;
+
+    /* untouched, or claimed by a process that died meanwhile */
+    if ((0 == state || (kill(state, 0) < 0 && ESRCH == errno)) &&
+        atomic_compare_exchange_strong(&t->state, &state, self)) {
+      if (SUCCESS != initialize_tenant(t)) {
+        atomic_store(&t->state, 0);
+        return NULL;
+      }
+      atomic_store_explicit(&t->state, SLOT_READY, memory_order_release);
+      return t;
+    }
+    sched_yield();
+  }
+}
+
+/* NULL if tenant_id is out of the table, or it could not be set up */
+static inline shm_tenant_t*
+get_tenant(shm_limiter_t* rl, unsigned int tenant_id)
+{
+  shm_tenant_t* t;
+
+  if (tenant_id >= rl->max_tenants)
+    return NULL;
+  t = tenant_slot(rl, tenant_id);
+  if (SLOT_READY == atomic_load_explicit(&t->state, memory_order_acquire))
+    return t;
+  return claim_tenant(t);
+}
+
+long
+get_current_time_ms();
+
+static void
+read_boot_id(char* boot_id)
+{
+  int fd = open(BOOT_ID_PATH, O_RDONLY);
+  ssize_t len = fd < 0 ? -1 : read(fd, boot_id, BOOT_ID_LEN);
+
+  if (fd >= 0)
+    close(fd);
+  boot_id[len < 0 ? 0 : len] = '\0';
+}
+
+/* A slot as left by an earlier boot, see note 6 */
+static void
+reset_slot(shm_tenant_t* t, long timestamp)
+{
+  uint32_t state = atomic_load(&t->state);
+
+  if (0 == state)
+    return;
+  if (SLOT_READY != state) {
+    atomic_store(&t->state, 0); /* claimed, never initialized */
+    return;
+  }
+  initialize_qlock(t);
+  repair_ring(t, timestamp);
+  atomic_store(&t->blocked_until, 0);
+}
+
+/* Reset the slots of the data extents of the table, see note 6 */
+static void
+reset_slots(shm_limiter_t* rl, int fd)
+{
+  size_t first, last, hdr = sizeof(shm_header_t), ts = sizeof(shm_tenant_t);
+  long now = get_current_time_ms();
+  off_t data = 0, hole;
+
+  while ((size_t)data < rl->size &&
+         (data = lseek(fd, data, SEEK_DATA)) >= 0) {
+    hole = lseek(fd, data, SEEK_HOLE);
+    if (hole < 0 || (size_t)hole > rl->size)
+      hole = rl->size;
+    first = (size_t)data < hdr ? 0 : ((size_t)data - hdr) / ts;
+    last = (size_t)hole <= hdr ? 0 : ((size_t)hole - hdr + ts - 1) / ts;
+    for (size_t i = first; i < last && i < rl->max_tenants; i++)
+      reset_slot(tenant_slot(rl, i), now);
+    data = hole;
+  }
+  if (data < 0 && ENXIO != errno) {
+    /* no SEEK_DATA here: every slot */
+    for (size_t i = 0; i < rl->max_tenants; i++)
+      reset_slot(tenant_slot(rl, i), now);
+  }
+}
+
+/*
+ * Map the tenant table at path (or POSIX shared memory if path is NULL),
+ * creating it if this is the first process. Later processes wait until
+ * the creator is done, for up to CREATE_TIMEOUT ms: a creator that died
+ * half way leaves a table that is never ready (or a smaller table than
+ * asked for never grows), which fails rather than hangs. Slots are not
+ * touched (note 5), unless the table was last opened in an earlier boot
+ * (note 6).
+ */
+unsigned int
+initialize_limiter(shm_limiter_t* rl, const char* path, uint32_t max_tenants)
+{
+  int fd, created = 1;
+  char boot_id[BOOT_ID_LEN + 1];
+  struct stat st;
+  int waited = 0;
+
+  rl->path = path;
+  rl->max_tenants = max_tenants;
+  rl->size = SHM_SIZE(max_tenants);
+
+  if (path)
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+  else
+    fd = shm_open(SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && EEXIST == errno) {
+    created = 0;
+    fd = path ? open(path, O_RDWR) : shm_open(SHM_NAME, O_RDWR, 0600);
+  }
+  if (fd < 0)
+    return FAILURE;
+
+  if (created && ftruncate(fd, rl->size) < 0)
+    goto fail;
+
+  /* wait for the creator to size the region */
+  for (;;) {
+    if (fstat(fd, &st) < 0)
+      goto fail;
+    if ((size_t)st.st_size >= rl->size)
+      break;
+    if (++waited > CREATE_TIMEOUT)
+      goto fail;
+    usleep(1000);
+  }
+
+  rl->hdr = (shm_header_t*)mmap(
+    NULL, rl->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == rl->hdr)
+    goto fail;
+
+  read_boot_id(boot_id);
+  if (created) {
+    strcpy(rl->hdr->boot_id, boot_id);
+    rl->hdr->magic = SHM_MAGIC;
+    rl->hdr->version = SHM_VERSION;
+    rl->hdr->max_tenants = max_tenants;
+    rl->hdr->tenant_size = sizeof(shm_tenant_t);
+    atomic_store_explicit(&rl->hdr->ready, 1, memory_order_release);
+  } else {
+    while (!atomic_load_explicit(&rl->hdr->ready, memory_order_acquire) &&
+           ++waited <= CREATE_TIMEOUT)
+      usleep(1000);
+    if (!atomic_load_explicit(&rl->hdr->ready, memory_order_acquire) ||
+        SHM_MAGIC != rl->hdr->magic || SHM_VERSION != rl->hdr->version ||
+        max_tenants != rl->hdr->max_tenants ||
+        sizeof(shm_tenant_t) != rl->hdr->tenant_size) {
+      munmap(rl->hdr, rl->size);
+      close(fd);
+      return FAILURE;
+    }
+
+    /* first open since a reboot: claims and lock owners are stale */
+    flock(fd, LOCK_EX);
+    if (0 != strcmp(rl->hdr->boot_id, boot_id)) {
+      reset_slots(rl, fd);
+      strcpy(rl->hdr->boot_id, boot_id);
+    }
+    flock(fd, LOCK_UN);
+  }
+  close(fd);
+
+  return SUCCESS;
+
+fail:
+  close(fd);
+  if (created) {
+    if (path)
+      unlink(path);
+    else
+      shm_unlink(SHM_NAME);
+  }
+  return FAILURE;
+}
+
+void
+destroy_limiter(shm_limiter_t* rl)
+{
+  munmap(rl->hdr, rl->size);
+}
+
+/* Rate limiter functionality and helper functions */
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/*
+ * Called with qlock held after its owner died. Keeps every timestamp
+ * that is still plausible and drops the rest.
+ */
+static void
+recover_tenant(shm_limiter_t* rl, shm_tenant_t* t, long timestamp)
+{
+  repair_ring(t, timestamp);
+  atomic_store(&t->blocked_until, 0);
+  atomic_fetch_add(&rl->hdr->recovered, 1);
+  pthread_mutex_consistent(&t->qlock);
+}
+
+int
+check_tenant_allowed(shm_limiter_t* rl,
+                     unsigned int tenant_id,
+                     long timestamp,
+                     long* retry_after)
+{
+  shm_tenant_t* t = get_tenant(rl, tenant_id);
+  long blocked_until;
+  int result;
+
+  if (NULL == t) {
+    *retry_after = 0;
+    return FAILURE;
+  }
+
+  blocked_until = atomic_load_explicit(&t->blocked_until, memory_order_relaxed);
+  if (timestamp < blocked_until) {
+    *retry_after = blocked_until - timestamp;
+    return FAILURE;
+  }
+
+  if (EOWNERDEAD == pthread_mutex_lock(&t->qlock))
+    recover_tenant(rl, t, timestamp);
+
+  t->dirty = 1;
+  while (t->size && (timestamp - t->slots[t->head] >= WINDOW_SIZE)) {
+    t->head = (t->head + 1) % MAX_REQ;
+    t->size--;
+  }
+  if (t->size < MAX_REQ) {
+    t->slots[(t->head + t->size) % MAX_REQ] = timestamp;
+    t->size++;
+    *retry_after = 0;
+    result = SUCCESS;
+  } else {
+    blocked_until = t->slots[t->head] + WINDOW_SIZE;
+    atomic_store_explicit(&t->blocked_until,
+                          blocked_until,
+                          memory_order_relaxed);
+    *retry_after = blocked_until - timestamp;
+    result = FAILURE;
+  }
+  t->dirty = 0;
+
+  pthread_mutex_unlock(&t->qlock);
+
+  return result;
+}
+
+static void
+worker_process(int worker_id, const char* path, uint32_t max_tenants)
+{
+  shm_limiter_t rl;
+  long curr_time_ms, retry_after, start_ms;
+  unsigned long allowed = 0;
+  int tenant_id = 0;
+
+  if (SUCCESS != initialize_limiter(&rl, path, max_tenants)) {
+    fprintf(stderr, "[%d] failed to map limiter\n", getpid());
+    _exit(1);
+  }
+
+  /* the first worker dies holding a lock, to exercise recovery */
+  if (0 == worker_id) {
+    shm_tenant_t* t = get_tenant(&rl, 0);
+    pthread_mutex_lock(&t->qlock);
+    t->dirty = 1;
+    printf("[%d] exiting with tenant 0 locked\n", getpid());
+    fflush(stdout);
+    _exit(0);
+  }
+
+  start_ms = get_current_time_ms();
+  for (int i = 0; i < TEST_MAX_REQUESTS; i++) {
+    curr_time_ms = get_current_time_ms();
+    tenant_id = (tenant_id + 1) % TEST_NUM_TENANTS;
+    if (SUCCESS ==
+        check_tenant_allowed(&rl, tenant_id, curr_time_ms, &retry_after))
+      allowed++;
+  }
+
+  printf("[%d] %d decisions in %ld ms, allowed: %lu\n",
+         getpid(),
+         TEST_MAX_REQUESTS,
+         get_current_time_ms() - start_ms,
+         allowed);
+
+  destroy_limiter(&rl);
+  fflush(stdout);
+  _exit(0);
+}
+
+int
+main(int argc, char** argv)
+{
+  /* Sample usage.
+   * - TEST_NUM_WORKERS forked processes sharing one tenant table
+   * - worker 0 dies holding tenant 0's lock; the others recover it
+   * - totals must respect MAX_REQ per tenant across all processes
+   * - with -f the table persists: a second run within WINDOW_SIZE
+   *   resumes the windows and admits nothing new
+   */
+
+  shm_limiter_t rl;
+  const char* path = NULL;
+  uint32_t max_tenants = MAX_TENANTS;
+  unsigned long allowed = 0;
+  shm_tenant_t* t;
+  struct timeval start, end;
+  pid_t pid;
+  int opt;
+
+  while (-1 != (opt = getopt(argc, argv, "f:n:"))) {
+    switch (opt) {
+      case 'f':
+        path = optarg;
+        break;
+      case 'n':
+        max_tenants = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-f file] [-n tenants]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (max_tenants < TEST_NUM_TENANTS) {
+    fprintf(stderr, "rl-shm: at least %d tenants\n", TEST_NUM_TENANTS);
+    return 1;
+  }
+
+  if (NULL == path)
+    shm_unlink(SHM_NAME);
+  gettimeofday(&start, NULL);
+  if (SUCCESS != initialize_limiter(&rl, path, max_tenants)) {
+    fprintf(stderr, "failed to create limiter\n");
+    return 1;
+  }
+  gettimeofday(&end, NULL);
+  printf("mapped %u tenants (%zu MB) in %ld us\n",
+         max_tenants,
+         rl.size >> 20,
+         (end.tv_sec - start.tv_sec) * 1000000L + end.tv_usec - start.tv_usec);
+  fflush(stdout); /* before fork */
+
+  for (int i = 0; i < TEST_NUM_WORKERS; i++) {
+    pid = fork();
+    if (0 == pid)
+      worker_process(i, path, max_tenants);
+    else if (pid < 0)
+      perror("fork");
+    else if (0 == i)
+      waitpid(pid, NULL, 0); /* let it die first */
+  }
+
+  while (wait(NULL) > 0)
+    ;
+
+  for (int i = 0; i < TEST_NUM_TENANTS; i++) {
+    t = tenant_slot(&rl, i);
+    if (SLOT_READY == atomic_load(&t->state))
+      allowed += t->size;
+  }
+
+  printf("in window: %lu (limit %d x %d tenants), recovered locks: %lu\n",
+         allowed,
+         MAX_REQ,
+         TEST_NUM_TENANTS,
+         (unsigned long)atomic_load(&rl.hdr->recovered));
+
+  destroy_limiter(&rl);
+  if (NULL == path)
+    shm_unlink(SHM_NAME);
+
+  return 0;
+}
@@ -0,0 +1,189 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-stats.h
+ *
+ * DESCRIPTION:
+ *   Decision counters for the limiter engines, exposed in the
+ *   OpenMetrics text format.
+ *
+ * NOTES:
+ *   1. Every thread gets its own shard of counters, on its own cache
+ *      lines, the first time it records anything. A shard has a single
+ *      writer, so an update is a plain load and store (relaxed atomics,
+ *      so that a scrape never reads a torn value) with no locked
+ *      instruction and no shared line. Threads past the first
+ *      RL_STATS_MAX_THREADS - 1 share the last shard and use atomic
+ *      adds.
+ *
+ *   2. Shards are only summed when scraped, by rl_stats_dump() or
+ *      rl_stats_write_file(). The latter writes a file for a textfile
+ *      collector (e.g. node_exporter), replaced atomically.
+ *
+ *   3. An engine can append its own metric families (e.g. the latency
+ *      histograms of rate-limiter-hist.h) through the extra hook.
+ *
+ *   4. Counters are kept per tenant class (a tier, a level, ...), as
+ *      named by the engine; engines without classes use one class.
+ *
+ *   5. Header only: thread ids are static, so use the counters from one
+ *      translation unit per program.
+ *
+ */
+
+#ifndef RATE_LIMITER_STATS_H
+#define RATE_LIMITER_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define RL_STATS_MAX_THREADS 256
+#define RL_STATS_MAX_CLASSES 4
+
+#define RL_STAT_ALLOWED 0
+#define RL_STAT_DENIED 1
+#define RL_STAT_EXPIRED 2   /* timestamps that left the window */
+#define RL_STAT_EVICTED 3   /* idle tenants reclaimed */
+#define RL_STAT_CONTENDED 4 /* lock acquisitions that had to wait */
+#define RL_STAT_COUNT 5
+
+typedef struct
+{
+  _Alignas(64) uint64_t c[RL_STATS_MAX_CLASSES][RL_STAT_COUNT];
+} rl_stats_shard_t;
+
+typedef struct
+{
+  const char* engine;
+  unsigned int nclasses;
+  const char* class_names[RL_STATS_MAX_CLASSES];
+  void (*extra)(FILE* out); /* more metric families, e.g. histograms */
+  rl_stats_shard_t shards[RL_STATS_MAX_THREADS];
+} rl_stats_t;
+
+static int rl_stats_nthreads;
+static __thread int rl_stats_tid = -1;
+
+static inline int
+rl_stats_register(void)
+{
+  int tid = __atomic_fetch_add(&rl_stats_nthreads, 1, __ATOMIC_RELAXED);
+
+  rl_stats_tid = tid < RL_STATS_MAX_THREADS ? tid : RL_STATS_MAX_THREADS - 1;
+  return rl_stats_tid;
+}
+
+static inline void
+rl_stats_add(rl_stats_t* s, unsigned int cls, int stat, uint64_t n)
+{
+  int tid = rl_stats_tid >= 0 ? rl_stats_tid : rl_stats_register();
+  uint64_t* c = &s->shards[tid].c[cls][stat];
+
+  if (tid < RL_STATS_MAX_THREADS - 1)
+    __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+static inline void
+rl_stats_inc(rl_stats_t* s, unsigned int cls, int stat)
+{
+  rl_stats_add(s, cls, stat, 1);
+}
+
+static inline uint64_t
+rl_stats_sum(const rl_stats_t* s, unsigned int cls, int stat)
+{
+  int nthreads = __atomic_load_n(&rl_stats_nthreads, __ATOMIC_RELAXED);
+  uint64_t sum = 0;
+
+  if (nthreads > RL_STATS_MAX_THREADS)
+    nthreads = RL_STATS_MAX_THREADS;
+  for (int i = 0; i < nthreads; i++)
+    sum += __atomic_load_n(&s->shards[i].c[cls][stat], __ATOMIC_RELAXED);
+
+  return sum;
+}
+
+static inline void
+rl_stats_dump_counter(const rl_stats_t* s,
+                      FILE* out,
+                      const char* name,
+                      const char* help,
+                      int stat)
+{
+  fprintf(out, "# TYPE %s counter\n# HELP %s %s\n", name, name, help);
+  for (unsigned int cls = 0; cls < s->nclasses; cls++) {
+    fprintf(out,
+            "%s_total{engine=\"%s\",class=\"%s\"} %llu\n",
+            name,
+            s->engine,
+            s->class_names[cls],
+            (unsigned long long)rl_stats_sum(s, cls, stat));
+  }
+}
+
+/* Write all counters, and the table load factor, in OpenMetrics text */
+static inline void
+rl_stats_dump(const rl_stats_t* s, FILE* out, double load_factor)
+{
+  fprintf(out,
+          "# TYPE rl_decisions counter\n"
+          "# HELP rl_decisions Admission decisions.\n");
+  for (unsigned int cls = 0; cls < s->nclasses; cls++) {
+    fprintf(out,
+            "rl_decisions_total{engine=\"%s\",class=\"%s\",result=\"allowed\"}"
+            " %llu\n"
+            "rl_decisions_total{engine=\"%s\",class=\"%s\",result=\"denied\"}"
+            " %llu\n",
+            s->engine,
+            s->class_names[cls],
+            (unsigned long long)rl_stats_sum(s, cls, RL_STAT_ALLOWED),
+            s->engine,
+            s->class_names[cls],
+            (unsigned long long)rl_stats_sum(s, cls, RL_STAT_DENIED));
+  }
+  rl_stats_dump_counter(s,
+                        out,
+                        "rl_expired",
+                        "Request timestamps expired out of the window.",
+                        RL_STAT_EXPIRED);
+  rl_stats_dump_counter(
+    s, out, "rl_evicted", "Idle tenants reclaimed.", RL_STAT_EVICTED);
+  rl_stats_dump_counter(s,
+                        out,
+                        "rl_lock_contended",
+                        "Tenant lock acquisitions that had to wait.",
+                        RL_STAT_CONTENDED);
+  fprintf(out,
+          "# TYPE rl_table_load_factor gauge\n"
+          "# HELP rl_table_load_factor Share of tenant slots in use.\n"
+          "rl_table_load_factor{engine=\"%s\"} %.6f\n",
+          s->engine,
+          load_factor);
+  if (NULL != s->extra)
+    s->extra(out);
+  fputs("# EOF\n", out);
+}
+
+/* rl_stats_dump() to path, through a temporary file and a rename */
+static inline int
+rl_stats_write_file(const rl_stats_t* s, const char* path, double load_factor)
+{
+  char tmp_path[256];
+  FILE* out;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  out = fopen(tmp_path, "w");
+  if (NULL == out)
+    return -1;
+  rl_stats_dump(s, out, load_factor);
+  if (0 != fclose(out) || 0 != rename(tmp_path, path)) {
+    unlink(tmp_path);
+    return -1;
+  }
+
+  return 0;
+}
+
+#endif /* RATE_LIMITER_STATS_H */
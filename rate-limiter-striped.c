@@ -0,0 +1,315 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-striped.c
+ *
+ * DESCRIPTION:
+ *   Sample MT-Safe sliding window rate limiter for a single hot key
+ *   (a global limit, or a very hot tenant) using per-CPU striped
+ *   counters instead of one lock protected queue.
+ *
+ * NOTES:
+ *   1. The window is split into NUM_BUCKETS buckets. Every stripe
+ *      (one per CPU, picked with sched_getcpu(), which glibc serves
+ *      from the rseq area) keeps its own bucket counters on its own
+ *      cache lines, so admissions far from the limit never write a
+ *      shared line.
+ *
+ *   2. The exact count is only summed lazily, in the slow path, under
+ *      a lock. Each sum publishes a generation together with a per
+ *      stripe quota of (MAX_REQ - count) / nstripes; a stripe may
+ *      admit on the fast path until it has used its quota for the
+ *      current generation. As the remaining room shrinks so do the
+ *      quotas, and close to the threshold every decision takes the
+ *      exact slow path.
+ *
+ *   3. A fast path admission first reserves its bucket slot and only
+ *      then reads the generation. The slow path invalidates the
+ *      generation before summing, so every admission is either
+ *      included in the sum or charged against the new quota, and the
+ *      limit is never exceeded. Reservations that are given back only
+ *      ever make the sum larger, never smaller.
+ *
+ *   4. Counts are kept at bucket granularity, so a request is counted
+ *      for between WINDOW_SIZE and WINDOW_SIZE + BUCKET_SIZE ms; the
+ *      limiter errs on the side of denying.
+ *
+ *   5. Bucket tags are 32-bit epochs and wrap. A bucket is current only
+ *      while its tag is less than RING_BUCKETS epochs away from the one
+ *      asked about (a racing admission with an older timestamp may find
+ *      it a little ahead); anything further, including a never used
+ *      bucket, is stale and is reset or skipped.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define WINDOW_SIZE 1000 /* Miliseconds (1s)     */
+#define MAX_REQ 5000000  /* Hot key limit        */
+#define NUM_BUCKETS 10
+#define BUCKET_SIZE (WINDOW_SIZE / NUM_BUCKETS)
+#define RING_BUCKETS (NUM_BUCKETS + 1) /* window plus current bucket */
+#define MAX_STRIPES 64
+#define CACHE_LINE 64
+
+#define TEST_DURATION 3000 /* Miliseconds          */
+
+/* Per-CPU sub-counters; each word is (epoch/generation << 32 | count) */
+typedef struct
+{
+  _Alignas(CACHE_LINE) _Atomic uint64_t bucket[RING_BUCKETS];
+  _Atomic uint64_t lease; /* fast path admissions in a generation */
+} stripe_t;
+
+typedef struct
+{
+  _Alignas(CACHE_LINE) _Atomic uint64_t share; /* generation, quota */
+  _Alignas(CACHE_LINE) pthread_mutex_t lock;   /* slow path only */
+  unsigned int nstripes;
+  stripe_t stripes[MAX_STRIPES];
+} striped_limiter_t;
+
+#define WORD_TAG(w) ((uint32_t)((w) >> 32))
+#define WORD_COUNT(w) ((uint32_t)(w))
+#define MAKE_WORD(tag, count) (((uint64_t)(tag) << 32) | (uint32_t)(count))
+
+unsigned int
+initialize_limiter(striped_limiter_t** rl)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+  *rl = (striped_limiter_t*)aligned_alloc(CACHE_LINE,
+                                          sizeof(striped_limiter_t));
+  if (NULL == *rl)
+    return FAILURE;
+
+  memset(*rl, 0, sizeof(striped_limiter_t));
+  pthread_mutex_init(&(*rl)->lock, NULL);
+  (*rl)->nstripes =
+    (ncpus < 1) ? 1 : (ncpus > MAX_STRIPES) ? MAX_STRIPES : ncpus;
+  atomic_store(&(*rl)->share, MAKE_WORD(1, MAX_REQ / (*rl)->nstripes));
+
+  return SUCCESS;
+}
+
+void
+destroy_limiter(striped_limiter_t* rl)
+{
+  if (NULL == rl)
+    return;
+
+  pthread_mutex_destroy(&rl->lock);
+  free(rl);
+}
+
+/* Stripe helpers */
+
+static inline stripe_t*
+current_stripe(striped_limiter_t* rl)
+{
+  int cpu = sched_getcpu();
+
+  return &rl->stripes[(cpu < 0 ? 0 : cpu) % rl->nstripes];
+}
+
+/* Add one to the stripe bucket of epoch (resetting a stale bucket) */
+static inline void
+stripe_reserve(stripe_t* s, uint32_t epoch)
+{
+  _Atomic uint64_t* b = &s->bucket[epoch % RING_BUCKETS];
+  uint64_t old = atomic_load_explicit(b, memory_order_relaxed), new;
+
+  do {
+    /* a bucket already reused for a newer epoch keeps its epoch */
+    if ((uint32_t)(WORD_TAG(old) - epoch) < RING_BUCKETS)
+      new = MAKE_WORD(WORD_TAG(old), WORD_COUNT(old) + 1);
+    else
+      new = MAKE_WORD(epoch, 1);
+  } while (!atomic_compare_exchange_weak(b, &old, new));
+}
+
+/* Give back a reservation, unless its bucket has moved on already */
+static inline void
+stripe_release(stripe_t* s, uint32_t epoch)
+{
+  _Atomic uint64_t* b = &s->bucket[epoch % RING_BUCKETS];
+  uint64_t old = atomic_load_explicit(b, memory_order_relaxed);
+
+  do {
+    if (WORD_TAG(old) != epoch || 0 == WORD_COUNT(old))
+      return;
+  } while (!atomic_compare_exchange_weak(b, &old, old - 1));
+}
+
+/* Exact count of the window ending in epoch, across all stripes */
+static unsigned long
+window_count(striped_limiter_t* rl, uint32_t epoch)
+{
+  unsigned long count = 0;
+  uint64_t w;
+
+  for (unsigned int i = 0; i < rl->nstripes; i++) {
+    for (int b = 0; b < RING_BUCKETS; b++) {
+      w = atomic_load(&rl->stripes[i].bucket[b]);
+      if ((uint32_t)(epoch - WORD_TAG(w)) < RING_BUCKETS ||
+          (uint32_t)(WORD_TAG(w) - epoch) < RING_BUCKETS)
+        count += WORD_COUNT(w);
+    }
+  }
+
+  return count;
+}
+
+/* Rate limiter functionality and helper functions */
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/* Exact slow path: sum all stripes and hand out fresh quotas */
+static int
+check_exact(striped_limiter_t* rl, stripe_t* s, uint32_t epoch)
+{
+  unsigned long count, quota;
+  uint32_t gen;
+  int result;
+
+  pthread_mutex_lock(&rl->lock);
+
+  /* stop fast path admissions of the current generation first */
+  gen = WORD_TAG(atomic_load(&rl->share)) + 1;
+  atomic_store(&rl->share, MAKE_WORD(gen, 0));
+
+  count = window_count(rl, epoch);
+  if (count < MAX_REQ) {
+    stripe_reserve(s, epoch);
+    count++;
+    result = SUCCESS;
+  } else {
+    result = FAILURE;
+  }
+
+  /* in-flight reservations may push the sum past the limit */
+  quota = (count < MAX_REQ) ? (MAX_REQ - count) / rl->nstripes : 0;
+  atomic_store(&rl->share, MAKE_WORD(gen + 1, quota));
+
+  pthread_mutex_unlock(&rl->lock);
+
+  return result;
+}
+
+int
+check_allowed(striped_limiter_t* rl, long timestamp)
+{
+  uint32_t epoch = (uint32_t)(timestamp / BUCKET_SIZE);
+  stripe_t* s = current_stripe(rl);
+  uint64_t share, lease, used;
+
+  stripe_reserve(s, epoch);
+
+  lease = atomic_load_explicit(&s->lease, memory_order_relaxed);
+  do {
+    share = atomic_load(&rl->share);
+    used = (WORD_TAG(lease) == WORD_TAG(share)) ? WORD_COUNT(lease) : 0;
+    if (used >= WORD_COUNT(share)) {
+      stripe_release(s, epoch);
+      return check_exact(rl, s, epoch);
+    }
+  } while (!atomic_compare_exchange_weak(
+    &s->lease, &lease, MAKE_WORD(WORD_TAG(share), used + 1)));
+
+  return SUCCESS;
+}
+
+typedef struct
+{
+  striped_limiter_t* rl;
+  long end_time_ms;
+  unsigned long allowed;
+  unsigned long denied;
+} client_arg_t;
+
+void*
+client_thread(void* arg)
+{
+  client_arg_t* c = (client_arg_t*)arg;
+  long curr_time_ms = 0;
+
+  do {
+    curr_time_ms = get_current_time_ms();
+    for (int i = 0; i < 64; i++) {
+      if (SUCCESS == check_allowed(c->rl, curr_time_ms))
+        c->allowed++;
+      else
+        c->denied++;
+    }
+  } while (curr_time_ms < c->end_time_ms);
+
+  return NULL;
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - one client thread per CPU hammering the same key
+   * - limit MAX_REQ per WINDOW_SIZE
+   * - total decisions per second reported at the end
+   */
+
+  striped_limiter_t* rl = NULL;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = (ncpus < 1) ? 1 : (ncpus > MAX_STRIPES) ? MAX_STRIPES
+                                                          : ncpus;
+  pthread_t threads[MAX_STRIPES];
+  client_arg_t args[MAX_STRIPES];
+  unsigned long allowed = 0, denied = 0;
+  long start_ms;
+
+  if (SUCCESS != initialize_limiter(&rl)) {
+    fprintf(stderr, "failed to allocate limiter\n");
+    return 1;
+  }
+
+  start_ms = get_current_time_ms();
+  for (int i = 0; i < nthreads; i++) {
+    memset(&args[i], 0, sizeof(args[i]));
+    args[i].rl = rl;
+    args[i].end_time_ms = start_ms + TEST_DURATION;
+    pthread_create(&threads[i], NULL, client_thread, &args[i]);
+  }
+
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+    allowed += args[i].allowed;
+    denied += args[i].denied;
+  }
+
+  printf("threads: %d, stripes: %u\n", nthreads, rl->nstripes);
+  printf("allowed: %lu (limit %d / %d ms), denied: %lu\n",
+         allowed,
+         MAX_REQ,
+         WINDOW_SIZE,
+         denied);
+  printf("decisions/sec: %.0f\n",
+         (allowed + denied) * 1000.0 / (get_current_time_ms() - start_ms));
+
+  destroy_limiter(rl);
+
+  return 0;
+}
@@ -0,0 +1,259 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-topk.h
+ *
+ * DESCRIPTION:
+ *   Streaming top-K of tenants (hottest by requests, most denied) in
+ *   fixed memory, using the space-saving algorithm.
+ *
+ * NOTES:
+ *   1. A sketch monitors RL_TOPK_K tenants in a min-heap on their count.
+ *      A monitored tenant has its count raised; an unmonitored one
+ *      replaces the minimum and inherits its count as error. Any tenant
+ *      with more than total / RL_TOPK_K of the stream is guaranteed to
+ *      be monitored, and count - error <= true count <= count.
+ *
+ *   2. A small open addressing index (key -> heap position, linear
+ *      probing with backward shift deletion) avoids scanning the heap,
+ *      so an update is O(log K) under the sketch lock.
+ *
+ *   3. Fast path: rl_topk_sample() lets one request in RL_TOPK_SAMPLE
+ *      through to the sketch, chosen by a per thread random number, and
+ *      counts it RL_TOPK_SAMPLE times. The rest cost a multiply and a
+ *      compare, and the lock is taken only for sampled requests.
+ *
+ *   4. rl_topk_decay() halves all counts. Called once per second and
+ *      read just after, a count estimates the requests per second of a
+ *      steady tenant, and tenants that went quiet age out.
+ *
+ *   5. rl_topk_query() copies the monitored tenants out, ordered by
+ *      their guaranteed count (count - error), so that tenants which
+ *      only inherited the count of an evicted one rank last. The report
+ *      never touches the tenant table.
+ *
+ */
+
+#ifndef RATE_LIMITER_TOPK_H
+#define RATE_LIMITER_TOPK_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RL_TOPK_K 64
+#define RL_TOPK_INDEX_BITS 7 /* 2 * RL_TOPK_K index slots */
+#define RL_TOPK_INDEX (1 << RL_TOPK_INDEX_BITS)
+#define RL_TOPK_SAMPLE_BITS 4
+#define RL_TOPK_SAMPLE (1 << RL_TOPK_SAMPLE_BITS)
+#define RL_TOPK_REPORT 10 /* tenants per metric family */
+
+#define RL_TOPK_INITIALIZER { .lock = PTHREAD_MUTEX_INITIALIZER }
+
+typedef struct
+{
+  uint32_t key;
+  uint32_t slot; /* position in index */
+  uint64_t count;
+  uint64_t error; /* over-estimate bound */
+} rl_topk_entry_t;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  unsigned int size;
+  rl_topk_entry_t heap[RL_TOPK_K]; /* min-heap on count */
+  uint16_t index[RL_TOPK_INDEX];   /* heap position + 1, 0 if free */
+} rl_topk_t;
+
+static __thread uint64_t rl_topk_rand;
+
+static inline unsigned int
+rl_topk_home(uint32_t key)
+{
+  return (key * 2654435761u) >> (32 - RL_TOPK_INDEX_BITS);
+}
+
+/* Index slot holding key, or the free slot that ends its probe */
+static unsigned int
+rl_topk_find(const rl_topk_t* t, uint32_t key)
+{
+  unsigned int i = rl_topk_home(key);
+
+  while (t->index[i] && t->heap[t->index[i] - 1].key != key)
+    i = (i + 1) & (RL_TOPK_INDEX - 1);
+
+  return i;
+}
+
+/* Free index slot i, shifting back later entries of the probe run */
+static void
+rl_topk_unindex(rl_topk_t* t, unsigned int i)
+{
+  unsigned int j = i, home;
+
+  for (;;) {
+    t->index[i] = 0;
+    do {
+      j = (j + 1) & (RL_TOPK_INDEX - 1);
+      if (!t->index[j])
+        return;
+      home = rl_topk_home(t->heap[t->index[j] - 1].key);
+      /* stay if home lies cyclically in (i, j] */
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    t->index[i] = t->index[j];
+    t->heap[t->index[i] - 1].slot = i;
+    i = j;
+  }
+}
+
+static void
+rl_topk_swap(rl_topk_t* t, unsigned int a, unsigned int b)
+{
+  rl_topk_entry_t e = t->heap[a];
+
+  t->heap[a] = t->heap[b];
+  t->heap[b] = e;
+  t->index[t->heap[a].slot] = a + 1;
+  t->index[t->heap[b].slot] = b + 1;
+}
+
+static void
+rl_topk_sift_up(rl_topk_t* t, unsigned int i)
+{
+  while (i && t->heap[i].count < t->heap[(i - 1) / 2].count) {
+    rl_topk_swap(t, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void
+rl_topk_sift_down(rl_topk_t* t, unsigned int i)
+{
+  unsigned int min, c;
+
+  for (;;) {
+    min = i;
+    for (c = 2 * i + 1; c <= 2 * i + 2 && c < t->size; c++) {
+      if (t->heap[c].count < t->heap[min].count)
+        min = c;
+    }
+    if (min == i)
+      return;
+    rl_topk_swap(t, i, min);
+    i = min;
+  }
+}
+
+/* Count weight more occurrences of key */
+static void
+rl_topk_add(rl_topk_t* t, uint32_t key, uint64_t weight)
+{
+  unsigned int slot, pos;
+  uint64_t min;
+
+  pthread_mutex_lock(&t->lock);
+  slot = rl_topk_find(t, key);
+  if (t->index[slot]) {
+    pos = t->index[slot] - 1;
+    t->heap[pos].count += weight;
+    rl_topk_sift_down(t, pos);
+  } else if (t->size < RL_TOPK_K) {
+    pos = t->size++;
+    t->heap[pos] = (rl_topk_entry_t){ key, slot, weight, 0 };
+    t->index[slot] = pos + 1;
+    rl_topk_sift_up(t, pos);
+  } else {
+    /* replace the minimum, which keeps its count as error */
+    min = t->heap[0].count;
+    rl_topk_unindex(t, t->heap[0].slot);
+    slot = rl_topk_find(t, key);
+    t->heap[0] = (rl_topk_entry_t){ key, slot, min + weight, min };
+    t->index[slot] = 1;
+    rl_topk_sift_down(t, 0);
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+/* Sampled rl_topk_add(t, key, 1) */
+static inline void
+rl_topk_sample(rl_topk_t* t, uint32_t key)
+{
+  uint64_t r = rl_topk_rand;
+
+  if (0 == r)
+    r = (uintptr_t)&rl_topk_rand | 1; /* distinct seed per thread */
+  r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+  rl_topk_rand = r;
+  if (0 == r >> (64 - RL_TOPK_SAMPLE_BITS))
+    rl_topk_add(t, key, RL_TOPK_SAMPLE);
+}
+
+/* Halve every count; halving keeps the heap order */
+static void
+rl_topk_decay(rl_topk_t* t)
+{
+  pthread_mutex_lock(&t->lock);
+  for (unsigned int i = 0; i < t->size; i++) {
+    t->heap[i].count /= 2;
+    t->heap[i].error /= 2;
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+static int
+rl_topk_cmp(const void* a, const void* b)
+{
+  const rl_topk_entry_t* ea = (const rl_topk_entry_t*)a;
+  const rl_topk_entry_t* eb = (const rl_topk_entry_t*)b;
+  uint64_t ca = ea->count - ea->error, cb = eb->count - eb->error;
+
+  return (ca < cb) - (ca > cb);
+}
+
+/* Copy up to n monitored tenants into out, by guaranteed count */
+static unsigned int
+rl_topk_query(rl_topk_t* t, rl_topk_entry_t* out, unsigned int n)
+{
+  rl_topk_entry_t all[RL_TOPK_K];
+  unsigned int size;
+
+  pthread_mutex_lock(&t->lock);
+  size = t->size;
+  memcpy(all, t->heap, size * sizeof(all[0]));
+  pthread_mutex_unlock(&t->lock);
+
+  qsort(all, size, sizeof(all[0]), rl_topk_cmp);
+  if (n > size)
+    n = size;
+  memcpy(out, all, n * sizeof(all[0]));
+
+  return n;
+}
+
+/*
+ * Write the RL_TOPK_REPORT heaviest tenants as an OpenMetrics gauge of
+ * their guaranteed counts
+ */
+static void
+rl_topk_dump(rl_topk_t* t,
+             FILE* out,
+             const char* name,
+             const char* help,
+             const char* engine)
+{
+  rl_topk_entry_t top[RL_TOPK_REPORT];
+  unsigned int n = rl_topk_query(t, top, RL_TOPK_REPORT);
+
+  fprintf(out, "# TYPE %s gauge\n# HELP %s %s\n", name, name, help);
+  for (unsigned int i = 0; i < n; i++) {
+    fprintf(out,
+            "%s{engine=\"%s\",tenant=\"%u\"} %llu\n",
+            name,
+            engine,
+            top[i].key,
+            (unsigned long long)(top[i].count - top[i].error));
+  }
+}
+
+#endif /* RATE_LIMITER_TOPK_H */
@@ -0,0 +1,991 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-uring.c
+ *
+ * DESCRIPTION:
+ *   io_uring based variant of rl-server. Answers the TCP admit protocol
+ *   of rate-limiter-proto.h with as few system calls per decision as
+ *   possible.
+ *
+ * NOTES:
+ *   1. Uses the raw io_uring system calls (no liburing). One ring per
+ *      core, each with its own SO_REUSEPORT listener, as in rl-server.
+ *
+ *   2. Connections are accepted with one multishot accept and read with
+ *      one multishot recv each, both re-armed only when the kernel ends
+ *      them. Received data lands in a provided buffer ring, is copied
+ *      into the connection's reassembly buffer and the buffer is handed
+ *      straight back.
+ *
+ *   3. Frames may be pipelined freely, as with rl-server. Data that does
+ *      not fit the reassembly buffer yet stays in its provided buffer,
+ *      held on the connection, and the multishot recv is cancelled, so
+ *      the peer is throttled by TCP flow control. Held data is fed in
+ *      as results are written out, and recv is re-armed once it is all
+ *      in.
+ *
+ *   4. Responses are built in a single registered (fixed) buffer arena,
+ *      one slice per connection, and sent with IORING_OP_WRITE_FIXED.
+ *
+ *   5. Every loop iteration reaps all available completions, evaluates
+ *      every complete admit frame through the batch admit, queues one
+ *      write per connection with pending results and submits everything
+ *      with a single io_uring_enter(), which also waits for the next
+ *      completions. Under load one system call covers hundreds of
+ *      decisions. A submission that finds the SQ full is kept on the
+ *      connection (or the loop, for accept) and retried after the next
+ *      io_uring_enter().
+ *
+ *   6. Tenants keep 32-bit relative timestamps, as in rl-server
+ *      (rate-limiter-reltime.h); the clock is read once per batch.
+ *
+ *   7. UDP is served by rl-server only. Compare both with
+ *      `make bench-net`.
+ *
+ *   Usage: rl-uring [-p port] [-t loops]
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rate-limiter-proto.h"
+#include "rate-limiter-reltime.h"
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 65536 /* Active tenants       */
+#define WINDOW_SIZE 10000 /* Miliseconds (10s)    */
+#define WINDOW_UNITS ((int32_t)RL_TS_FROM_MS(WINDOW_SIZE))
+#define MAX_REQ 10        /* 10ms service rate    */
+#define MAX_LOOPS 64
+
+#define RING_ENTRIES 4096
+#define MAX_CONNS 1024 /* Per loop             */
+#define CONN_BUF_SIZE (4 * RL_MAX_FRAME)
+#define RECV_BUFS 1024 /* Provided buffers     */
+#define RECV_BUF_SIZE 16384
+#define RECV_GROUP 0
+
+/* user_data: operation, connection generation, connection index */
+#define OP_ACCEPT 1ULL
+#define OP_RECV 2ULL
+#define OP_WRITE 3ULL
+#define OP_CANCEL 4ULL
+#define NO_BUF 0xffff /* end of a held buffer list */
+#define MAKE_DATA(op, gen, idx)                                              \
+  (((op) << 56) | ((uint64_t)((gen) & 0xffffff) << 32) | (idx))
+#define DATA_OP(d) ((d) >> 56)
+#define DATA_GEN(d) ((unsigned int)(((d) >> 32) & 0xffffff))
+#define DATA_IDX(d) ((unsigned int)((d) & 0xffffffff))
+
+typedef struct
+{
+  pthread_mutex_t qlock;
+  int64_t blocked_until; /* RL_TS units, absolute */
+  unsigned int head;
+  unsigned int size;
+  uint32_t gen; /* epoch generation of slots */
+  rl_ts_t slots[MAX_REQ];
+} tenant_t;
+
+typedef struct
+{
+  int fd; /* -1 when free */
+  unsigned int gen; /* bumped on every accept */
+  int closing;
+  int writing; /* a WRITE_FIXED is in flight */
+  int dirty;   /* on the dirty list, for the end of the batch */
+  int recv_armed; /* a multishot recv is in flight */
+  int paused;     /* recv cancelled until held data is in */
+  int want_recv;  /* found the SQ full, retry */
+  int want_cancel;
+  unsigned short held_head; /* received data not copied in yet */
+  unsigned short held_tail;
+  size_t held_off; /* consumed from the head buffer */
+  size_t in_len;
+  size_t out_off; /* in flight: [out_off, out_sent) */
+  size_t out_sent;
+  size_t out_len;
+  unsigned char* out; /* slice of the registered arena */
+  unsigned char in[CONN_BUF_SIZE];
+} conn_t;
+
+typedef struct
+{
+  int fd;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_mask;
+  unsigned int* sq_array;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int* cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  unsigned int sq_local_tail;
+  unsigned int to_submit;
+  void* ring_ptr;
+  size_t ring_size;
+  size_t sqes_size;
+} uring_t;
+
+typedef struct
+{
+  pthread_t thread;
+  uring_t ring;
+  int listen_fd;
+  struct io_uring_buf_ring* buf_ring;
+  unsigned char* recv_bufs;
+  unsigned short buf_tail;
+  unsigned short held_next[RECV_BUFS]; /* held buffer lists */
+  unsigned int held_len[RECV_BUFS];
+  int want_accept; /* found the SQ full, retry */
+  unsigned char* arena; /* registered send buffers */
+  conn_t* conns;
+  unsigned int* dirty; /* connections with new results or retries */
+  unsigned int ndirty;
+  unsigned long decisions;
+  unsigned long allowed;
+  unsigned long syscalls;
+} loop_t;
+
+_Static_assert(RL_TS_FROM_MS(WINDOW_SIZE) < RL_TS_STEP,
+               "window too long for 32-bit timestamps");
+
+static tenant_t* tenants;
+static rl_tsclock_t ts_clock;
+static volatile sig_atomic_t stop;
+
+/* Rate limiter functionality and helper functions */
+
+int
+check_allowed(tenant_t* t, int64_t timestamp, long* retry_after)
+{
+  int64_t blocked_until = __atomic_load_n(&t->blocked_until, __ATOMIC_RELAXED);
+  uint32_t gen;
+  unsigned int tail;
+  rl_ts_t now;
+  int result;
+
+  if (timestamp < blocked_until) {
+    *retry_after = RL_TS_TO_MS(blocked_until - timestamp);
+    return FAILURE;
+  }
+
+  pthread_mutex_lock(&t->qlock);
+
+  gen = rl_ts_gen(&ts_clock);
+  if (t->gen != gen)
+    rl_ts_rebase(t->slots, MAX_REQ, &t->head, &t->size, &t->gen, gen);
+  now = rl_ts_rel(&ts_clock, t->gen, timestamp);
+
+  while (t->size && (int32_t)(now - t->slots[t->head]) >= WINDOW_UNITS) {
+    t->head = (t->head + 1) % MAX_REQ;
+    t->size--;
+  }
+  if (t->size < MAX_REQ) {
+    tail = (t->head + t->size) % MAX_REQ;
+    t->slots[tail] = now;
+    t->size++;
+    *retry_after = 0;
+    result = SUCCESS;
+  } else {
+    blocked_until =
+      timestamp + (int32_t)(t->slots[t->head] + WINDOW_UNITS - now);
+    __atomic_store_n(&t->blocked_until, blocked_until, __ATOMIC_RELAXED);
+    *retry_after = RL_TS_TO_MS(blocked_until - timestamp);
+    result = FAILURE;
+  }
+
+  pthread_mutex_unlock(&t->qlock);
+
+  return result;
+}
+
+/* Batch admit: one admit frame into one result frame */
+static size_t
+admit_frame(loop_t* l, const unsigned char* in, unsigned char* out, int64_t now)
+{
+  const rl_frame_hdr_t* hdr = (const rl_frame_hdr_t*)in;
+  const rl_admit_req_t* req = (const rl_admit_req_t*)(hdr + 1);
+  rl_admit_resp_t* resp = (rl_admit_resp_t*)((rl_frame_hdr_t*)out + 1);
+  uint32_t count = RL_LE32(hdr->count), tenant_id;
+  long retry_after;
+
+  rl_frame_init((rl_frame_hdr_t*)out, RL_OP_RESULT, count);
+  for (uint32_t i = 0; i < count; i++) {
+    tenant_id = RL_LE32(req[i].tenant_id);
+    resp[i].seq = req[i].seq;
+    if (tenant_id >= MAX_TENANTS) {
+      resp[i].status = RL_LE16(RL_STATUS_ERROR);
+      resp[i].retry_after = 0;
+      continue;
+    }
+    if (SUCCESS == check_allowed(&tenants[tenant_id], now, &retry_after)) {
+      resp[i].status = RL_LE16(RL_STATUS_ALLOWED);
+      l->allowed++;
+    } else {
+      resp[i].status = RL_LE16(RL_STATUS_DENIED);
+    }
+    resp[i].retry_after = RL_LE16(retry_after > 65535 ? 65535 : retry_after);
+  }
+  l->decisions += count;
+
+  return sizeof(rl_frame_hdr_t) + count * sizeof(rl_admit_resp_t);
+}
+
+/* Raw io_uring helpers */
+
+static int
+uring_setup(uring_t* r, unsigned int entries)
+{
+  struct io_uring_params p;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_COOP_TASKRUN;
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) {
+    /* older kernels: retry without the optimization flag */
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+      return FAILURE;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    return FAILURE;
+
+  r->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  if (r->ring_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+    r->ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->ring_ptr = mmap(NULL,
+                     r->ring_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE,
+                     r->fd,
+                     IORING_OFF_SQ_RING);
+  if (MAP_FAILED == r->ring_ptr)
+    return FAILURE;
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL,
+                 r->sqes_size,
+                 PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE,
+                 r->fd,
+                 IORING_OFF_SQES);
+  if (MAP_FAILED == r->sqes)
+    return FAILURE;
+
+  r->sq_head = (unsigned int*)((char*)r->ring_ptr + p.sq_off.head);
+  r->sq_tail = (unsigned int*)((char*)r->ring_ptr + p.sq_off.tail);
+  r->sq_mask = (unsigned int*)((char*)r->ring_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned int*)((char*)r->ring_ptr + p.sq_off.array);
+  r->cq_head = (unsigned int*)((char*)r->ring_ptr + p.cq_off.head);
+  r->cq_tail = (unsigned int*)((char*)r->ring_ptr + p.cq_off.tail);
+  r->cq_mask = (unsigned int*)((char*)r->ring_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)((char*)r->ring_ptr + p.cq_off.cqes);
+  r->sq_local_tail = *r->sq_tail;
+  r->to_submit = 0;
+
+  return SUCCESS;
+}
+
+static int
+uring_enter(loop_t* l, unsigned int wait)
+{
+  uring_t* r = &l->ring;
+  int n;
+
+  atomic_store_explicit((_Atomic unsigned int*)r->sq_tail,
+                        r->sq_local_tail,
+                        memory_order_release);
+  n = syscall(__NR_io_uring_enter,
+              r->fd,
+              r->to_submit,
+              wait,
+              wait ? IORING_ENTER_GETEVENTS : 0,
+              NULL,
+              0);
+  l->syscalls++;
+  if (n < 0)
+    return (EINTR == errno || EAGAIN == errno || EBUSY == errno) ? SUCCESS
+                                                                  : FAILURE;
+  r->to_submit -= n;
+  return SUCCESS;
+}
+
+static struct io_uring_sqe*
+uring_get_sqe(loop_t* l)
+{
+  uring_t* r = &l->ring;
+  unsigned int head, idx;
+
+  head = atomic_load_explicit((_Atomic unsigned int*)r->sq_head,
+                              memory_order_acquire);
+  if (r->sq_local_tail - head > *r->sq_mask) {
+    uring_enter(l, 0);
+    head = atomic_load_explicit((_Atomic unsigned int*)r->sq_head,
+                                memory_order_acquire);
+    if (r->sq_local_tail - head > *r->sq_mask)
+      return NULL;
+  }
+
+  idx = r->sq_local_tail & *r->sq_mask;
+  r->sq_array[idx] = idx;
+  r->sq_local_tail++;
+  r->to_submit++;
+  memset(&r->sqes[idx], 0, sizeof(struct io_uring_sqe));
+  return &r->sqes[idx];
+}
+
+/* The queue_* helpers return FAILURE when the SQ is full */
+
+static int
+queue_accept(loop_t* l)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(l);
+
+  if (NULL == sqe)
+    return FAILURE;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = l->listen_fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = MAKE_DATA(OP_ACCEPT, 0, 0);
+  return SUCCESS;
+}
+
+static int
+queue_recv(loop_t* l, unsigned int idx)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(l);
+
+  if (NULL == sqe)
+    return FAILURE;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = l->conns[idx].fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_GROUP;
+  sqe->user_data = MAKE_DATA(OP_RECV, l->conns[idx].gen, idx);
+  l->conns[idx].recv_armed = 1;
+  return SUCCESS;
+}
+
+/* Stop the multishot recv of a connection */
+static int
+queue_cancel(loop_t* l, unsigned int idx)
+{
+  struct io_uring_sqe* sqe = uring_get_sqe(l);
+
+  if (NULL == sqe)
+    return FAILURE;
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = MAKE_DATA(OP_RECV, l->conns[idx].gen, idx);
+  sqe->user_data = MAKE_DATA(OP_CANCEL, l->conns[idx].gen, idx);
+  return SUCCESS;
+}
+
+static int
+queue_write(loop_t* l, unsigned int idx)
+{
+  conn_t* c = &l->conns[idx];
+  struct io_uring_sqe* sqe = uring_get_sqe(l);
+
+  if (NULL == sqe)
+    return FAILURE;
+  c->out_sent = c->out_len;
+  c->writing = 1;
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->fd = c->fd;
+  sqe->addr = (unsigned long)(c->out + c->out_off);
+  sqe->len = c->out_sent - c->out_off;
+  sqe->off = (unsigned long)-1; /* sockets have no file position */
+  sqe->buf_index = 0;
+  sqe->user_data = MAKE_DATA(OP_WRITE, c->gen, idx);
+  return SUCCESS;
+}
+
+/* Hand a provided buffer back to the kernel */
+static void
+recycle_buffer(loop_t* l, unsigned short bid)
+{
+  struct io_uring_buf* buf =
+    &l->buf_ring->bufs[l->buf_tail & (RECV_BUFS - 1)];
+
+  buf->addr = (unsigned long)(l->recv_bufs + (size_t)bid * RECV_BUF_SIZE);
+  buf->len = RECV_BUF_SIZE;
+  buf->bid = bid;
+  l->buf_tail++;
+}
+
+static void
+publish_buffers(loop_t* l)
+{
+  atomic_store_explicit((_Atomic unsigned short*)&l->buf_ring->tail,
+                        l->buf_tail,
+                        memory_order_release);
+}
+
+/* Connections */
+
+static void
+mark_dirty(loop_t* l, unsigned int idx)
+{
+  if (!l->conns[idx].dirty) {
+    l->conns[idx].dirty = 1;
+    l->dirty[l->ndirty++] = idx;
+  }
+}
+
+static void
+conn_arm_recv(loop_t* l, unsigned int idx)
+{
+  conn_t* c = &l->conns[idx];
+
+  if (c->recv_armed || c->want_recv)
+    return;
+  if (SUCCESS != queue_recv(l, idx)) {
+    c->want_recv = 1;
+    mark_dirty(l, idx);
+  }
+}
+
+static void
+conn_pause(loop_t* l, unsigned int idx)
+{
+  conn_t* c = &l->conns[idx];
+
+  c->paused = 1;
+  if (SUCCESS != queue_cancel(l, idx)) {
+    c->want_cancel = 1;
+    mark_dirty(l, idx);
+  }
+}
+
+/* Keep a received buffer on the connection until it is copied in */
+static void
+hold_buffer(loop_t* l, conn_t* c, unsigned short bid, unsigned int len)
+{
+  l->held_len[bid] = len;
+  l->held_next[bid] = NO_BUF;
+  if (NO_BUF == c->held_head)
+    c->held_head = bid;
+  else
+    l->held_next[c->held_tail] = bid;
+  c->held_tail = bid;
+}
+
+static void
+release_held(loop_t* l, conn_t* c)
+{
+  unsigned short bid;
+
+  while (NO_BUF != (bid = c->held_head)) {
+    c->held_head = l->held_next[bid];
+    recycle_buffer(l, bid);
+  }
+  c->held_off = 0;
+}
+
+static void
+conn_release(loop_t* l, unsigned int idx)
+{
+  conn_t* c = &l->conns[idx];
+
+  if (c->fd < 0 || c->writing)
+    return;
+  release_held(l, c);
+  /* also ends a multishot recv that is still armed */
+  shutdown(c->fd, SHUT_RDWR);
+  close(c->fd);
+  c->fd = -1;
+}
+
+/* Parse complete frames while their results fit in the send slice */
+static int
+conn_process(loop_t* l, unsigned int idx, int64_t now)
+{
+  conn_t* c = &l->conns[idx];
+  size_t off = 0, len, produced = 0;
+
+  /* results can only be appended behind the data in flight */
+  if (!c->writing && c->out_off == c->out_len)
+    c->out_off = c->out_len = 0;
+
+  while (c->in_len - off >= sizeof(rl_frame_hdr_t)) {
+    len = rl_frame_len((rl_frame_hdr_t*)(c->in + off), RL_OP_ADMIT);
+    if (0 == len)
+      return FAILURE;
+    if (c->in_len - off < len || CONN_BUF_SIZE - c->out_len < len)
+      break;
+    c->out_len += admit_frame(l, c->in + off, c->out + c->out_len, now);
+    off += len;
+    produced = 1;
+  }
+
+  if (off) {
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+  }
+  if (produced && !c->writing)
+    mark_dirty(l, idx);
+
+  return SUCCESS;
+}
+
+/*
+ * Feed held data into the reassembly buffer and evaluate it, for as
+ * long as results fit in the send slice. Resumes reading once nothing
+ * is held and the cancelled recv has ended.
+ */
+static int
+conn_drain(loop_t* l, unsigned int idx, int64_t now)
+{
+  conn_t* c = &l->conns[idx];
+  unsigned short bid;
+  size_t n;
+
+  for (;;) {
+    if (SUCCESS != conn_process(l, idx, now))
+      return FAILURE;
+    if (NO_BUF == c->held_head || CONN_BUF_SIZE == c->in_len)
+      break;
+    bid = c->held_head;
+    n = l->held_len[bid] - c->held_off;
+    if (n > CONN_BUF_SIZE - c->in_len)
+      n = CONN_BUF_SIZE - c->in_len;
+    memcpy(c->in + c->in_len,
+           l->recv_bufs + (size_t)bid * RECV_BUF_SIZE + c->held_off,
+           n);
+    c->in_len += n;
+    c->held_off += n;
+    if (c->held_off == l->held_len[bid]) {
+      c->held_head = l->held_next[bid];
+      c->held_off = 0;
+      recycle_buffer(l, bid);
+    }
+  }
+
+  if (c->paused && NO_BUF == c->held_head && !c->recv_armed) {
+    c->paused = 0;
+    conn_arm_recv(l, idx);
+  }
+
+  return SUCCESS;
+}
+
+static void
+handle_accept(loop_t* l, struct io_uring_cqe* cqe)
+{
+  unsigned int idx;
+  int one = 1;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE) && SUCCESS != queue_accept(l))
+    l->want_accept = 1;
+  if (cqe->res < 0)
+    return;
+
+  for (idx = 0; idx < MAX_CONNS && l->conns[idx].fd >= 0; idx++)
+    ;
+  if (MAX_CONNS == idx) {
+    close(cqe->res);
+    return;
+  }
+
+  setsockopt(cqe->res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  l->conns[idx].fd = cqe->res;
+  l->conns[idx].gen++;
+  l->conns[idx].closing = 0;
+  l->conns[idx].writing = 0;
+  l->conns[idx].recv_armed = l->conns[idx].paused = 0;
+  l->conns[idx].want_recv = l->conns[idx].want_cancel = 0;
+  l->conns[idx].held_head = NO_BUF;
+  l->conns[idx].held_off = 0;
+  l->conns[idx].in_len = 0;
+  l->conns[idx].out_off = l->conns[idx].out_sent = l->conns[idx].out_len = 0;
+  conn_arm_recv(l, idx);
+}
+
+static void
+handle_recv(loop_t* l, struct io_uring_cqe* cqe, unsigned int idx, int64_t now)
+{
+  conn_t* c = &l->conns[idx];
+  int stale = (c->fd < 0 || DATA_GEN(cqe->user_data) != c->gen);
+  unsigned short bid;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !stale && !c->closing) {
+      hold_buffer(l, c, bid, cqe->res);
+      if (SUCCESS != conn_drain(l, idx, now))
+        c->closing = 1;
+      else if (NO_BUF != c->held_head && !c->paused)
+        conn_pause(l, idx); /* backpressure: stop reading for now */
+    } else {
+      recycle_buffer(l, bid);
+    }
+  }
+  if (stale)
+    return;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    c->recv_armed = 0;
+    if (c->closing || !(cqe->res > 0 || -ENOBUFS == cqe->res ||
+                        -ECANCELED == cqe->res)) {
+      c->closing = 1;
+    } else if (!c->paused) {
+      conn_arm_recv(l, idx);
+    } else if (NO_BUF == c->held_head) {
+      c->paused = 0;
+      conn_arm_recv(l, idx);
+    }
+  }
+  if (c->closing)
+    conn_release(l, idx);
+}
+
+static void
+handle_write(loop_t* l, struct io_uring_cqe* cqe, unsigned int idx, int64_t now)
+{
+  conn_t* c = &l->conns[idx];
+
+  if (c->fd < 0 || DATA_GEN(cqe->user_data) != c->gen)
+    return;
+  c->writing = 0;
+  if (cqe->res <= 0)
+    c->closing = 1;
+  if (c->closing) {
+    conn_release(l, idx);
+    return;
+  }
+
+  c->out_off += cqe->res;
+  if (c->out_off < c->out_len) {
+    if (SUCCESS != queue_write(l, idx))
+      mark_dirty(l, idx);
+  } else {
+    /* the slice is free again, results held back can go out now */
+    c->out_off = c->out_len = 0;
+    if (SUCCESS != conn_drain(l, idx, now)) {
+      c->closing = 1;
+      conn_release(l, idx);
+    }
+  }
+}
+
+void*
+event_loop(void* arg)
+{
+  loop_t* l = (loop_t*)arg;
+  uring_t* r = &l->ring;
+  struct io_uring_cqe* cqe;
+  unsigned int head, tail, idx, ndirty;
+  int64_t now;
+  conn_t* c;
+
+  if (SUCCESS != queue_accept(l))
+    l->want_accept = 1;
+
+  while (!stop) {
+    /* retries pending: only reap, they need the SQ space back */
+    if (SUCCESS != uring_enter(l, !(l->ndirty || l->want_accept))) {
+      perror("rl-uring: io_uring_enter");
+      break;
+    }
+
+    now = rl_ts_now(&ts_clock);
+    head = *r->cq_head;
+    tail = atomic_load_explicit((_Atomic unsigned int*)r->cq_tail,
+                                memory_order_acquire);
+    for (; head != tail; head++) {
+      cqe = &r->cqes[head & *r->cq_mask];
+      idx = DATA_IDX(cqe->user_data);
+      switch (DATA_OP(cqe->user_data)) {
+        case OP_ACCEPT:
+          handle_accept(l, cqe);
+          break;
+        case OP_RECV:
+          handle_recv(l, cqe, idx, now);
+          break;
+        case OP_WRITE:
+          handle_write(l, cqe, idx, now);
+          break;
+        case OP_CANCEL:
+          break;
+      }
+    }
+    atomic_store_explicit((_Atomic unsigned int*)r->cq_head,
+                          head,
+                          memory_order_release);
+    publish_buffers(l);
+
+    /*
+     * One write per connection with new results, and the submissions
+     * that found the SQ full, all in one submit. What still does not
+     * fit stays on the list for the next round.
+     */
+    if (l->want_accept && SUCCESS == queue_accept(l))
+      l->want_accept = 0;
+    ndirty = l->ndirty;
+    l->ndirty = 0;
+    for (unsigned int i = 0; i < ndirty; i++) {
+      idx = l->dirty[i];
+      c = &l->conns[idx];
+      c->dirty = 0;
+      if (c->fd < 0 || c->closing)
+        continue;
+      if (c->want_cancel && SUCCESS == queue_cancel(l, idx))
+        c->want_cancel = 0;
+      if (c->want_recv && SUCCESS == queue_recv(l, idx))
+        c->want_recv = 0;
+      if (!c->writing && c->out_len > c->out_off)
+        queue_write(l, idx);
+      if (c->want_cancel || c->want_recv ||
+          (!c->writing && c->out_len > c->out_off))
+        mark_dirty(l, idx);
+    }
+  }
+
+  return NULL;
+}
+
+/* Setup */
+
+static int
+open_listener(int port)
+{
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    goto fail;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0)
+    goto fail;
+
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+static int
+initialize_loop(loop_t* l, int port)
+{
+  struct io_uring_buf_reg reg;
+  struct iovec iov;
+
+  memset(l, 0, sizeof(loop_t));
+  l->listen_fd = open_listener(port);
+  if (l->listen_fd < 0 || SUCCESS != uring_setup(&l->ring, RING_ENTRIES))
+    return FAILURE;
+
+  /* provided receive buffers */
+  l->buf_ring = mmap(NULL,
+                     RECV_BUFS * sizeof(struct io_uring_buf),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+  l->recv_bufs = malloc((size_t)RECV_BUFS * RECV_BUF_SIZE);
+  if (MAP_FAILED == l->buf_ring || NULL == l->recv_bufs)
+    return FAILURE;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)l->buf_ring;
+  reg.ring_entries = RECV_BUFS;
+  reg.bgid = RECV_GROUP;
+  if (syscall(__NR_io_uring_register,
+              l->ring.fd,
+              IORING_REGISTER_PBUF_RING,
+              &reg,
+              1) < 0)
+    return FAILURE;
+  for (unsigned short bid = 0; bid < RECV_BUFS; bid++)
+    recycle_buffer(l, bid);
+  publish_buffers(l);
+
+  /* registered send arena, one slice per connection */
+  l->arena = mmap(NULL,
+                  (size_t)MAX_CONNS * CONN_BUF_SIZE,
+                  PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS,
+                  -1,
+                  0);
+  if (MAP_FAILED == l->arena)
+    return FAILURE;
+  iov.iov_base = l->arena;
+  iov.iov_len = (size_t)MAX_CONNS * CONN_BUF_SIZE;
+  if (syscall(__NR_io_uring_register,
+              l->ring.fd,
+              IORING_REGISTER_BUFFERS,
+              &iov,
+              1) < 0)
+    return FAILURE;
+
+  l->conns = (conn_t*)malloc(MAX_CONNS * sizeof(conn_t));
+  l->dirty = (unsigned int*)malloc(MAX_CONNS * sizeof(unsigned int));
+  if (NULL == l->conns || NULL == l->dirty)
+    return FAILURE;
+  for (unsigned int i = 0; i < MAX_CONNS; i++) {
+    l->conns[i].fd = -1;
+    l->conns[i].gen = 0;
+    l->conns[i].dirty = 0;
+    l->conns[i].out = l->arena + (size_t)i * CONN_BUF_SIZE;
+  }
+
+  return SUCCESS;
+}
+
+static void
+destroy_loop(loop_t* l)
+{
+  for (unsigned int i = 0; i < MAX_CONNS; i++) {
+    if (l->conns[i].fd >= 0)
+      close(l->conns[i].fd);
+  }
+  close(l->ring.fd);
+  close(l->listen_fd);
+  munmap(l->ring.ring_ptr, l->ring.ring_size);
+  munmap(l->ring.sqes, l->ring.sqes_size);
+  munmap(l->buf_ring, RECV_BUFS * sizeof(struct io_uring_buf));
+  munmap(l->arena, (size_t)MAX_CONNS * CONN_BUF_SIZE);
+  free(l->recv_bufs);
+  free(l->conns);
+  free(l->dirty);
+}
+
+static void
+handle_signal(int sig)
+{
+  (void)sig;
+  stop = 1;
+}
+
+int
+main(int argc, char** argv)
+{
+  static loop_t loops[MAX_LOOPS];
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int port = RL_PROTO_PORT, nloops = (ncpus < 1) ? 1 : ncpus, opt;
+  unsigned long decisions = 0, allowed = 0, syscalls = 0;
+  struct sigaction sa;
+  sigset_t mask, old;
+
+  while (-1 != (opt = getopt(argc, argv, "p:t:"))) {
+    switch (opt) {
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 't':
+        nloops = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-p port] [-t loops]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (nloops < 1)
+    nloops = 1;
+  if (nloops > MAX_LOOPS)
+    nloops = MAX_LOOPS;
+
+  tenants = (tenant_t*)calloc(MAX_TENANTS, sizeof(tenant_t));
+  if (NULL == tenants) {
+    fprintf(stderr, "failed to allocate tenant table\n");
+    return 1;
+  }
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_init(&tenants[i].qlock, NULL);
+  rl_ts_init(&ts_clock);
+
+  /*
+   * SIGINT / SIGTERM are handled by the main thread, which then wakes
+   * the loops from io_uring_enter() with SIGUSR1 (no SA_RESTART).
+   */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGUSR1, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+  for (int i = 0; i < nloops; i++) {
+    if (SUCCESS != initialize_loop(&loops[i], port)) {
+      perror("rl-uring");
+      return 1;
+    }
+  }
+  for (int i = 0; i < nloops; i++)
+    pthread_create(&loops[i].thread, NULL, event_loop, &loops[i]);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  printf("rl-uring: listening on port %d (tcp), %d loops\n", port, nloops);
+  fflush(stdout);
+
+  while (!stop)
+    pause();
+
+  for (int i = 0; i < nloops; i++) {
+    struct timespec ts;
+    do {
+      /* a wakeup may race with the loop entering the kernel, repeat */
+      pthread_kill(loops[i].thread, SIGUSR1);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 100000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+    } while (ETIMEDOUT == pthread_timedjoin_np(loops[i].thread, NULL, &ts));
+    decisions += loops[i].decisions;
+    allowed += loops[i].allowed;
+    syscalls += loops[i].syscalls;
+    destroy_loop(&loops[i]);
+  }
+
+  printf("rl-uring: %lu decisions, %lu allowed, %.1f decisions/syscall\n",
+         decisions,
+         allowed,
+         syscalls ? (double)decisions / syscalls : 0.0);
+
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_destroy(&tenants[i].qlock);
+  free(tenants);
+
+  return 0;
+}
@@ -0,0 +1,495 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-wait.c
+ *
+ * DESCRIPTION:
+ *   Sample MT-Safe sliding window rate limiter with a wait mode: a
+ *   request over the limit is given the earliest time it may go and is
+ *   delayed until then, instead of denied. Meant for background jobs,
+ *   whose traffic should be smoothed rather than rejected.
+ *
+ * NOTES:
+ *   1. Each tenant keeps a ring of its last MAX_REQ admission times, as
+ *      in rl-server, but a request that finds the ring full reserves
+ *      the time the oldest entry leaves the window: the oldest entry is
+ *      replaced by that (future) time. The ring stays sorted, any
+ *      WINDOW_SIZE holds at most MAX_REQ entries, and the earliest
+ *      admissible time is found in O(1). check_tenant_wait() makes the
+ *      reservation and returns the time; callers that keep their own
+ *      timers need nothing more.
+ *
+ *   2. The wait queue of a tenant is bounded by time: a request that
+ *      would have to wait more than MAX_WAIT ms is denied and reserves
+ *      nothing, so no tenant queues more than about
+ *      MAX_REQ * MAX_WAIT / WINDOW_SIZE requests. Parked requests are
+ *      also bounded globally, by MAX_PENDING.
+ *
+ *   3. submit_wait() parks a request, given as a caller allocated
+ *      waiter_t, on the FIFO of its tenant and has its callback run by
+ *      the scheduler thread at the reserved time. A request that may go
+ *      at once, with nothing parked ahead of it, runs its callback
+ *      directly. wait_allowed() parks the calling thread instead.
+ *
+ *   4. The scheduler thread keeps a hashed timing wheel of WHEEL_SLOTS
+ *      one millisecond slots. The wheel holds tenants, not requests: a
+ *      tenant is on it once, at the reserved time of the head of its
+ *      FIFO, and is put back for the next head after its due requests
+ *      are released. Waiters are linked through themselves, so the
+ *      scheduler allocates nothing and its work per tick is the number
+ *      of tenants due; millions of parked requests cost only their
+ *      waiter_t.
+ *
+ *   5. A tenant that gets its first parked request is handed to the
+ *      scheduler through a lock-free inbox (a Treiber stack), which is
+ *      drained every tick; the wheel itself is touched by the scheduler
+ *      thread only. Callbacks run on the scheduler thread and must not
+ *      block.
+ *
+ *   6. Callbacks see w->status SUCCESS when their request is released.
+ *      Requests still parked when the limiter is destroyed have their
+ *      callbacks run with FAILURE, so wait_allowed() callers return.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SUCCESS 0
+#define FAILURE 1
+
+#define MAX_TENANTS 65536    /* Active tenants       */
+#define WINDOW_SIZE 1000     /* Miliseconds (1s)     */
+#define MAX_REQ 10           /* Per tenant limit     */
+#define MAX_WAIT 2000        /* Miliseconds          */
+#define MAX_PENDING (1 << 22) /* Parked requests      */
+#define WHEEL_SLOTS 4096     /* One per milisecond   */
+
+#define TEST_BURST 32 /* Requests per tenant  */
+
+_Static_assert(0 == (WHEEL_SLOTS & (WHEEL_SLOTS - 1)),
+               "WHEEL_SLOTS must be a power of two");
+_Static_assert(MAX_WAIT < WHEEL_SLOTS, "waits must fit on the wheel");
+
+typedef struct waiter
+{
+  struct waiter* next;
+  long admit_at; /* Reserved time (ms)   */
+  int status;    /* Set before fn runs  */
+  void (*fn)(struct waiter* w);
+  void* arg;
+} waiter_t;
+
+typedef struct tenant
+{
+  pthread_mutex_t qlock;
+  unsigned int head;
+  unsigned int size;
+  long slots[MAX_REQ]; /* admissions and reservations, ascending */
+  waiter_t* first;     /* parked requests, FIFO */
+  waiter_t* last;
+  int scheduled;       /* in the inbox or on the wheel */
+  struct tenant* next; /* inbox or wheel slot link */
+} tenant_t;
+
+typedef struct
+{
+  tenant_t* tenants;
+  _Atomic(tenant_t*) inbox;
+  atomic_long pending;
+  atomic_int stop;
+  pthread_t thread;
+  /* scheduler thread only */
+  long tick;
+  tenant_t* wheel[WHEEL_SLOTS];
+} wait_limiter_t;
+
+/* Rate limiter functionality and helper functions */
+
+long
+get_current_time_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
+}
+
+/*
+ * Admit now, or reserve the earliest admissible time. Called with the
+ * tenant's qlock held.
+ */
+static int
+reserve(tenant_t* t, long now, long* admit_at)
+{
+  while (t->size && (now - t->slots[t->head] >= WINDOW_SIZE)) {
+    t->head = (t->head + 1) % MAX_REQ;
+    t->size--;
+  }
+  if (t->size < MAX_REQ) {
+    t->slots[(t->head + t->size) % MAX_REQ] = now;
+    t->size++;
+    *admit_at = now;
+    return SUCCESS;
+  }
+
+  *admit_at = t->slots[t->head] + WINDOW_SIZE;
+  if (*admit_at - now > MAX_WAIT)
+    return FAILURE;
+  /* full ring: the tail is the head, replace the oldest entry */
+  t->slots[t->head] = *admit_at;
+  t->head = (t->head + 1) % MAX_REQ;
+
+  return SUCCESS;
+}
+
+/*
+ * Reserve an admission for tenant_id and return its time in admit_at,
+ * now if the request may go at once. FAILURE if it would have to wait
+ * more than MAX_WAIT ms; admit_at is then the time it would have got.
+ */
+int
+check_tenant_wait(wait_limiter_t* rl, int tenant_id, long now, long* admit_at)
+{
+  tenant_t* t = &rl->tenants[tenant_id];
+  int result;
+
+  pthread_mutex_lock(&t->qlock);
+  result = reserve(t, now, admit_at);
+  pthread_mutex_unlock(&t->qlock);
+
+  return result;
+}
+
+/*
+ * Park w until its tenant may go, then run w->fn(w) on the scheduler
+ * thread, or at once on this one. FAILURE if the wait would be longer
+ * than MAX_WAIT or MAX_PENDING requests are parked already; w->fn is
+ * not run.
+ */
+int
+submit_wait(wait_limiter_t* rl, int tenant_id, waiter_t* w, long now)
+{
+  tenant_t* t = &rl->tenants[tenant_id];
+  tenant_t* top;
+
+  if (atomic_fetch_add(&rl->pending, 1) >= MAX_PENDING) {
+    atomic_fetch_sub(&rl->pending, 1);
+    return FAILURE;
+  }
+
+  pthread_mutex_lock(&t->qlock);
+  if (SUCCESS != reserve(t, now, &w->admit_at)) {
+    pthread_mutex_unlock(&t->qlock);
+    atomic_fetch_sub(&rl->pending, 1);
+    return FAILURE;
+  }
+  if (w->admit_at <= now && NULL == t->first) {
+    pthread_mutex_unlock(&t->qlock);
+    atomic_fetch_sub(&rl->pending, 1);
+    w->status = SUCCESS;
+    w->fn(w);
+    return SUCCESS;
+  }
+
+  w->next = NULL;
+  if (NULL == t->first)
+    t->first = w;
+  else
+    t->last->next = w;
+  t->last = w;
+
+  if (!t->scheduled) {
+    t->scheduled = 1;
+    top = atomic_load(&rl->inbox);
+    do {
+      t->next = top;
+    } while (!atomic_compare_exchange_weak(&rl->inbox, &top, t));
+  }
+  pthread_mutex_unlock(&t->qlock);
+
+  return SUCCESS;
+}
+
+static void
+wake_waiter(waiter_t* w)
+{
+  sem_post((sem_t*)w->arg);
+}
+
+/*
+ * Block the calling thread until tenant_id may go. FAILURE, at once,
+ * if the wait would be longer than MAX_WAIT, or once the limiter is
+ * destroyed.
+ */
+int
+wait_allowed(wait_limiter_t* rl, int tenant_id)
+{
+  waiter_t w = { .fn = wake_waiter };
+  sem_t sem;
+  int result;
+
+  sem_init(&sem, 0, 0);
+  w.arg = &sem;
+  result = submit_wait(rl, tenant_id, &w, get_current_time_ms());
+  if (SUCCESS == result) {
+    while (0 != sem_wait(&sem))
+      ;
+    result = w.status;
+  }
+  sem_destroy(&sem);
+
+  return result;
+}
+
+/* Timing wheel, scheduler thread only */
+
+static void
+wheel_insert(wait_limiter_t* rl, tenant_t* t, long when)
+{
+  tenant_t** slot;
+
+  if (when < rl->tick)
+    when = rl->tick;
+  slot = &rl->wheel[when & (WHEEL_SLOTS - 1)];
+  t->next = *slot;
+  *slot = t;
+}
+
+/* Release the requests due at tick, in FIFO order per tenant */
+static void
+wheel_run(wait_limiter_t* rl, long tick)
+{
+  tenant_t** slot = &rl->wheel[tick & (WHEEL_SLOTS - 1)];
+  tenant_t *t = *slot, *next;
+  waiter_t *fire = NULL, **fire_tail = &fire, *w;
+
+  *slot = NULL;
+  for (; NULL != t; t = next) {
+    next = t->next;
+    pthread_mutex_lock(&t->qlock);
+    while (t->first && t->first->admit_at <= tick) {
+      *fire_tail = t->first;
+      fire_tail = &t->first->next;
+      t->first = t->first->next;
+    }
+    /* not due yet (a later turn of the wheel), or the next head */
+    if (t->first)
+      wheel_insert(rl, t, t->first->admit_at);
+    else
+      t->scheduled = 0;
+    pthread_mutex_unlock(&t->qlock);
+  }
+  *fire_tail = NULL;
+
+  for (; NULL != fire; fire = w) {
+    w = fire->next; /* fn may reuse the waiter */
+    atomic_fetch_sub(&rl->pending, 1);
+    fire->status = SUCCESS;
+    fire->fn(fire);
+  }
+}
+
+static void*
+scheduler_thread(void* arg)
+{
+  wait_limiter_t* rl = (wait_limiter_t*)arg;
+  tenant_t *t, *next;
+  long now;
+
+  rl->tick = get_current_time_ms();
+  while (!atomic_load(&rl->stop)) {
+    now = get_current_time_ms();
+
+    t = atomic_exchange(&rl->inbox, NULL);
+    for (; NULL != t; t = next) {
+      next = t->next;
+      pthread_mutex_lock(&t->qlock);
+      wheel_insert(rl, t, t->first->admit_at);
+      pthread_mutex_unlock(&t->qlock);
+    }
+
+    for (; rl->tick <= now; rl->tick++)
+      wheel_run(rl, rl->tick);
+
+    usleep(1000);
+  }
+
+  return NULL;
+}
+
+unsigned int
+initialize_limiter(wait_limiter_t** rl)
+{
+  *rl = (wait_limiter_t*)calloc(1, sizeof(wait_limiter_t));
+  if (NULL == *rl)
+    return FAILURE;
+
+  (*rl)->tenants = (tenant_t*)calloc(MAX_TENANTS, sizeof(tenant_t));
+  if (NULL == (*rl)->tenants) {
+    free(*rl);
+    return FAILURE;
+  }
+  for (int i = 0; i < MAX_TENANTS; i++)
+    pthread_mutex_init(&(*rl)->tenants[i].qlock, NULL);
+
+  if (0 != pthread_create(&(*rl)->thread, NULL, scheduler_thread, *rl)) {
+    free((*rl)->tenants);
+    free(*rl);
+    return FAILURE;
+  }
+
+  return SUCCESS;
+}
+
+/*
+ * Requests still parked, on the wheel or in the inbox, have their
+ * callbacks run with status FAILURE
+ */
+void
+destroy_limiter(wait_limiter_t* rl)
+{
+  waiter_t *w, *next;
+
+  if (NULL == rl)
+    return;
+
+  atomic_store(&rl->stop, 1);
+  pthread_join(rl->thread, NULL);
+  for (int i = 0; i < MAX_TENANTS; i++) {
+    /* every parked request is on its tenant's FIFO, wherever it is */
+    for (w = rl->tenants[i].first; NULL != w; w = next) {
+      next = w->next; /* fn may reuse the waiter */
+      atomic_fetch_sub(&rl->pending, 1);
+      w->status = FAILURE;
+      w->fn(w);
+    }
+    rl->tenants[i].first = rl->tenants[i].last = NULL;
+    pthread_mutex_destroy(&rl->tenants[i].qlock);
+  }
+  free(rl->tenants);
+  free(rl);
+}
+
+/* Sample usage */
+
+typedef struct
+{
+  waiter_t* waiters; /* TEST_BURST per tenant */
+  int* expected;     /* next request to be released, per tenant */
+  atomic_ulong released;
+  atomic_ulong out_of_order;
+  atomic_ulong over_limit;
+  atomic_ulong early;
+  atomic_long late_sum;
+  atomic_long late_max;
+} test_t;
+
+static test_t test;
+
+static void
+test_release(waiter_t* w)
+{
+  long seq = w - test.waiters, late = get_current_time_ms() - w->admit_at;
+  int tenant_id = seq / TEST_BURST, i = seq % TEST_BURST;
+  long max = atomic_load(&test.late_max);
+
+  if (test.expected[tenant_id]++ != i)
+    atomic_fetch_add(&test.out_of_order, 1);
+  if (i >= MAX_REQ &&
+      w->admit_at - test.waiters[seq - MAX_REQ].admit_at < WINDOW_SIZE)
+    atomic_fetch_add(&test.over_limit, 1);
+  if (late < 0)
+    atomic_fetch_add(&test.early, 1);
+
+  atomic_fetch_add(&test.released, 1);
+  atomic_fetch_add(&test.late_sum, late);
+  while (late > max && !atomic_compare_exchange_weak(&test.late_max, &max, late))
+    ;
+}
+
+int
+main(void)
+{
+  /* Sample usage.
+   * - every tenant but the last submits TEST_BURST requests at once:
+   *   MAX_REQ go now, the rest are parked for up to MAX_WAIT ms and
+   *   the last few are denied
+   * - the scheduler releases them; order, limit and lateness are
+   *   checked
+   * - one thread then blocks in wait_allowed() on the last tenant
+   */
+
+  wait_limiter_t* rl = NULL;
+  int ntenants = MAX_TENANTS - 1, blocking = MAX_REQ + MAX_REQ / 2;
+  unsigned long submitted = 0, denied = 0;
+  long start_ms, now, peak = 0;
+
+  test.waiters = (waiter_t*)calloc((size_t)ntenants * TEST_BURST,
+                                   sizeof(waiter_t));
+  test.expected = (int*)calloc(ntenants, sizeof(int));
+  if (NULL == test.waiters || NULL == test.expected ||
+      SUCCESS != initialize_limiter(&rl)) {
+    fprintf(stderr, "failed to allocate limiter\n");
+    return 1;
+  }
+
+  start_ms = get_current_time_ms();
+  for (int i = 0; i < TEST_BURST; i++) {
+    now = get_current_time_ms();
+    for (int tenant_id = 0; tenant_id < ntenants; tenant_id++) {
+      waiter_t* w = &test.waiters[tenant_id * TEST_BURST + i];
+
+      w->fn = test_release;
+      submitted++;
+      if (SUCCESS != submit_wait(rl, tenant_id, w, now))
+        denied++;
+    }
+  }
+  peak = atomic_load(&rl->pending);
+  printf("tenants: %d, submitted: %lu in %ld ms, denied: %lu, "
+         "parked: %ld\n",
+         ntenants,
+         submitted,
+         get_current_time_ms() - start_ms,
+         denied,
+         peak);
+
+  while (atomic_load(&test.released) < submitted - denied)
+    usleep(10000);
+
+  printf("released: %lu in %ld ms, out of order: %lu, over limit: %lu, "
+         "early: %lu\n",
+         atomic_load(&test.released),
+         get_current_time_ms() - start_ms,
+         atomic_load(&test.out_of_order),
+         atomic_load(&test.over_limit),
+         atomic_load(&test.early));
+  printf("lateness: avg %.3f ms, max %ld ms\n",
+         (double)atomic_load(&test.late_sum) / atomic_load(&test.released),
+         atomic_load(&test.late_max));
+
+  start_ms = get_current_time_ms();
+  for (int i = 0; i < blocking; i++) {
+    if (SUCCESS != wait_allowed(rl, ntenants)) {
+      printf("wait_allowed: denied\n");
+      break;
+    }
+  }
+  printf("wait_allowed: %d requests (limit %d / %d ms) in %ld ms\n",
+         blocking,
+         MAX_REQ,
+         WINDOW_SIZE,
+         get_current_time_ms() - start_ms);
+
+  destroy_limiter(rl);
+  free(test.waiters);
+  free(test.expected);
+
+  return 0;
+}
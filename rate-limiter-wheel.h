@@ -0,0 +1,181 @@
+/***********************************************************************
+ * FILENAME: rate-limiter-wheel.h
+ *
+ * DESCRIPTION:
+ *   Hierarchical hashed timing wheel, for per tenant maintenance timers
+ *   (window expiry, idle reclamation) in O(1) per event.
+ *
+ * NOTES:
+ *   1. RL_WHEEL_LEVELS levels of RL_WHEEL_SIZE slots. Level 0 has one
+ *      slot per tick, each level above slots RL_WHEEL_SIZE times
+ *      coarser, so 4 levels of 64 cover 2^24 ticks (4.6 hours of
+ *      miliseconds). Timers further out are parked on the top level and
+ *      re-filed until due.
+ *
+ *   2. Timers are intrusive and doubly linked through a back pointer,
+ *      so adding and deleting a timer are O(1) and the wheel never
+ *      allocates. A timer is filed by how far it is from now, in the
+ *      slot of its own expiry at that level.
+ *
+ *   3. rl_wheel_advance() processes every tick up to now. A tick costs a
+ *      slot lookup plus its due timers; every RL_WHEEL_SIZE ticks a slot
+ *      of the next level is cascaded one level down, so a timer moves
+ *      at most RL_WHEEL_LEVELS - 1 times before it fires.
+ *
+ *   4. Not thread safe: the owner serializes adds, deletes and advances.
+ *
+ */
+
+#ifndef RATE_LIMITER_WHEEL_H
+#define RATE_LIMITER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RL_WHEEL_BITS 6
+#define RL_WHEEL_SIZE (1 << RL_WHEEL_BITS)
+#define RL_WHEEL_MASK (RL_WHEEL_SIZE - 1)
+#define RL_WHEEL_LEVELS 4
+#define RL_WHEEL_SPAN (1ULL << (RL_WHEEL_BITS * RL_WHEEL_LEVELS))
+
+typedef struct rl_timer
+{
+  struct rl_timer* next;
+  struct rl_timer** pprev; /* NULL when not armed */
+  uint64_t expires;        /* Tick                 */
+  void* data;
+} rl_timer_t;
+
+typedef struct
+{
+  uint64_t now; /* next tick to process */
+  rl_timer_t* slots[RL_WHEEL_LEVELS][RL_WHEEL_SIZE];
+} rl_wheel_t;
+
+typedef void (*rl_timer_fn)(rl_timer_t* t, uint64_t now, void* arg);
+
+static inline void
+rl_wheel_init(rl_wheel_t* w, uint64_t now)
+{
+  for (int l = 0; l < RL_WHEEL_LEVELS; l++) {
+    for (int s = 0; s < RL_WHEEL_SIZE; s++)
+      w->slots[l][s] = NULL;
+  }
+  w->now = now;
+}
+
+static inline void
+rl_timer_init(rl_timer_t* t, void* data)
+{
+  t->next = NULL;
+  t->pprev = NULL;
+  t->expires = 0;
+  t->data = data;
+}
+
+static inline int
+rl_timer_armed(const rl_timer_t* t)
+{
+  return NULL != t->pprev;
+}
+
+static inline void
+rl_wheel_file(rl_wheel_t* w, rl_timer_t* t)
+{
+  uint64_t expires = t->expires, delta;
+  rl_timer_t** slot;
+  int l;
+
+  if (expires < w->now)
+    expires = w->now; /* overdue: the next tick */
+  delta = expires - w->now;
+  if (delta >= RL_WHEEL_SPAN)
+    expires = w->now + RL_WHEEL_SPAN - 1; /* re-filed on cascade */
+
+  for (l = 0; l < RL_WHEEL_LEVELS - 1; l++) {
+    if (delta < (1ULL << (RL_WHEEL_BITS * (l + 1))))
+      break;
+  }
+  slot = &w->slots[l][(expires >> (RL_WHEEL_BITS * l)) & RL_WHEEL_MASK];
+
+  t->next = *slot;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+}
+
+static inline void
+rl_wheel_del(rl_timer_t* t)
+{
+  if (!rl_timer_armed(t))
+    return;
+
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+/* Arm t to fire at tick expires, moving it if armed already */
+static inline void
+rl_wheel_add(rl_wheel_t* w, rl_timer_t* t, uint64_t expires)
+{
+  rl_wheel_del(t);
+  t->expires = expires;
+  rl_wheel_file(w, t);
+}
+
+/* Move the list of slot from to the empty list to */
+static inline void
+rl_wheel_splice(rl_timer_t** from, rl_timer_t** to)
+{
+  *to = *from;
+  *from = NULL;
+  if (*to)
+    (*to)->pprev = to;
+}
+
+/*
+ * Fire every timer due up to and including tick now, in tick order.
+ * fn may re-arm or delete any timer, including the one it was given;
+ * timers re-armed for a tick already processed fire on the next one.
+ * Returns the number of timers fired.
+ */
+static inline unsigned long
+rl_wheel_advance(rl_wheel_t* w, uint64_t now, rl_timer_fn fn, void* arg)
+{
+  rl_timer_t *due, *t;
+  unsigned long fired = 0;
+  unsigned int idx;
+  uint64_t tick;
+
+  while (w->now <= now) {
+    tick = w->now;
+
+    /* level 0 wrapped: bring the next slot of each level down */
+    for (int l = 1; l < RL_WHEEL_LEVELS; l++) {
+      if (tick & ((1ULL << (RL_WHEEL_BITS * l)) - 1))
+        break;
+      idx = (tick >> (RL_WHEEL_BITS * l)) & RL_WHEEL_MASK;
+      rl_wheel_splice(&w->slots[l][idx], &due);
+      while (NULL != (t = due)) {
+        rl_wheel_del(t);
+        rl_wheel_file(w, t);
+      }
+    }
+
+    rl_wheel_splice(&w->slots[0][tick & RL_WHEEL_MASK], &due);
+    w->now = tick + 1;
+    while (NULL != (t = due)) {
+      rl_wheel_del(t);
+      fn(t, tick, arg);
+      fired++;
+    }
+  }
+
+  return fired;
+}
+
+#endif /* RATE_LIMITER_WHEEL_H */
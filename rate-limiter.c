@@ -13,8 +13,31 @@
  *      a) Single queue with nodes containing tenant_id
  *      b) AVL / RB Trees based on tenant_id containing a single queue
  *
+ *   2. Decisions, expirations, tenant creation and teardown fire USDT
+ *      probes (rate-limiter-probes.h), with the address of the tenant's
+ *      queue slot as tenant; expirations are printed only with DEBUG.
+ *
+ *   3. With -DAPPROX, the queues are replaced by two counters per tenant
+ *      and a fixed point interpolation between windows, see the
+ *      approximate mode section below.
+ *
+ *   4. Every queue has a timer on a hierarchical timing wheel
+ *      (rate-limiter-wheel.h), armed for when its head leaves the
+ *      window. expire_tenants() advances the wheel to the current time:
+ *      a due tenant has its expired requests dropped and is re-armed
+ *      for its next head, or, once empty, for IDLE_TIMEOUT after its
+ *      last admission, when its queue is freed. Maintenance costs O(1)
+ *      per event and per tick, with no scan of the tenant table, and
+ *      admissions never touch the wheel. check_tenant_allowed() still
+ *      expires lazily, so decisions stay exact between ticks.
+ *
+ *   5. In queue mode decisions, expirations and reclaimed tenants are
+ *      counted with rate-limiter-stats.h and dumped in OpenMetrics text
+ *      at exit.
+ *
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,16 +45,22 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "rate-limiter-probes.h"
+#include "rate-limiter-stats.h"
+#include "rate-limiter-wheel.h"
+
 #define SUCCESS 0
 #define FAILURE 1
 
 #define MAX_TENANTS 100   /* Active tenants       */
 #define WINDOW_SIZE 10000 /* Miliseconds (10s)    */
 #define MAX_REQ 10        /* 10ms service rate    */
+#define IDLE_TIMEOUT 15000 /* Miliseconds (15s)    */
 
 #define TEST_NUM_TENANTS 3
 #define TEST_MAX_REQUESTS 200
 #define TEST_REQ_DELAY 200000
+#define TEST_IDLE_TENANTS 50 /* one request each, then idle */
 
 /* Dequeue implementation (Ideally should be separate files) */
 
@@ -48,6 +77,9 @@ typedef struct
   qnode_t* head;
   qnode_t* tail;
   unsigned int size;
+  long blocked_until; /* denied until the head leaves the window */
+  long last;          /* latest admission */
+  rl_timer_t timer;   /* head expiry or idle reclamation */
 } queue_t;
 
 qnode_t*
@@ -74,6 +106,7 @@ initialize_queue(queue_t** q, long data)
     return FAILURE;
 
   (*q)->size = 1;
+  (*q)->blocked_until = 0;
   return SUCCESS;
 }
 
@@ -152,19 +185,282 @@ get_current_time_ms()
   return (tv.tv_sec * 1000L) + (tv.tv_usec / 1000);
 }
 
+#ifdef APPROX
+/*
+ * Approximate mode
+ *
+ * A tenant only counts its admissions in its current fixed window (cur)
+ * and in the one before (prev). The sliding window count is estimated
+ * as
+ *   cur + prev * (1 - elapsed / WINDOW_SIZE)
+ * where elapsed is the time since the current window started, i.e. the
+ * admissions of the previous window are assumed to be evenly spread.
+ *
+ * The estimate is computed in 32.32 fixed point: elapsed / WINDOW_SIZE
+ * is elapsed * APPROX_RECIP, a reciprocal fixed at compile time, so a
+ * decision needs neither floating point nor a division. The reciprocal
+ * is rounded down, so the weight of prev is never too small and the
+ * estimate only ever errs towards denying, by less than
+ *   prev * WINDOW_SIZE / 2^32
+ * requests (2.3e-5 with the defaults). approx_self_check() verifies
+ * this bound against a floating point reference for every state, as
+ * does every decision with DEBUG.
+ */
+
+#define APPROX_ONE (1ULL << 32)
+#define APPROX_RECIP (APPROX_ONE / WINDOW_SIZE)
+#define APPROX_LIMIT ((uint64_t)MAX_REQ << 32)
+
+_Static_assert(MAX_REQ < (1U << 31), "estimates must fit 32.32 fixed point");
+
+typedef struct
+{
+  long start; /* of the current window */
+  uint32_t prev;
+  uint32_t cur;
+  long blocked_until; /* denied until the estimate drops below MAX_REQ */
+} approx_t;
+
+/* cur + prev * (1 - elapsed / WINDOW_SIZE), in 32.32 fixed point */
+static inline uint64_t
+approx_estimate(uint32_t prev, uint32_t cur, long elapsed)
+{
+  return ((uint64_t)cur << 32) +
+         prev * (APPROX_ONE - (uint64_t)elapsed * APPROX_RECIP);
+}
+
+static inline void
+approx_roll(approx_t* w, long timestamp)
+{
+  long elapsed = timestamp - w->start;
+
+  if (elapsed < WINDOW_SIZE)
+    return;
+  if (elapsed < 2 * WINDOW_SIZE) {
+    w->prev = w->cur;
+    w->start += WINDOW_SIZE;
+  } else {
+    w->prev = 0; /* idle for a whole window */
+    w->start = timestamp;
+  }
+  w->cur = 0;
+}
+
+/*
+ * Smallest elapsed at which approx_estimate(prev, cur, elapsed) drops
+ * below MAX_REQ, for prev + cur >= MAX_REQ and cur < MAX_REQ. This
+ * divides, but only runs when a tenant becomes blocked; until then it
+ * is denied on blocked_until.
+ */
+static long
+approx_wait(uint32_t prev, uint32_t cur)
+{
+  uint64_t excess = (uint64_t)(prev + cur - MAX_REQ) << 32;
+
+  return excess / (prev * APPROX_RECIP) + 1;
+}
+
+/* When a denied tenant is admitted again, if nothing else is admitted */
+static long
+approx_open_at(const approx_t* w)
+{
+  long wait;
+
+  if (w->cur >= MAX_REQ) /* after the roll, prev = cur and cur = 0 */
+    return w->start + WINDOW_SIZE + approx_wait(w->cur, 0);
+
+  wait = approx_wait(w->prev, w->cur);
+  return w->start + (wait < WINDOW_SIZE ? wait : WINDOW_SIZE);
+}
+
+/* Error of the fixed point estimate against floating point, in requests */
+static double
+approx_error(uint32_t prev, uint32_t cur, long elapsed)
+{
+  double exact = cur + prev * (1.0 - (double)elapsed / WINDOW_SIZE);
+
+  return (double)approx_estimate(prev, cur, elapsed) / APPROX_ONE - exact;
+}
+
+static int
+approx_error_ok(uint32_t prev, double error)
+{
+  /* plus a margin for the rounding of the reference itself */
+  return error >= -1e-9 && error <= prev * (double)WINDOW_SIZE / APPROX_ONE;
+}
+
+/*
+ * On FAILURE, *retry_after is set to the miliseconds until the estimate
+ * drops below MAX_REQ (0 on SUCCESS).
+ */
+int
+check_tenant_allowed(approx_t* w, long timestamp, long* retry_after)
+{
+  if (timestamp < w->blocked_until) {
+    *retry_after = w->blocked_until - timestamp;
+    RL_PROBE3(deny, w, timestamp, *retry_after);
+    return FAILURE;
+  }
+
+  approx_roll(w, timestamp);
+#if DEBUG
+  if (!approx_error_ok(w->prev,
+                       approx_error(w->prev, w->cur, timestamp - w->start))) {
+    fprintf(stderr, "approximation error out of bounds\n");
+    abort();
+  }
+#endif
+  if (approx_estimate(w->prev, w->cur, timestamp - w->start) < APPROX_LIMIT) {
+    w->cur++;
+    *retry_after = 0;
+    RL_PROBE3(admit, w, timestamp, w->cur);
+    return SUCCESS;
+  }
+
+  w->blocked_until = approx_open_at(w);
+  *retry_after = w->blocked_until - timestamp;
+  RL_PROBE3(deny, w, timestamp, *retry_after);
+  return FAILURE;
+}
+
+/*
+ * Checks every (prev, cur, elapsed) state: the error bound against the
+ * floating point estimate, how many decisions differ from floating
+ * point, and that approx_wait() is the first admitting elapsed.
+ */
+int
+approx_self_check(void)
+{
+  unsigned long states = 0, differ = 0, bad_bound = 0, bad_wait = 0;
+  double error, max_error = 0;
+  long first;
+
+  for (uint32_t prev = 0; prev <= MAX_REQ; prev++) {
+    for (uint32_t cur = 0; cur < MAX_REQ; cur++) {
+      first = -1;
+      for (long elapsed = 0; elapsed < WINDOW_SIZE; elapsed++) {
+        error = approx_error(prev, cur, elapsed);
+        max_error = error > max_error ? error : max_error;
+        bad_bound += !approx_error_ok(prev, error);
+        differ += (approx_estimate(prev, cur, elapsed) < APPROX_LIMIT) !=
+                  (cur + prev * (1.0 - (double)elapsed / WINDOW_SIZE) <
+                   MAX_REQ);
+        if (first < 0 && approx_estimate(prev, cur, elapsed) < APPROX_LIMIT)
+          first = elapsed;
+        states++;
+      }
+      if (prev + cur >= MAX_REQ && first > 0)
+        bad_wait += approx_wait(prev, cur) != first;
+    }
+  }
+
+  printf("approx: %lu states, max error %.3g requests (bound %.3g), "
+         "%lu decisions differ from floating point, %lu bound violations, "
+         "%lu wrong retry-after\n",
+         states,
+         max_error,
+         MAX_REQ * (double)WINDOW_SIZE / APPROX_ONE,
+         differ,
+         bad_bound,
+         bad_wait);
+
+  return 0 == bad_bound && 0 == bad_wait ? SUCCESS : FAILURE;
+}
+#else
+/*
+ * Background expiry
+ *
+ * The wheel ticks in miliseconds. A queue's timer is armed when the
+ * queue is created and is then kept armed by expire_tenant() until the
+ * queue is freed; its data is the tenant's queue slot.
+ */
+
+static rl_wheel_t wheel;
+static rl_stats_t stats = { .engine = "st",
+                            .nclasses = 1,
+                            .class_names = { "default" } };
+
+static void
+expire_tenant(rl_timer_t* t, uint64_t now, void* arg)
+{
+  queue_t** q = (queue_t**)t->data;
+  long expired;
+
+  (void)arg;
+  while ((*q)->head && ((long)now - (*q)->head->data >= WINDOW_SIZE)) {
+    expired = dequeue(q);
+    rl_stats_inc(&stats, 0, RL_STAT_EXPIRED);
+    RL_PROBE3(expire, q, expired, (long)now - expired);
+  }
+
+  if ((*q)->head) {
+    rl_wheel_add(&wheel, t, (*q)->head->data + WINDOW_SIZE);
+  } else if ((long)now - (*q)->last < IDLE_TIMEOUT) {
+    rl_wheel_add(&wheel, t, (*q)->last + IDLE_TIMEOUT);
+  } else {
+    RL_PROBE2(evict, q, 0);
+    destroy_queue(*q);
+    *q = NULL;
+    rl_stats_inc(&stats, 0, RL_STAT_EVICTED);
+  }
+}
+
+/* Run the expiry and reclamation due up to timestamp */
+void
+expire_tenants(long timestamp)
+{
+  rl_wheel_advance(&wheel, timestamp, expire_tenant, NULL);
+}
+
+/*
+ * On FAILURE, *retry_after is set to the miliseconds until the oldest
+ * request leaves the window (0 on SUCCESS). Until then the tenant is
+ * denied without walking its queue.
+ */
 int
-check_tenant_allowed(queue_t** q, long timestamp)
+check_tenant_allowed(queue_t** q, long timestamp, long* retry_after)
 {
+  long expired;
+
+  if (*q && timestamp < (*q)->blocked_until) {
+    *retry_after = (*q)->blocked_until - timestamp;
+    RL_PROBE3(deny, q, timestamp, *retry_after);
+    rl_stats_inc(&stats, 0, RL_STAT_DENIED);
+    return FAILURE;
+  }
+
   while (*q && (*q)->head && (timestamp - (*q)->head->data >= WINDOW_SIZE)) {
-    printf("removed expired node (timestamp = %lu)\n", dequeue(q));
+    expired = dequeue(q);
+#if DEBUG
+    printf("removed expired node (timestamp = %lu)\n", expired);
+#endif
+    RL_PROBE3(expire, q, expired, timestamp - expired);
+    rl_stats_inc(&stats, 0, RL_STAT_EXPIRED);
   }
   if (!(*q) || (*q)->size < MAX_REQ) {
-    enqueue(q, get_current_time_ms());
+    if (!(*q)) {
+      RL_PROBE2(create, q, timestamp);
+      if (SUCCESS != enqueue(q, get_current_time_ms()))
+        return FAILURE;
+      rl_timer_init(&(*q)->timer, q);
+      rl_wheel_add(&wheel, &(*q)->timer, (*q)->head->data + WINDOW_SIZE);
+    } else {
+      enqueue(q, get_current_time_ms());
+    }
+    (*q)->last = (*q)->tail->data;
+    *retry_after = 0;
+    RL_PROBE3(admit, q, timestamp, (*q)->size);
+    rl_stats_inc(&stats, 0, RL_STAT_ALLOWED);
     return SUCCESS;
   } else {
+    (*q)->blocked_until = (*q)->head->data + WINDOW_SIZE;
+    *retry_after = (*q)->blocked_until - timestamp;
+    RL_PROBE3(deny, q, timestamp, *retry_after);
+    rl_stats_inc(&stats, 0, RL_STAT_DENIED);
     return FAILURE;
   }
 }
+#endif
 
 int
 main(void)
@@ -173,28 +469,63 @@ main(void)
    * - 200 requests distributed over 3 tenants randomly
    * - 0.2 seconds between requests (5 req/sec)
    * - max rps (per config) 1 req / sec / tenant
+   * - TEST_IDLE_TENANTS more tenants send one request up front and are
+   *   reclaimed in the background once idle (queue mode)
    */
 
   queue_t *tenant_queues[MAX_TENANTS] = { NULL }, *q = NULL;
-  long curr_time_ms = 0;
-  int tenant_id = 0;
+  long curr_time_ms = 0, retry_after = 0;
+  int tenant_id = 0, result;
+#ifdef APPROX
+  static approx_t tenant_windows[MAX_TENANTS];
+
+  if (SUCCESS != approx_self_check())
+    return 1;
+#else
+  int active = 0;
+
+  rl_wheel_init(&wheel, get_current_time_ms());
+  for (int i = 0; i < TEST_IDLE_TENANTS; i++) {
+    check_tenant_allowed(&tenant_queues[TEST_NUM_TENANTS + i],
+                         get_current_time_ms(),
+                         &retry_after);
+  }
+#endif
 
   srand(time(NULL));
 
   for (int i = 0; i <= TEST_MAX_REQUESTS; i++) {
     curr_time_ms = get_current_time_ms();
+#ifndef APPROX
+    expire_tenants(curr_time_ms);
+#endif
 #ifdef RANDOM
     tenant_id = rand() % TEST_NUM_TENANTS;
 #else
     tenant_id = ++tenant_id % TEST_NUM_TENANTS;
 #endif
-    if (SUCCESS ==
-        check_tenant_allowed(&tenant_queues[tenant_id], curr_time_ms)) {
+#ifdef APPROX
+    result = check_tenant_allowed(
+      &tenant_windows[tenant_id], curr_time_ms, &retry_after);
+#else
+    result = check_tenant_allowed(
+      &tenant_queues[tenant_id], curr_time_ms, &retry_after);
+#endif
+    if (SUCCESS == result) {
       printf("Tenant %d - Request allowed: %d\n", tenant_id, i);
     } else {
-      printf("Tenant %d - Request denied: %d\n", tenant_id, i);
+      printf("Tenant %d - Request denied: %d (retry after %ld ms)\n",
+             tenant_id,
+             i,
+             retry_after);
     }
-#if DEBUG
+#if DEBUG && defined(APPROX)
+    printf("\t(curr_time: %lu, start: %lu, prev: %u, cur: %u)\n",
+           curr_time_ms,
+           tenant_windows[tenant_id].start,
+           tenant_windows[tenant_id].prev,
+           tenant_windows[tenant_id].cur);
+#elif DEBUG
     q = tenant_queues[tenant_id];
     printf("\t(curr_time: %lu, q-size: %d, q-head: %lu, q-tail: %lu)\n",
            curr_time_ms,
@@ -205,7 +536,21 @@ main(void)
     usleep(TEST_REQ_DELAY);
   }
 
+#ifndef APPROX
+  for (int i = 0; i < MAX_TENANTS; i++)
+    active += NULL != tenant_queues[i];
+  printf("expired: %lu, tenants reclaimed: %lu, active: %d\n",
+         (unsigned long)rl_stats_sum(&stats, 0, RL_STAT_EXPIRED),
+         (unsigned long)rl_stats_sum(&stats, 0, RL_STAT_EVICTED),
+         active);
+  rl_stats_dump(&stats, stdout, (double)active / MAX_TENANTS);
+#endif
+
   for (int i = 0; i < MAX_TENANTS; i++) {
+    if (tenant_queues[i]) {
+      RL_PROBE2(evict, &tenant_queues[i], tenant_queues[i]->size);
+      rl_wheel_del(&tenant_queues[i]->timer);
+    }
     destroy_queue(tenant_queues[i]);
   }
 
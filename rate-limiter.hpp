@@ -0,0 +1,220 @@
+/***********************************************************************
+ * FILENAME: rate-limiter.hpp
+ *
+ * DESCRIPTION:
+ *   Header-only C++17 sliding window rate limiter with the window, the
+ *   limit and the engine fixed at compile time.
+ *
+ * NOTES:
+ *   1. rl::RateLimiter<Engine, Window, Limit, ClockT> admits at most
+ *      Limit requests per tenant within any Window. Window is a
+ *      std::chrono::duration type whose single tick is the window, e.g.
+ *      std::chrono::seconds or rl::milliseconds<250>. It is converted to
+ *      ClockT ticks at compile time, so every division and modulo by the
+ *      window, a bucket width or Limit is by a constant, which the
+ *      compiler turns into shifts and multiplies, and rings are
+ *      std::arrays of fixed size.
+ *
+ *   2. Engines are policy types, selected statically, with no virtual
+ *      dispatch:
+ *        rl::LogEngine            exact, a ring of Limit timestamps per
+ *                                 tenant, as in rate-limiter-server.c
+ *        rl::BucketEngine<N>      approximate, N + 1 bucket counts per
+ *                                 tenant, as in rate-limiter-striped.c
+ *      An engine provides a nested Tenant<Rep, Window, Limit> with
+ *      bool admit(Rep now, Rep& retry_after) noexcept.
+ *
+ *   3. Each tenant has its own spinlock and caches its blocked-until
+ *      time, so denied tenants are answered with one relaxed load.
+ *      Tenant state is cache line aligned.
+ *
+ *   4. ClockT is any clock with a static now(): std::chrono::steady_clock
+ *      by default, or a manual clock in tests.
+ *
+ *   5. Limits known only at run time keep using the C implementations
+ *      (rate-limiter.c, rate-limiter-mt.c, rl-server).
+ *
+ */
+
+#ifndef RATE_LIMITER_HPP
+#define RATE_LIMITER_HPP
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ratio>
+
+namespace rl {
+
+template<long long Ms>
+using milliseconds = std::chrono::duration<long long, std::ratio<Ms, 1000>>;
+
+template<long long Us>
+using microseconds =
+  std::chrono::duration<long long, std::ratio<Us, 1000000>>;
+
+/* Exact sliding window log: the last Limit admission times */
+struct LogEngine
+{
+  template<typename Rep, Rep Window, std::size_t Limit>
+  struct Tenant
+  {
+    std::array<Rep, Limit> slots{};
+    std::size_t head = 0;
+    std::size_t size = 0;
+
+    bool admit(Rep now, Rep& retry_after) noexcept
+    {
+      while (size && now - slots[head] >= Window) {
+        head = (head + 1) % Limit;
+        size--;
+      }
+      if (size < Limit) {
+        slots[(head + size) % Limit] = now;
+        size++;
+        retry_after = 0;
+        return true;
+      }
+      retry_after = slots[head] + Window - now;
+      return false;
+    }
+  };
+};
+
+/*
+ * Approximate sliding window: admissions counted in Buckets buckets of
+ * Window / Buckets, plus the current one, so the window is exact to
+ * one bucket.
+ */
+template<std::size_t Buckets>
+struct BucketEngine
+{
+  static_assert(Buckets > 0, "at least one bucket");
+
+  template<typename Rep, Rep Window, std::size_t Limit>
+  struct Tenant
+  {
+    static constexpr Rep width = Window / Buckets;
+    static constexpr std::size_t ring = Buckets + 1;
+    static_assert(width > 0, "bucket narrower than a clock tick");
+
+    std::array<std::uint32_t, ring> counts{};
+    std::array<Rep, ring> epochs{};
+
+    bool admit(Rep now, Rep& retry_after) noexcept
+    {
+      Rep e = now / width;
+      std::size_t slot = e % ring;
+      std::uint64_t sum = 0;
+
+      if (epochs[slot] != e) {
+        epochs[slot] = e;
+        counts[slot] = 0;
+      }
+      for (std::size_t i = 0; i < ring; i++) {
+        if (e - epochs[i] < static_cast<Rep>(ring))
+          sum += counts[i];
+      }
+      if (sum < Limit) {
+        counts[slot]++;
+        retry_after = 0;
+        return true;
+      }
+      /* open again once enough of the oldest buckets have retired */
+      Rep b = e - static_cast<Rep>(ring) + 1;
+      for (; b < e; b++) {
+        if (b >= 0 && epochs[b % ring] == b)
+          sum -= counts[b % ring];
+        if (sum < Limit)
+          break;
+      }
+      retry_after = (b + static_cast<Rep>(ring)) * width - now;
+      return false;
+    }
+  };
+};
+
+template<typename Rep>
+struct Decision
+{
+  bool allowed;
+  Rep retry_after; /* zero when allowed */
+
+  explicit operator bool() const noexcept { return allowed; }
+};
+
+template<typename Engine,
+         typename Window,
+         std::size_t Limit,
+         typename ClockT = std::chrono::steady_clock>
+class RateLimiter
+{
+public:
+  using clock = ClockT;
+  using rep = typename ClockT::rep;
+  using duration = typename ClockT::duration;
+  using time_point = typename ClockT::time_point;
+
+  static constexpr rep window =
+    std::chrono::duration_cast<duration>(Window(1)).count();
+  static constexpr std::size_t limit = Limit;
+
+  static_assert(window > 0, "window shorter than a clock tick");
+  static_assert(Limit > 0, "limit must be positive");
+
+  explicit RateLimiter(std::size_t tenants)
+    : tenants_(new TenantSlot[tenants])
+    , ntenants_(tenants)
+  {
+  }
+
+  std::size_t tenants() const noexcept { return ntenants_; }
+
+  Decision<duration> check(std::size_t tenant) noexcept
+  {
+    return check(tenant, clock::now());
+  }
+
+  /* tenant must be below tenants() */
+  Decision<duration> check(std::size_t tenant, time_point now) noexcept
+  {
+    assert(tenant < ntenants_);
+
+    TenantSlot& t = tenants_[tenant];
+    rep ts = now.time_since_epoch().count(), retry_after;
+    rep blocked_until;
+    bool allowed;
+
+    blocked_until = t.blocked_until.load(std::memory_order_relaxed);
+    if (ts < blocked_until)
+      return { false, duration(blocked_until - ts) };
+
+    while (t.lock.test_and_set(std::memory_order_acquire))
+      ;
+    allowed = t.state.admit(ts, retry_after);
+    if (!allowed)
+      t.blocked_until.store(ts + retry_after, std::memory_order_relaxed);
+    t.lock.clear(std::memory_order_release);
+
+    return { allowed, duration(retry_after) };
+  }
+
+private:
+  struct alignas(64) TenantSlot
+  {
+    std::atomic<rep> blocked_until{ 0 };
+    std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    typename Engine::template Tenant<rep, window, Limit> state;
+  };
+
+  std::unique_ptr<TenantSlot[]> tenants_;
+  std::size_t ntenants_;
+};
+
+} // namespace rl
+
+#endif /* RATE_LIMITER_HPP */